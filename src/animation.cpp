@@ -112,13 +112,13 @@ void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4 color, boo
 
 	Shader* shader = Shader::getDefaultShader("flat");
 	shader->enable();
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_model", model);
-	shader->setUniform("u_color", color);
+	shader->setUniform(UNIFORM("u_viewprojection"), camera->viewprojection_matrix);
+	shader->setUniform(UNIFORM("u_model"), model);
+	shader->setUniform(UNIFORM("u_color"), color);
 	m.render(GL_LINES);
 	if (render_points)
 	{
-		shader->setUniform("u_color", color * 2);
+		shader->setUniform(UNIFORM("u_color"), color * 2);
 		glPointSize(10);
 		m.render(GL_POINTS);
 		glPointSize(1);
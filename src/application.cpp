@@ -10,6 +10,8 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "task.h"
+#include "glstate.h"
 
 #include <cmath>
 #include <string>
@@ -36,6 +38,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	must_exit = false;
 	render_debug = true;
 	render_gui = true;
+	tasks_budget = 4000;
 
 	render_wireframe = false;
 
@@ -89,14 +92,18 @@ void Application::render(void)
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//the GUI and other libs change the state behind our back, start every frame from scratch
+	GLState::newFrame();
+	GLState::invalidate();
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
     
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 	if(render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -112,7 +119,7 @@ void Application::render(void)
 	//if(render_debug)
 		//drawGrid();
 
-    glDisable(GL_DEPTH_TEST);
+    GLState::disable(GL_DEPTH_TEST);
     //render anything in the gui after this
 
 	//the swap buffers is done in the main loop after this function
@@ -247,14 +254,27 @@ void Application::renderDebugGUI(void)
 	//System stats
 	ImGui::Text(getGPUStats().c_str());					   // Display some text (you can use a format strings too)
 
+	ImGui::Text("Pending tasks: %d BG / %d FG", TaskManager::background.getNumPending(), TaskManager::foreground.getNumPending());
+	ImGui::Text("GL state calls: %ld (avoided %ld)", GLState::last_frame_calls, GLState::last_frame_avoided);
+	ImGui::SliderInt("Tasks budget (us)", &tasks_budget, 500, 16000);
 	ImGui::Checkbox("Wireframe", &render_wireframe);
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
 	ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
 	ImGui::Combo("1 - Pipeline", (int*)&renderer->pipeline, "Forward\0Deferred", 2);
-	ImGui::Combo("2 - Light mode", (int*)&renderer->light_mode, "Single\0Multi", 2);
+	if (renderer->pipeline == GTR::Renderer::DEFERRED)
+		ImGui::Text("Deferred lights: %d volumes, %d full screen", renderer->deferred_volume_lights, renderer->deferred_fullscreen_lights);
+	ImGui::Combo("2 - Light mode", (int*)&renderer->light_mode, "Single\0Multi\0Clustered", 3);
+	if (renderer->light_mode == GTR::Renderer::CLUSTERED)
+		ImGui::Text("Clustered lights: %d (%d indices)", (int)renderer->light_clusters.lights.size(), (int)renderer->light_clusters.indices.size());
 	ImGui::Checkbox("3 - GBuffers", &renderer->show_gbuffers);
 	ImGui::Checkbox("4 - HDR", &renderer->show_hdr);
 	ImGui::Checkbox("5 - SSAO", &renderer->show_ssao);
+	ImGui::Checkbox("Instancing", &renderer->use_instancing);
+	ImGui::Checkbox("LODs", &renderer->use_lods);
+	ImGui::SliderFloat("LOD error (pixels)", &renderer->lod_pixel_error, 0.0f, 10.0f);
+	ImGui::Checkbox("Cluster culling", &renderer->use_cluster_culling);
+	ImGui::Checkbox("Occlusion culling", &renderer->use_occlusion_culling);
+	ImGui::Text("Occlusion culled: %d of %d calls (%d occluders, %d triangles)", renderer->occlusion_culled_calls, renderer->occlusion_tested_calls, renderer->occlusion_buffer.num_occluders, renderer->occlusion_buffer.num_triangles);
 
 	//LAB3
 	ImGui::Checkbox("6 - Irradiance texture", &renderer->show_probes_texture);
@@ -338,7 +358,7 @@ void Application::onKeyDown( SDL_KeyboardEvent event )
 		case SDLK_F1: render_debug = !render_debug; break;
 		case SDLK_f: camera->center.set(0, 0, 0); camera->updateViewMatrix(); break;
 		case SDLK_1: renderer->pipeline = (renderer->pipeline == GTR::Renderer::FORWARD ? GTR::Renderer::DEFERRED : GTR::Renderer::FORWARD); break;
-		case SDLK_2: renderer->light_mode = (renderer->light_mode == GTR::Renderer::MULTI ? GTR::Renderer::SINGLE : GTR::Renderer::MULTI); break;
+		case SDLK_2: renderer->light_mode = (GTR::Renderer::eLightMode)((renderer->light_mode + 1) % 3); break;
 		case SDLK_3: renderer->show_gbuffers = !renderer->show_gbuffers; break;
 		case SDLK_4: renderer->show_hdr = !renderer->show_hdr; break;
 		case SDLK_5: renderer->show_ssao = !renderer->show_ssao; break;
@@ -380,6 +400,20 @@ void Application::onMouseButtonDown( SDL_MouseButtonEvent event )
 		mouse_locked = !mouse_locked;
 		SDL_ShowCursor(!mouse_locked);
 	}
+
+	if (event.button == SDL_BUTTON_LEFT) //pick the entity under the mouse
+	{
+#ifndef SKIP_IMGUI
+		if (ImGui::GetIO().WantCaptureMouse || ImGuizmo::IsOver())
+			return;
+#endif
+		Vector3 direction = camera->getRayDirection(event.x, event.y, (float)window_width, (float)window_height);
+		Vector3 collision;
+		scene->updateBVH();
+		GTR::BaseEntity* entity = scene->testRayCollision(camera->eye, direction, collision, camera->far_plane);
+		if (entity)
+			selected_entity = entity;
+	}
 }
 
 void Application::onMouseButtonUp(SDL_MouseButtonEvent event)
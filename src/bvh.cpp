@@ -0,0 +1,367 @@
+#include "bvh.h"
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+static inline float surfaceArea(const Vector3& min, const Vector3& max)
+{
+	Vector3 size = max - min;
+	return size.x * size.y + size.y * size.z + size.z * size.x; //half of it, only used to compare
+}
+
+static inline float unionArea(const BVH::sNode& a, const BVH::sNode& b)
+{
+	Vector3 min = a.min; min.setMin(b.min);
+	Vector3 max = a.max; max.setMax(b.max);
+	return surfaceArea(min, max);
+}
+
+BVH::BVH(float margin)
+{
+	this->margin = margin;
+	root = -1;
+	free_list = -1;
+	num_leaves = 0;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	root = -1;
+	free_list = -1;
+	num_leaves = 0;
+}
+
+int BVH::allocateNode()
+{
+	int node = free_list;
+	if (node == -1)
+	{
+		node = (int)nodes.size();
+		nodes.push_back(sNode());
+	}
+	else
+		free_list = nodes[node].parent;
+	sNode& n = nodes[node];
+	n.parent = -1;
+	n.children[0] = n.children[1] = -1;
+	n.height = 0;
+	n.data = NULL;
+	return node;
+}
+
+void BVH::freeNode(int node)
+{
+	nodes[node].parent = free_list;
+	nodes[node].height = -1;
+	free_list = node;
+}
+
+int BVH::insert(const BoundingBox& box, void* data)
+{
+	int leaf = allocateNode();
+	sNode& n = nodes[leaf];
+	Vector3 fat = box.halfsize * (1.0f + margin);
+	n.min = box.center - fat;
+	n.max = box.center + fat;
+	n.data = data;
+	insertLeaf(leaf);
+	num_leaves++;
+	return leaf;
+}
+
+void BVH::remove(int leaf)
+{
+	assert(leaf >= 0 && leaf < nodes.size() && nodes[leaf].isLeaf() && nodes[leaf].height == 0);
+	removeLeaf(leaf);
+	freeNode(leaf);
+	num_leaves--;
+}
+
+bool BVH::update(int leaf, const BoundingBox& box)
+{
+	sNode& n = nodes[leaf];
+	Vector3 min = box.center - box.halfsize;
+	Vector3 max = box.center + box.halfsize;
+	if (n.min.x <= min.x && n.min.y <= min.y && n.min.z <= min.z && n.max.x >= max.x && n.max.y >= max.y && n.max.z >= max.z)
+		return false;
+
+	removeLeaf(leaf);
+	Vector3 fat = box.halfsize * (1.0f + margin);
+	nodes[leaf].min = box.center - fat;
+	nodes[leaf].max = box.center + fat;
+	insertLeaf(leaf);
+	return true;
+}
+
+void BVH::refit(int node)
+{
+	sNode& n = nodes[node];
+	const sNode& a = nodes[n.children[0]];
+	const sNode& b = nodes[n.children[1]];
+	n.min = a.min; n.min.setMin(b.min);
+	n.max = a.max; n.max.setMax(b.max);
+	n.height = 1 + std::max(a.height, b.height);
+}
+
+void BVH::insertLeaf(int leaf)
+{
+	if (root == -1)
+	{
+		root = leaf;
+		nodes[leaf].parent = -1;
+		return;
+	}
+
+	//go down to the sibling where the leaf increases less the area of the tree
+	int index = root;
+	while (!nodes[index].isLeaf())
+	{
+		const sNode& n = nodes[index];
+		float area = surfaceArea(n.min, n.max);
+		float combined_area = unionArea(n, nodes[leaf]);
+		float cost = 2.0f * combined_area; //making a new parent of this node and the leaf
+		float inheritance_cost = 2.0f * (combined_area - area); //what the ancestors grow if we go down
+
+		float child_costs[2];
+		for (int i = 0; i < 2; ++i)
+		{
+			const sNode& child = nodes[n.children[i]];
+			child_costs[i] = unionArea(child, nodes[leaf]) + inheritance_cost;
+			if (!child.isLeaf())
+				child_costs[i] -= surfaceArea(child.min, child.max);
+		}
+
+		if (cost < child_costs[0] && cost < child_costs[1])
+			break;
+		index = child_costs[0] < child_costs[1] ? n.children[0] : n.children[1];
+	}
+	int sibling = index;
+
+	//new parent of the sibling and the leaf
+	int old_parent = nodes[sibling].parent;
+	int new_parent = allocateNode();
+	sNode& p = nodes[new_parent];
+	p.parent = old_parent;
+	p.children[0] = sibling;
+	p.children[1] = leaf;
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+	if (old_parent == -1)
+		root = new_parent;
+	else
+	{
+		sNode& op = nodes[old_parent];
+		op.children[op.children[0] == sibling ? 0 : 1] = new_parent;
+	}
+
+	//fix the boxes and heights up to the root
+	for (index = new_parent; index != -1; index = nodes[index].parent)
+	{
+		index = balance(index);
+		refit(index);
+	}
+}
+
+void BVH::removeLeaf(int leaf)
+{
+	if (leaf == root)
+	{
+		root = -1;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grand_parent = nodes[parent].parent;
+	int sibling = nodes[parent].children[nodes[parent].children[0] == leaf ? 1 : 0];
+
+	//the sibling takes the place of the parent
+	if (grand_parent == -1)
+	{
+		root = sibling;
+		nodes[sibling].parent = -1;
+		freeNode(parent);
+		return;
+	}
+
+	sNode& gp = nodes[grand_parent];
+	gp.children[gp.children[0] == parent ? 0 : 1] = sibling;
+	nodes[sibling].parent = grand_parent;
+	freeNode(parent);
+
+	for (int index = grand_parent; index != -1; index = nodes[index].parent)
+	{
+		index = balance(index);
+		refit(index);
+	}
+}
+
+//if a child is more than one level taller than the other it is rotated up
+int BVH::balance(int a)
+{
+	sNode& A = nodes[a];
+	if (A.isLeaf() || A.height < 2)
+		return a;
+
+	int difference = nodes[A.children[1]].height - nodes[A.children[0]].height;
+	if (difference >= -1 && difference <= 1)
+		return a;
+
+	int slot = difference > 1 ? 1 : 0; //the taller child goes up, the other one stays in A
+	int c = A.children[slot];
+	sNode& C = nodes[c];
+	int f = C.children[0];
+	int g = C.children[1];
+
+	//C takes the place of A and A becomes its child
+	C.children[0] = a;
+	C.parent = A.parent;
+	A.parent = c;
+	if (C.parent == -1)
+		root = c;
+	else
+	{
+		sNode& parent = nodes[C.parent];
+		parent.children[parent.children[0] == a ? 0 : 1] = c;
+	}
+
+	//the taller grandchild stays in C, the other goes to A
+	if (nodes[f].height > nodes[g].height)
+		std::swap(f, g);
+	C.children[1] = g;
+	A.children[slot] = f;
+	nodes[f].parent = a;
+
+	refit(a);
+	refit(c);
+	return c;
+}
+
+void BVH::addSubtree(int node, std::vector<void*>& result) const
+{
+	const sNode& n = nodes[node];
+	if (n.isLeaf())
+	{
+		result.push_back(n.data);
+		return;
+	}
+	addSubtree(n.children[0], result);
+	addSubtree(n.children[1], result);
+}
+
+void BVH::queryFrustum(const float planes[6][4], std::vector<void*>& result) const
+{
+	if (root == -1)
+		return;
+
+	//every entry has the planes that still have to be tested, the nodes inside a plane do not test it again
+	struct sEntry { int node; int mask; };
+	std::vector<sEntry> stack;
+	stack.reserve(64);
+	sEntry first = { root, 63 };
+	stack.push_back(first);
+
+	while (!stack.empty())
+	{
+		sEntry entry = stack.back();
+		stack.pop_back();
+		const sNode& n = nodes[entry.node];
+		Vector3 center = (n.min + n.max) * 0.5f;
+		Vector3 halfsize = (n.max - n.min) * 0.5f;
+
+		int mask = entry.mask;
+		bool outside = false;
+		for (int i = 0; i < 6 && !outside; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			const float* p = planes[i];
+			float distance = p[0] * center.x + p[1] * center.y + p[2] * center.z + p[3];
+			float radius = fabsf(p[0]) * halfsize.x + fabsf(p[1]) * halfsize.y + fabsf(p[2]) * halfsize.z;
+			if (distance <= -radius)
+				outside = true;
+			else if (distance >= radius)
+				mask &= ~(1 << i);
+		}
+		if (outside)
+			continue;
+
+		if (!mask)
+			addSubtree(entry.node, result);
+		else if (n.isLeaf())
+			result.push_back(n.data);
+		else
+		{
+			sEntry a = { n.children[0], mask };
+			sEntry b = { n.children[1], mask };
+			stack.push_back(a);
+			stack.push_back(b);
+		}
+	}
+}
+
+void BVH::queryBox(const BoundingBox& box, std::vector<void*>& result) const
+{
+	if (root == -1)
+		return;
+	Vector3 min = box.center - box.halfsize;
+	Vector3 max = box.center + box.halfsize;
+
+	std::vector<int> stack;
+	stack.reserve(64);
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		const sNode& n = nodes[stack.back()];
+		stack.pop_back();
+		if (n.min.x > max.x || n.min.y > max.y || n.min.z > max.z || n.max.x < min.x || n.max.y < min.y || n.max.z < min.z)
+			continue;
+		if (n.isLeaf())
+			result.push_back(n.data);
+		else
+		{
+			stack.push_back(n.children[0]);
+			stack.push_back(n.children[1]);
+		}
+	}
+}
+
+void BVH::queryRay(const Vector3& origin, const Vector3& direction, float max_dist, std::vector<void*>& result) const
+{
+	if (root == -1)
+		return;
+	//slab test, infinities work for the axis the ray does not move in
+	Vector3 inv(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+
+	std::vector<int> stack;
+	stack.reserve(64);
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		const sNode& n = nodes[stack.back()];
+		stack.pop_back();
+
+		float t0 = 0.0f;
+		float t1 = max_dist;
+		for (int i = 0; i < 3; ++i)
+		{
+			float near_t = (n.min.v[i] - origin.v[i]) * inv.v[i];
+			float far_t = (n.max.v[i] - origin.v[i]) * inv.v[i];
+			if (near_t > far_t)
+				std::swap(near_t, far_t);
+			t0 = near_t > t0 ? near_t : t0; //written like this so a NaN keeps the previous value
+			t1 = far_t < t1 ? far_t : t1;
+		}
+		if (t0 > t1)
+			continue;
+
+		if (n.isLeaf())
+			result.push_back(n.data);
+		else
+		{
+			stack.push_back(n.children[0]);
+			stack.push_back(n.children[1]);
+		}
+	}
+}
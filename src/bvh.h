@@ -0,0 +1,62 @@
+/*
+	Dynamic bounding volume hierarchy of AABBs (like the broadphase trees of Box2D or Bullet).
+	The leaves store a fat box (enlarged by a margin) so small movements do not change the tree,
+	they are only reinserted when the new box gets out of the fat one. Insertions choose the branch
+	where the surface area grows less and rotations keep the tree balanced, so queries only visit
+	the branches that overlap (the cost depends on the results, not on the number of leaves).
+*/
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include "framework.h"
+
+class BVH
+{
+public:
+	struct sNode {
+		Vector3 min;
+		Vector3 max;
+		int parent;
+		int children[2]; //-1 in the leaves
+		int height; //0 in the leaves, -1 if the node is free
+		void* data; //only in the leaves
+
+		bool isLeaf() const { return children[0] == -1; }
+	};
+
+	std::vector<sNode> nodes;
+	int root;
+	float margin; //fraction of the size of the box added to every side of the leaves
+
+	BVH(float margin = 0.1f);
+	void clear();
+
+	int insert(const BoundingBox& box, void* data); //returns the id of the leaf
+	void remove(int leaf);
+	bool update(int leaf, const BoundingBox& box); //returns true if the leaf had to be moved in the tree
+	void* getData(int leaf) const { return nodes[leaf].data; }
+	int getNumLeaves() const { return num_leaves; }
+	int getHeight() const { return root == -1 ? 0 : nodes[root].height; }
+
+	//queries append the data of the leaves whose fat box overlaps, the caller must test the real bounds.
+	//The planes point inside, like the ones of the camera
+	void queryFrustum(const float planes[6][4], std::vector<void*>& result) const;
+	void queryBox(const BoundingBox& box, std::vector<void*>& result) const;
+	void queryRay(const Vector3& origin, const Vector3& direction, float max_dist, std::vector<void*>& result) const;
+
+private:
+	int free_list; //free nodes are linked with parent
+	int num_leaves;
+
+	int allocateNode();
+	void freeNode(int node);
+	void insertLeaf(int leaf);
+	void removeLeaf(int leaf);
+	void refit(int node); //box and height from its children
+	int balance(int node); //returns the node that takes its place
+	void addSubtree(int node, std::vector<void*>& result) const;
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include "clustering.h"
+#include "culling.h"
+#include "camera.h"
+#include "task.h"
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#ifdef CULLING_SSE
+	#include <emmintrin.h>
+#endif
+
+static_assert(CLUSTERS_PER_SLICE % 32 == 0, "the clusters of a slice are stored in masks of 32 bits");
+
+#define CLUSTER_MASK_WORDS (CLUSTERS_PER_SLICE / 32)
+
+LightClusters::LightClusters()
+{
+	near_plane = far_plane = 0.0f;
+	fov = aspect = 0.0f;
+	slice_scale = 0.0f;
+	grid.resize(NUM_CLUSTERS * 2, 0);
+	slice_bins.resize(CLUSTERS_Z);
+}
+
+void LightClusters::begin(Camera* camera)
+{
+	assert(camera->type == Camera::PERSPECTIVE && "clusters need a perspective camera");
+	view = camera->view_matrix;
+	if (camera->fov != fov || camera->aspect != aspect || camera->near_plane != near_plane || camera->far_plane != far_plane)
+	{
+		fov = camera->fov;
+		aspect = camera->aspect;
+		near_plane = camera->near_plane;
+		far_plane = camera->far_plane;
+		computeBounds();
+	}
+	lights.clear();
+}
+
+void LightClusters::addPointLight(const Vector3& position, float radius)
+{
+	sLight light;
+	light.position = position;
+	light.radius = radius;
+	light.cos_angle = -1.0f;
+	light.sin_angle = 0.0f;
+	light.spot = false;
+	lights.push_back(light);
+}
+
+void LightClusters::addSpotLight(const Vector3& position, float radius, const Vector3& direction, float cone_angle)
+{
+	sLight light;
+	light.position = position;
+	light.radius = radius;
+	light.direction = direction;
+	light.direction.normalize();
+	light.cos_angle = cos(cone_angle * DEG2RAD);
+	light.sin_angle = sin(cone_angle * DEG2RAD);
+	light.spot = true;
+	lights.push_back(light);
+}
+
+int LightClusters::getSlice(float depth) const
+{
+	if (depth <= near_plane)
+		return 0;
+	int slice = (int)floor(log(depth / near_plane) * slice_scale);
+	return std::min(std::max(slice, 0), CLUSTERS_Z - 1);
+}
+
+//the camera looks to -z in view space, the corners of a tile at a depth are its corners in NDC scaled by the depth
+void LightClusters::computeBounds()
+{
+	min_x.resize(NUM_CLUSTERS); min_y.resize(NUM_CLUSTERS); min_z.resize(NUM_CLUSTERS);
+	max_x.resize(NUM_CLUSTERS); max_y.resize(NUM_CLUSTERS); max_z.resize(NUM_CLUSTERS);
+	sphere_x.resize(NUM_CLUSTERS); sphere_y.resize(NUM_CLUSTERS); sphere_z.resize(NUM_CLUSTERS); sphere_radius.resize(NUM_CLUSTERS);
+
+	float tan_y = tan(fov * 0.5f * DEG2RAD);
+	float tan_x = tan_y * aspect;
+	slice_scale = CLUSTERS_Z / log(far_plane / near_plane);
+
+	for (int z = 0; z < CLUSTERS_Z; ++z)
+	{
+		float depth0 = near_plane * pow(far_plane / near_plane, z / (float)CLUSTERS_Z);
+		float depth1 = near_plane * pow(far_plane / near_plane, (z + 1) / (float)CLUSTERS_Z);
+		for (int y = 0; y < CLUSTERS_Y; ++y)
+		{
+			float y0 = -1.0f + 2.0f * y / CLUSTERS_Y;
+			float y1 = -1.0f + 2.0f * (y + 1) / CLUSTERS_Y;
+			for (int x = 0; x < CLUSTERS_X; ++x)
+			{
+				float x0 = -1.0f + 2.0f * x / CLUSTERS_X;
+				float x1 = -1.0f + 2.0f * (x + 1) / CLUSTERS_X;
+				int c = getCluster(x, y, z);
+				min_x[c] = std::min(x0 * depth0, x0 * depth1) * tan_x;
+				max_x[c] = std::max(x1 * depth0, x1 * depth1) * tan_x;
+				min_y[c] = std::min(y0 * depth0, y0 * depth1) * tan_y;
+				max_y[c] = std::max(y1 * depth0, y1 * depth1) * tan_y;
+				min_z[c] = -depth1;
+				max_z[c] = -depth0;
+
+				//the sphere around the box, for the cones
+				Vector3 halfsize((max_x[c] - min_x[c]) * 0.5f, (max_y[c] - min_y[c]) * 0.5f, (max_z[c] - min_z[c]) * 0.5f);
+				sphere_x[c] = min_x[c] + halfsize.x;
+				sphere_y[c] = min_y[c] + halfsize.y;
+				sphere_z[c] = min_z[c] + halfsize.z;
+				sphere_radius[c] = halfsize.length();
+			}
+		}
+	}
+}
+
+void LightClusters::prepareLights()
+{
+	view_lights.resize(lights.size());
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		const sLight& light = lights[i];
+		sViewLight& view_light = view_lights[i];
+		view_light.position = view * light.position;
+		view_light.radius = light.radius;
+		view_light.direction = view.rotateVector(light.direction);
+
+		//slices touched by the sphere, none if it is out of the depth range
+		float depth = -view_light.position.z;
+		if (depth + light.radius < near_plane || depth - light.radius > far_plane)
+		{
+			view_light.min_slice = 1;
+			view_light.max_slice = 0;
+			continue;
+		}
+		view_light.min_slice = getSlice(depth - light.radius);
+		view_light.max_slice = getSlice(depth + light.radius);
+	}
+}
+
+//sphere vs box of every cluster, and for the spots the cone vs the sphere of the cluster
+//(the cone test is from Bart Wronski, "Cull that cone!")
+static void testClustersScalar(const float* light, bool spot, const float* const* bounds, uint32* mask)
+{
+	float px = light[0], py = light[1], pz = light[2], radius = light[3];
+	float dir_x = light[4], dir_y = light[5], dir_z = light[6], cos_angle = light[7], sin_angle = light[8];
+	memset(mask, 0, CLUSTER_MASK_WORDS * sizeof(uint32));
+	for (int c = 0; c < CLUSTERS_PER_SLICE; ++c)
+	{
+		float dx = std::max(bounds[0][c] - px, 0.0f) + std::max(px - bounds[3][c], 0.0f);
+		float dy = std::max(bounds[1][c] - py, 0.0f) + std::max(py - bounds[4][c], 0.0f);
+		float dz = std::max(bounds[2][c] - pz, 0.0f) + std::max(pz - bounds[5][c], 0.0f);
+		bool inside = dx * dx + dy * dy + dz * dz <= radius * radius;
+		if (inside && spot)
+		{
+			float vx = bounds[6][c] - px, vy = bounds[7][c] - py, vz = bounds[8][c] - pz;
+			float sphere_radius = bounds[9][c];
+			float length2 = vx * vx + vy * vy + vz * vz;
+			float along = vx * dir_x + vy * dir_y + vz * dir_z;
+			float closest = cos_angle * sqrtf(std::max(length2 - along * along, 0.0f)) - along * sin_angle;
+			inside = closest <= sphere_radius && along <= sphere_radius + radius && along >= -sphere_radius;
+		}
+		if (inside)
+			mask[c >> 5] |= 1u << (c & 31);
+	}
+}
+
+#ifdef CULLING_SSE
+static void testClustersSSE(const float* light, bool spot, const float* const* bounds, uint32* mask)
+{
+	const __m128 zero = _mm_setzero_ps();
+	__m128 px = _mm_set1_ps(light[0]), py = _mm_set1_ps(light[1]), pz = _mm_set1_ps(light[2]);
+	__m128 radius = _mm_set1_ps(light[3]);
+	__m128 radius2 = _mm_set1_ps(light[3] * light[3]);
+	__m128 dir_x = _mm_set1_ps(light[4]), dir_y = _mm_set1_ps(light[5]), dir_z = _mm_set1_ps(light[6]);
+	__m128 cos_angle = _mm_set1_ps(light[7]), sin_angle = _mm_set1_ps(light[8]);
+	memset(mask, 0, CLUSTER_MASK_WORDS * sizeof(uint32));
+	for (int c = 0; c < CLUSTERS_PER_SLICE; c += 4)
+	{
+		__m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bounds[0] + c), px), zero), _mm_max_ps(_mm_sub_ps(px, _mm_loadu_ps(bounds[3] + c)), zero));
+		__m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bounds[1] + c), py), zero), _mm_max_ps(_mm_sub_ps(py, _mm_loadu_ps(bounds[4] + c)), zero));
+		__m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bounds[2] + c), pz), zero), _mm_max_ps(_mm_sub_ps(pz, _mm_loadu_ps(bounds[5] + c)), zero));
+		__m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		__m128 inside = _mm_cmple_ps(distance2, radius2);
+		if (spot && _mm_movemask_ps(inside))
+		{
+			__m128 vx = _mm_sub_ps(_mm_loadu_ps(bounds[6] + c), px);
+			__m128 vy = _mm_sub_ps(_mm_loadu_ps(bounds[7] + c), py);
+			__m128 vz = _mm_sub_ps(_mm_loadu_ps(bounds[8] + c), pz);
+			__m128 sphere_radius = _mm_loadu_ps(bounds[9] + c);
+			__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+			__m128 along = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, dir_x), _mm_mul_ps(vy, dir_y)), _mm_mul_ps(vz, dir_z));
+			__m128 closest = _mm_sub_ps(_mm_mul_ps(cos_angle, _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(length2, _mm_mul_ps(along, along)), zero))), _mm_mul_ps(along, sin_angle));
+			inside = _mm_and_ps(inside, _mm_cmple_ps(closest, sphere_radius));
+			inside = _mm_and_ps(inside, _mm_cmple_ps(along, _mm_add_ps(sphere_radius, radius)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(along, _mm_sub_ps(zero, sphere_radius)));
+		}
+		mask[c >> 5] |= (uint32)_mm_movemask_ps(inside) << (c & 31);
+	}
+}
+#endif
+
+//the lights of every cluster keep the order in which they were added
+void LightClusters::binSlice(int slice, bool simd)
+{
+	sSliceBins& bins = slice_bins[slice];
+	bins.lights.clear();
+	bins.masks.clear();
+	bins.counts.assign(CLUSTERS_PER_SLICE, 0);
+	bins.offsets.resize(CLUSTERS_PER_SLICE);
+
+	int base = slice * CLUSTERS_PER_SLICE;
+	const float* bounds[10] = { &min_x[base], &min_y[base], &min_z[base], &max_x[base], &max_y[base], &max_z[base], &sphere_x[base], &sphere_y[base], &sphere_z[base], &sphere_radius[base] };
+	uint32 mask[CLUSTER_MASK_WORDS];
+
+	for (int i = 0; i < view_lights.size(); ++i)
+	{
+		const sViewLight& view_light = view_lights[i];
+		if (slice < view_light.min_slice || slice > view_light.max_slice)
+			continue;
+		const sLight& light = lights[i];
+		float params[9] = { view_light.position.x, view_light.position.y, view_light.position.z, view_light.radius,
+			view_light.direction.x, view_light.direction.y, view_light.direction.z, light.cos_angle, light.sin_angle };
+#ifdef CULLING_SSE
+		if (simd)
+			testClustersSSE(params, light.spot, bounds, mask);
+		else
+#endif
+			testClustersScalar(params, light.spot, bounds, mask);
+
+		uint32 any = 0;
+		for (int j = 0; j < CLUSTER_MASK_WORDS; ++j)
+			any |= mask[j];
+		if (!any)
+			continue;
+		bins.lights.push_back(i);
+		bins.masks.insert(bins.masks.end(), mask, mask + CLUSTER_MASK_WORDS);
+		for (int c = 0; c < CLUSTERS_PER_SLICE; ++c)
+			bins.counts[c] += (mask[c >> 5] >> (c & 31)) & 1;
+	}
+
+	uint32 total = 0;
+	for (int c = 0; c < CLUSTERS_PER_SLICE; ++c)
+	{
+		bins.offsets[c] = total;
+		total += bins.counts[c];
+	}
+	bins.indices.resize(total);
+
+	//the offsets are used as cursors and restored at the end
+	for (int i = 0; i < bins.lights.size(); ++i)
+	{
+		const uint32* light_mask = &bins.masks[i * CLUSTER_MASK_WORDS];
+		for (int c = 0; c < CLUSTERS_PER_SLICE; ++c)
+			if ((light_mask[c >> 5] >> (c & 31)) & 1)
+				bins.indices[bins.offsets[c]++] = bins.lights[i];
+	}
+	for (int c = 0; c < CLUSTERS_PER_SLICE; ++c)
+		bins.offsets[c] -= bins.counts[c];
+}
+
+void LightClusters::merge()
+{
+	uint32 total = 0;
+	for (int z = 0; z < CLUSTERS_Z; ++z)
+		total += (uint32)slice_bins[z].indices.size();
+	indices.resize(total);
+
+	uint32 offset = 0;
+	for (int z = 0; z < CLUSTERS_Z; ++z)
+	{
+		sSliceBins& bins = slice_bins[z];
+		if (bins.indices.size())
+			memcpy(&indices[offset], &bins.indices[0], bins.indices.size() * sizeof(uint32));
+		for (int c = 0; c < CLUSTERS_PER_SLICE; ++c)
+		{
+			int cluster = z * CLUSTERS_PER_SLICE + c;
+			grid[cluster * 2] = offset + bins.offsets[c];
+			grid[cluster * 2 + 1] = bins.counts[c];
+		}
+		offset += (uint32)bins.indices.size();
+	}
+}
+
+void LightClusters::build()
+{
+	prepareLights();
+	TaskManager::background.parallelFor(CLUSTERS_Z, 1, [&](int start, int end, int chunk) {
+		for (int slice = start; slice < end; ++slice)
+			binSlice(slice, true);
+	});
+	merge();
+}
+
+void LightClusters::buildScalar()
+{
+	prepareLights();
+	for (int z = 0; z < CLUSTERS_Z; ++z)
+		binSlice(z, false);
+	merge();
+}
@@ -0,0 +1,95 @@
+/*
+	Clustered light assignment for forward+ rendering. The view frustum is split in a grid of froxels: CLUSTERS_X x CLUSTERS_Y
+	tiles on screen and CLUSTERS_Z slices in depth (exponential, so all the clusters have a similar shape).
+	The point and spot lights are binned in the CPU:
+	- the bounds of the clusters only change with the projection, they are computed in view space
+	- the lights are moved to view space and every slice is binned by a task of the background TaskManager
+	- every light is tested against 4 clusters at a time with SSE: sphere vs box, and for spots the cone vs the bounding sphere of the cluster
+	The result is an offset and a count per cluster in a list of light indices, the forward shader reads them from textures.
+	It does not use the GPU, the binning can be checked and timed in the CPU.
+*/
+
+#ifndef CLUSTERING_H
+#define CLUSTERING_H
+
+#include <vector>
+#include "framework.h"
+
+class Camera;
+
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 8
+#define CLUSTERS_Z 24
+#define CLUSTERS_PER_SLICE (CLUSTERS_X * CLUSTERS_Y) //must be a multiple of 32
+#define NUM_CLUSTERS (CLUSTERS_PER_SLICE * CLUSTERS_Z)
+#define CLUSTER_INDICES_WIDTH 1024 //of the texture with the light indices
+
+class LightClusters
+{
+public:
+	struct sLight {
+		Vector3 position;
+		float radius;
+		Vector3 direction; //only for spots
+		float cos_angle;
+		float sin_angle;
+		bool spot;
+	};
+
+	std::vector<sLight> lights; //in world space, in the order they were added
+	std::vector<uint32> grid; //offset and count in indices of every cluster, x changes first, then y and then z
+	std::vector<uint32> indices; //of the lights, sorted in every cluster
+
+	float near_plane;
+	float far_plane;
+	float slice_scale; //slices per unit of log(depth / near)
+
+	LightClusters();
+
+	//computes the bounds of the clusters if the projection changed and removes the lights (only perspective cameras)
+	void begin(Camera* camera);
+	void addPointLight(const Vector3& position, float radius);
+	void addSpotLight(const Vector3& position, float radius, const Vector3& direction, float cone_angle); //half angle in degrees
+
+	//fills grid and indices
+	void build();
+	void buildScalar(); //in the calling thread and without SIMD, to compare
+
+	int getCluster(int x, int y, int z) const { return x + y * CLUSTERS_X + z * CLUSTERS_PER_SLICE; }
+	//slice of a distance along the front of the camera
+	int getSlice(float depth) const;
+
+private:
+	struct sViewLight {
+		Vector3 position;
+		float radius;
+		Vector3 direction;
+		int min_slice, max_slice;
+	};
+
+	//lights that touch a slice, every one with a mask of the clusters touched
+	struct sSliceBins {
+		std::vector<int> lights;
+		std::vector<uint32> masks; //CLUSTERS_PER_SLICE / 32 per light
+		std::vector<uint32> offsets; //of every cluster in indices
+		std::vector<uint32> counts;
+		std::vector<uint32> indices;
+	};
+
+	Matrix44 view;
+	float fov, aspect; //of the bounds
+
+	//bounds of the clusters in view space (SoA)
+	std::vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+	std::vector<float> sphere_x, sphere_y, sphere_z, sphere_radius;
+
+	std::vector<sViewLight> view_lights;
+	std::vector<sSliceBins> slice_bins;
+
+	void computeBounds();
+	void prepareLights();
+	void binSlice(int slice, bool simd);
+	void merge();
+};
+
+#endif
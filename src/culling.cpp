@@ -0,0 +1,152 @@
+#include "culling.h"
+#include "camera.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(CULLING_AVX)
+	#include <immintrin.h>
+#elif defined(CULLING_SSE)
+	#include <emmintrin.h>
+#endif
+
+void BoxCuller::reserve(int num)
+{
+	num += CULLING_BATCH;
+	center_x.reserve(num); center_y.reserve(num); center_z.reserve(num);
+	halfsize_x.reserve(num); halfsize_y.reserve(num); halfsize_z.reserve(num);
+}
+
+void BoxCuller::add(const Vector3& center, const Vector3& halfsize)
+{
+	if (num_boxes < center_x.size())
+	{
+		//overwrite the padding of the last cull
+		center_x.resize(num_boxes); center_y.resize(num_boxes); center_z.resize(num_boxes);
+		halfsize_x.resize(num_boxes); halfsize_y.resize(num_boxes); halfsize_z.resize(num_boxes);
+	}
+	center_x.push_back(center.x); center_y.push_back(center.y); center_z.push_back(center.z);
+	halfsize_x.push_back(halfsize.x); halfsize_y.push_back(halfsize.y); halfsize_z.push_back(halfsize.z);
+	num_boxes++;
+}
+
+//the padding is removed by the next add, its bits are not used
+void BoxCuller::pad()
+{
+	int count = (num_boxes + CULLING_BATCH - 1) / CULLING_BATCH * CULLING_BATCH;
+	center_x.resize(count, 0.0f); center_y.resize(count, 0.0f); center_z.resize(count, 0.0f);
+	halfsize_x.resize(count, 0.0f); halfsize_y.resize(count, 0.0f); halfsize_z.resize(count, 0.0f);
+	visibility.resize((count + 31) / 32);
+}
+
+void BoxCuller::cull(const float planes[6][4])
+{
+	pad();
+	if (num_boxes)
+		cullBoxes(planes, &center_x[0], &center_y[0], &center_z[0], &halfsize_x[0], &halfsize_y[0], &halfsize_z[0], (int)center_x.size(), &visibility[0]);
+}
+
+void BoxCuller::cull(Camera* camera)
+{
+	cull(camera->frustum);
+}
+
+void BoxCuller::setAllVisible(int num)
+{
+	clear();
+	num_boxes = num;
+	visibility.assign((num + 31) / 32, 0xFFFFFFFF);
+}
+
+void BoxCuller::cullScalar(const float planes[6][4])
+{
+	pad();
+	if (num_boxes)
+		cullBoxesScalar(planes, &center_x[0], &center_y[0], &center_z[0], &halfsize_x[0], &halfsize_y[0], &halfsize_z[0], (int)center_x.size(), &visibility[0]);
+}
+
+//a box is outside if it is behind one plane: distance to the center <= -(projection of the halfsize on the normal)
+void cullBoxesScalar(const float planes[6][4], const float* center_x, const float* center_y, const float* center_z, const float* halfsize_x, const float* halfsize_y, const float* halfsize_z, int count, uint32* visibility)
+{
+	memset(visibility, 0, (count + 31) / 32 * sizeof(uint32));
+	for (int i = 0; i < count; ++i)
+	{
+		bool inside = true;
+		for (int j = 0; j < 6 && inside; ++j)
+		{
+			const float* p = planes[j];
+			float distance = p[0] * center_x[i] + p[1] * center_y[i] + p[2] * center_z[i] + p[3];
+			float radius = fabsf(p[0]) * halfsize_x[i] + fabsf(p[1]) * halfsize_y[i] + fabsf(p[2]) * halfsize_z[i];
+			inside = distance > -radius;
+		}
+		if (inside)
+			visibility[i >> 5] |= 1u << (i & 31);
+	}
+}
+
+void cullBoxes(const float planes[6][4], const float* center_x, const float* center_y, const float* center_z, const float* halfsize_x, const float* halfsize_y, const float* halfsize_z, int count, uint32* visibility)
+{
+#if defined(CULLING_AVX)
+	memset(visibility, 0, (count + 31) / 32 * sizeof(uint32));
+	__m256 plane[6][7]; //normal, distance and absolute value of the normal, in every lane
+	for (int j = 0; j < 6; ++j)
+	{
+		for (int k = 0; k < 4; ++k)
+			plane[j][k] = _mm256_set1_ps(planes[j][k]);
+		for (int k = 0; k < 3; ++k)
+			plane[j][4 + k] = _mm256_set1_ps(fabsf(planes[j][k]));
+	}
+	const __m256 zero = _mm256_setzero_ps();
+
+	for (int i = 0; i < count; i += 8)
+	{
+		__m256 cx = _mm256_loadu_ps(center_x + i);
+		__m256 cy = _mm256_loadu_ps(center_y + i);
+		__m256 cz = _mm256_loadu_ps(center_z + i);
+		__m256 hx = _mm256_loadu_ps(halfsize_x + i);
+		__m256 hy = _mm256_loadu_ps(halfsize_y + i);
+		__m256 hz = _mm256_loadu_ps(halfsize_z + i);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int j = 0; j < 6; ++j)
+		{
+			const __m256* p = plane[j];
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(p[0], cx), _mm256_mul_ps(p[1], cy)), _mm256_mul_ps(p[2], cz)), p[3]);
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(p[4], hx), _mm256_mul_ps(p[5], hy)), _mm256_mul_ps(p[6], hz));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_sub_ps(zero, radius), _CMP_GT_OQ));
+		}
+		visibility[i >> 5] |= (uint32)_mm256_movemask_ps(inside) << (i & 31);
+	}
+#elif defined(CULLING_SSE)
+	memset(visibility, 0, (count + 31) / 32 * sizeof(uint32));
+	__m128 plane[6][7];
+	for (int j = 0; j < 6; ++j)
+	{
+		for (int k = 0; k < 4; ++k)
+			plane[j][k] = _mm_set1_ps(planes[j][k]);
+		for (int k = 0; k < 3; ++k)
+			plane[j][4 + k] = _mm_set1_ps(fabsf(planes[j][k]));
+	}
+	const __m128 zero = _mm_setzero_ps();
+
+	for (int i = 0; i < count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(center_x + i);
+		__m128 cy = _mm_loadu_ps(center_y + i);
+		__m128 cz = _mm_loadu_ps(center_z + i);
+		__m128 hx = _mm_loadu_ps(halfsize_x + i);
+		__m128 hy = _mm_loadu_ps(halfsize_y + i);
+		__m128 hz = _mm_loadu_ps(halfsize_z + i);
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int j = 0; j < 6; ++j)
+		{
+			const __m128* p = plane[j];
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(p[0], cx), _mm_mul_ps(p[1], cy)), _mm_mul_ps(p[2], cz)), p[3]);
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p[4], hx), _mm_mul_ps(p[5], hy)), _mm_mul_ps(p[6], hz));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, _mm_sub_ps(zero, radius)));
+		}
+		visibility[i >> 5] |= (uint32)_mm_movemask_ps(inside) << (i & 31);
+	}
+#else
+	cullBoxesScalar(planes, center_x, center_y, center_z, halfsize_x, halfsize_y, halfsize_z, count, visibility);
+#endif
+}
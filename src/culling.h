@@ -0,0 +1,61 @@
+/*
+	Batched frustum culling of AABBs. The boxes are stored as structure of arrays (one array per component)
+	so several boxes are tested at the same time against every plane with SIMD:
+	- AVX (8 boxes) when compiled with it (/arch:AVX or -mavx)
+	- SSE (4 boxes) in x86 and x64
+	- a scalar loop in the rest of platforms (or if CULLING_NO_SIMD is defined)
+	The result is a bitmask with one bit per box, set if the box is not fully outside a plane
+	(the same test than Camera::testBoxInFrustum).
+*/
+
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <vector>
+#include "framework.h"
+
+class Camera;
+
+#define CULLING_BATCH 8 //the arrays are padded to a multiple of this
+
+//instruction sets available for the CPU culling (also used by the occlusion buffer)
+#if !defined(CULLING_NO_SIMD) && defined(__AVX__)
+	#define CULLING_AVX
+#endif
+#if !defined(CULLING_NO_SIMD) && (defined(__AVX__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define CULLING_SSE
+#endif
+
+class BoxCuller
+{
+public:
+	//SoA of the boxes, padded with empty boxes
+	std::vector<float> center_x, center_y, center_z;
+	std::vector<float> halfsize_x, halfsize_y, halfsize_z;
+	std::vector<uint32> visibility; //one bit per box, box i is in the bit i % 32 of the word i / 32
+
+	BoxCuller() { num_boxes = 0; }
+
+	void clear() { num_boxes = 0; }
+	void reserve(int num);
+	void add(const Vector3& center, const Vector3& halfsize);
+	int size() const { return num_boxes; }
+
+	//fills visibility with the boxes inside the planes (they point inside, like the ones of the camera)
+	void cull(const float planes[6][4]);
+	void cull(Camera* camera);
+	void cullScalar(const float planes[6][4]); //without SIMD, to compare
+	void setAllVisible(int num); //num boxes already known to be inside, without storing nor testing them (call clear before adding more)
+
+	bool isVisible(int i) const { return (visibility[i >> 5] >> (i & 31)) & 1; }
+
+private:
+	int num_boxes;
+	void pad(); //fills the arrays till a multiple of CULLING_BATCH
+};
+
+//tests the boxes (SoA, count must be a multiple of CULLING_BATCH) against the planes, visibility must have count / 32 words rounded up
+void cullBoxes(const float planes[6][4], const float* center_x, const float* center_y, const float* center_z, const float* halfsize_x, const float* halfsize_y, const float* halfsize_z, int count, uint32* visibility);
+void cullBoxesScalar(const float planes[6][4], const float* center_x, const float* center_y, const float* center_z, const float* halfsize_x, const float* halfsize_y, const float* halfsize_z, int count, uint32* visibility);
+
+#endif
@@ -1,4 +1,5 @@
 #include "framework.h"
+#include "simd.h"
 
 //#include "includes.h"
 
@@ -436,42 +437,102 @@ Vector3 Matrix44::project(const Vector3& v)
 }
 
 
-//Multiply a matrix by another and returns the result
-Matrix44 Matrix44::operator*(const Matrix44& matrix) const
-{
-	Matrix44 ret;
+//SIMD kernels (see simd.h), the operations are done in the same order than the old scalar code so the results are the same
 
-	unsigned int i,j,k;
-	for (i=0;i<4;i++) 	
+//every row of the result is the rows of b weighted by the row of a (a and result can be the same)
+static inline void multiplyKernel(const float* a, float4 b0, float4 b1, float4 b2, float4 b3, float* result)
+{
+	const float4 zero = set4(0.0f); //the scalar code started the sum with 0 (it changes the sign of -0)
+	for (int i = 0; i < 4; ++i)
 	{
-		for (j=0;j<4;j++) 
-		{
-			ret.M[i][j]=0.0;
-			for (k=0;k<4;k++) 
-				ret.M[i][j] += M[i][k] * matrix.M[k][j];
-		}
+		float4 row = load4(a + i * 4);
+		float4 r = add4(zero, mul4(splat4<0>(row), b0));
+		r = add4(r, mul4(splat4<1>(row), b1));
+		r = add4(r, mul4(splat4<2>(row), b2));
+		r = add4(r, mul4(splat4<3>(row), b3));
+		store4(result + i * 4, r);
 	}
+}
+
+static inline float4 transformPointKernel(float4 r0, float4 r1, float4 r2, float4 r3, float x, float y, float z)
+{
+	return add4(add4(add4(mul4(r0, set4(x)), mul4(r1, set4(y))), mul4(r2, set4(z))), r3);
+}
+
+//the box of the transformed box: the center is transformed and the halfsize projected on the axis (Arvo 1990)
+static inline void transformBoundingBoxKernel(float4 r0, float4 r1, float4 r2, float4 r3, const BoundingBox& box, BoundingBox& result)
+{
+	float center[4], halfsize[4];
+	store4(center, transformPointKernel(r0, r1, r2, r3, box.center.x, box.center.y, box.center.z));
+	store4(halfsize, add4(add4(mul4(abs4(r0), set4(box.halfsize.x)), mul4(abs4(r1), set4(box.halfsize.y))), mul4(abs4(r2), set4(box.halfsize.z))));
+	result.center.set(center[0], center[1], center[2]);
+	result.halfsize.set(halfsize[0], halfsize[1], halfsize[2]);
+}
 
+//Multiply a matrix by another and returns the result
+Matrix44 Matrix44::operator*(const Matrix44& matrix) const
+{
+	Matrix44 ret;
+	multiplyKernel(m, load4(matrix.m), load4(matrix.m + 4), load4(matrix.m + 8), load4(matrix.m + 12), ret.m);
 	return ret;
 }
 
 //Multiplies a vector by a matrix and returns the new vector
 Vector3 operator * (const Matrix44& matrix, const Vector3& v) 
 {   
-   float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12]; 
-   float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13]; 
-   float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + matrix.m[14];
-   return Vector3(x,y,z);
+	float r[4];
+	store4(r, transformPointKernel(load4(matrix.m), load4(matrix.m + 4), load4(matrix.m + 8), load4(matrix.m + 12), v.x, v.y, v.z));
+	return Vector3(r[0], r[1], r[2]);
 }
 
 //Multiplies a vector by a matrix and returns the new vector
 Vector4 operator * (const Matrix44& matrix, const Vector4& v)
 {
-	float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + v.w * matrix.m[12];
-	float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + v.w * matrix.m[13];
-	float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + v.w * matrix.m[14];
-	float w = matrix.m[3] * v.x + matrix.m[7] * v.y + matrix.m[11] * v.z + v.w * matrix.m[15];
-	return Vector4(x, y, z, w);
+	float r[4];
+	store4(r, add4(add4(add4(mul4(load4(matrix.m), set4(v.x)), mul4(load4(matrix.m + 4), set4(v.y))), mul4(load4(matrix.m + 8), set4(v.z))), mul4(set4(v.w), load4(matrix.m + 12))));
+	return Vector4(r[0], r[1], r[2], r[3]);
+}
+
+void multiplyMatrices(const Matrix44* a, const Matrix44& b, Matrix44* result, int count)
+{
+	float4 b0 = load4(b.m), b1 = load4(b.m + 4), b2 = load4(b.m + 8), b3 = load4(b.m + 12);
+	for (int i = 0; i < count; ++i)
+		multiplyKernel(a[i].m, b0, b1, b2, b3, result[i].m);
+}
+
+void multiplyMatrices(const Matrix44* a, const Matrix44* b, Matrix44* result, int count)
+{
+	for (int i = 0; i < count; ++i)
+		multiplyKernel(a[i].m, load4(b[i].m), load4(b[i].m + 4), load4(b[i].m + 8), load4(b[i].m + 12), result[i].m);
+}
+
+void transformPoints(const Matrix44& m, const Vector3* points, Vector3* result, int count)
+{
+	float4 r0 = load4(m.m), r1 = load4(m.m + 4), r2 = load4(m.m + 8), r3 = load4(m.m + 12);
+	float r[4];
+	for (int i = 0; i < count; ++i)
+	{
+		store4(r, transformPointKernel(r0, r1, r2, r3, points[i].x, points[i].y, points[i].z));
+		result[i].set(r[0], r[1], r[2]);
+	}
+}
+
+void transformBoundingBoxes(const Matrix44* models, const BoundingBox& box, BoundingBox* result, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const float* m = models[i].m;
+		transformBoundingBoxKernel(load4(m), load4(m + 4), load4(m + 8), load4(m + 12), box, result[i]);
+	}
+}
+
+void transformBoundingBoxes(const Matrix44* models, const BoundingBox* boxes, BoundingBox* result, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const float* m = models[i].m;
+		transformBoundingBoxKernel(load4(m), load4(m + 4), load4(m + 8), load4(m + 12), boxes[i], result[i]);
+	}
 }
 
 void Matrix44::setUpAndOrthonormalize(Vector3 up)
@@ -620,6 +681,34 @@ bool Matrix44::inverse()
    return true;
 }
 
+//rows 0 to 2 are the axis (A) and row 3 the translation (t), the inverse is A^-1 and -t * A^-1.
+//The columns of A^-1 are the cross products of the rows of A divided by the determinant
+bool Matrix44::inverseAffine()
+{
+	Vector3 r0(m[0], m[1], m[2]);
+	Vector3 r1(m[4], m[5], m[6]);
+	Vector3 r2(m[8], m[9], m[10]);
+	Vector3 c0 = r1.cross(r2);
+	Vector3 c1 = r2.cross(r0);
+	Vector3 c2 = r0.cross(r1);
+	float det = r0.dot(c0);
+	if (fabsf(det) < 1e-30f)
+		return false;
+
+	float4 inv_det = set4(1.0f / det);
+	float4 i0 = mul4(set4(c0.x, c1.x, c2.x, 0.0f), inv_det);
+	float4 i1 = mul4(set4(c0.y, c1.y, c2.y, 0.0f), inv_det);
+	float4 i2 = mul4(set4(c0.z, c1.z, c2.z, 0.0f), inv_det);
+	float4 t = add4(add4(mul4(i0, set4(m[12])), mul4(i1, set4(m[13]))), mul4(i2, set4(m[14])));
+	t = sub4(set4(0.0f, 0.0f, 0.0f, 1.0f), t);
+
+	store4(m, i0);
+	store4(m + 4, i1);
+	store4(m + 8, i2);
+	store4(m + 12, t);
+	return true;
+}
+
 #ifdef FIXEDPIPELINE
 void Matrix44::multGL()
 {
@@ -1306,25 +1395,11 @@ float signedDistanceToPlane( const Vector4& plane, const Vector3& point )
 	return dot(plane.xyz(), point) + plane.w;
 }
 
-const Vector3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
-
-BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
+BoundingBox transformBoundingBox(const Matrix44& m, const BoundingBox& box)
 {
-	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
-	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
-
-	for (int i = 0; i < 8; ++i)
-	{
-		Vector3 corner = corners[i];
-		corner = box.halfsize * corner;
-		corner = corner + box.center;
-		corner = m * corner;
-		box_min.setMin(corner);
-		box_max.setMax(corner);
-	}
-
-	Vector3 halfsize = (box_max - box_min) * 0.5;
-	return BoundingBox(box_max - halfsize, halfsize );
+	BoundingBox result;
+	transformBoundingBoxKernel(load4(m.m), load4(m.m + 4), load4(m.m + 8), load4(m.m + 12), box, result);
+	return result;
 }
 
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
@@ -1448,4 +1523,4 @@ bool BoundingBoxSphereOverlap(const BoundingBox& box, const Vector3& center, flo
 	}
 
 	return false; //OUTSIDE;
-}
\ No newline at end of file
+}
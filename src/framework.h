@@ -21,6 +21,7 @@ typedef unsigned short uint16;
 typedef short int16;
 typedef int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 inline float clamp(float v, float a, float b) { return v < a ? a : (v > b ? b : v); }
 inline float lerp(float a, float b, float v ) { return a*(1.0f-v) + b*v; }
@@ -230,6 +231,7 @@ class Matrix44
 		Vector3 frontVector() { return Vector3(m[8],m[9],m[10]); }
 
 		bool inverse();
+		bool inverseAffine(); //faster, only for matrices whose last column is (0,0,0,1) like the models and views
 		void setUpAndOrthonormalize(Vector3 up);
 		void setFrontAndOrthonormalize(Vector3 front);
 
@@ -373,7 +375,14 @@ public:
 
 //applies a transform to a AABB from object to world
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b);
-BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box);
+BoundingBox transformBoundingBox(const Matrix44& m, const BoundingBox& box);
+
+//batched versions of the SIMD kernels, they keep the shared matrix or box in registers
+void multiplyMatrices(const Matrix44* a, const Matrix44& b, Matrix44* result, int count); //result[i] = a[i] * b
+void multiplyMatrices(const Matrix44* a, const Matrix44* b, Matrix44* result, int count); //result[i] = a[i] * b[i]
+void transformPoints(const Matrix44& m, const Vector3* points, Vector3* result, int count);
+void transformBoundingBoxes(const Matrix44* models, const BoundingBox& box, BoundingBox* result, int count); //one box, several instances
+void transformBoundingBoxes(const Matrix44* models, const BoundingBox* boxes, BoundingBox* result, int count);
 
 float signedDistanceToPlane(const Vector4& plane, const Vector3& point);
 int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3& halfsize );
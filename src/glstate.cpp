@@ -0,0 +1,225 @@
+#include "glstate.h"
+
+#include <cassert>
+
+#ifndef GL_TEXTURE_2D_ARRAY
+	#define GL_TEXTURE_2D_ARRAY 0x8C1A
+#endif
+
+#define UNKNOWN_STATE -1
+
+long GLState::num_calls = 0;
+long GLState::num_avoided = 0;
+long GLState::last_frame_calls = 0;
+long GLState::last_frame_avoided = 0;
+
+int GLState::flags[NUM_FLAGS] = { UNKNOWN_STATE, UNKNOWN_STATE, UNKNOWN_STATE };
+GLint GLState::blend_sfactor = UNKNOWN_STATE;
+GLint GLState::blend_dfactor = UNKNOWN_STATE;
+GLint GLState::depth_func = UNKNOWN_STATE;
+GLint GLState::program = UNKNOWN_STATE;
+int GLState::active_slot = UNKNOWN_STATE;
+GLint GLState::textures[max_texture_slots][NUM_TARGETS];
+GLint GLState::framebuffer = UNKNOWN_STATE;
+
+int GLState::getFlagIndex(GLenum cap)
+{
+	switch (cap)
+	{
+		case GL_BLEND: return BLEND_FLAG;
+		case GL_CULL_FACE: return CULL_FACE_FLAG;
+		case GL_DEPTH_TEST: return DEPTH_TEST_FLAG;
+	}
+	return -1;
+}
+
+int GLState::getTargetIndex(GLenum target)
+{
+	switch (target)
+	{
+		case GL_TEXTURE_2D: return TEXTURE_2D_TARGET;
+		case GL_TEXTURE_CUBE_MAP: return TEXTURE_CUBE_MAP_TARGET;
+		case GL_TEXTURE_3D: return TEXTURE_3D_TARGET;
+		case GL_TEXTURE_2D_ARRAY: return TEXTURE_2D_ARRAY_TARGET;
+	}
+	return -1;
+}
+
+void GLState::enable(GLenum cap)
+{
+	int index = getFlagIndex(cap);
+	if (index != -1)
+	{
+		if (flags[index] == 1)
+		{
+			num_avoided++;
+			return;
+		}
+		flags[index] = 1;
+	}
+	glEnable(cap);
+	num_calls++;
+}
+
+void GLState::disable(GLenum cap)
+{
+	int index = getFlagIndex(cap);
+	if (index != -1)
+	{
+		if (flags[index] == 0)
+		{
+			num_avoided++;
+			return;
+		}
+		flags[index] = 0;
+	}
+	glDisable(cap);
+	num_calls++;
+}
+
+bool GLState::isEnabled(GLenum cap)
+{
+	int index = getFlagIndex(cap);
+	return index != -1 && flags[index] == 1;
+}
+
+void GLState::blendFunc(GLenum sfactor, GLenum dfactor)
+{
+	if (blend_sfactor == (GLint)sfactor && blend_dfactor == (GLint)dfactor)
+	{
+		num_avoided++;
+		return;
+	}
+	blend_sfactor = sfactor;
+	blend_dfactor = dfactor;
+	glBlendFunc(sfactor, dfactor);
+	num_calls++;
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (depth_func == (GLint)func)
+	{
+		num_avoided++;
+		return;
+	}
+	depth_func = func;
+	glDepthFunc(func);
+	num_calls++;
+}
+
+void GLState::useProgram(GLuint program)
+{
+	if (GLState::program == (GLint)program)
+	{
+		num_avoided++;
+		return;
+	}
+	GLState::program = program;
+	glUseProgram(program);
+	num_calls++;
+}
+
+void GLState::activeTexture(int slot)
+{
+	assert(slot >= 0 && slot < max_texture_slots && "texture slot out of range");
+	if (active_slot == slot)
+	{
+		num_avoided++;
+		return;
+	}
+	active_slot = slot;
+	glActiveTexture(GL_TEXTURE0 + slot);
+	num_calls++;
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture)
+{
+	int index = getTargetIndex(target);
+	if (index == -1 || active_slot == UNKNOWN_STATE)
+	{
+		//we do not know where it ends, forget this target in every slot
+		if (index != -1)
+			for (int i = 0; i < max_texture_slots; ++i)
+				textures[i][index] = UNKNOWN_STATE;
+		glBindTexture(target, texture);
+		num_calls++;
+		return;
+	}
+
+	if (textures[active_slot][index] == (GLint)texture)
+	{
+		num_avoided++;
+		return;
+	}
+	textures[active_slot][index] = texture;
+	glBindTexture(target, texture);
+	num_calls++;
+}
+
+void GLState::bindTexture(int slot, GLenum target, GLuint texture)
+{
+	assert(slot >= 0 && slot < max_texture_slots && "texture slot out of range");
+	int index = getTargetIndex(target);
+	if (index != -1 && textures[slot][index] == (GLint)texture)
+	{
+		num_avoided++;
+		return;
+	}
+	activeTexture(slot);
+	bindTexture(target, texture);
+}
+
+void GLState::bindFramebuffer(GLuint fbo)
+{
+	if (framebuffer == (GLint)fbo)
+	{
+		num_avoided++;
+		return;
+	}
+	framebuffer = fbo;
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
+	num_calls++;
+}
+
+void GLState::onTextureDeleted(GLuint texture)
+{
+	for (int i = 0; i < max_texture_slots; ++i)
+		for (int j = 0; j < NUM_TARGETS; ++j)
+			if (textures[i][j] == (GLint)texture)
+				textures[i][j] = UNKNOWN_STATE;
+}
+
+void GLState::onProgramDeleted(GLuint program)
+{
+	if (GLState::program == (GLint)program)
+		GLState::program = UNKNOWN_STATE;
+}
+
+void GLState::onFramebufferDeleted(GLuint fbo)
+{
+	if (framebuffer == (GLint)fbo)
+		framebuffer = UNKNOWN_STATE;
+}
+
+void GLState::invalidate()
+{
+	for (int i = 0; i < NUM_FLAGS; ++i)
+		flags[i] = UNKNOWN_STATE;
+	blend_sfactor = blend_dfactor = UNKNOWN_STATE;
+	depth_func = UNKNOWN_STATE;
+	program = UNKNOWN_STATE;
+	active_slot = UNKNOWN_STATE;
+	for (int i = 0; i < max_texture_slots; ++i)
+		for (int j = 0; j < NUM_TARGETS; ++j)
+			textures[i][j] = UNKNOWN_STATE;
+	framebuffer = UNKNOWN_STATE;
+}
+
+void GLState::newFrame()
+{
+	last_frame_calls = num_calls;
+	last_frame_avoided = num_avoided;
+	num_calls = 0;
+	num_avoided = 0;
+}
@@ -0,0 +1,65 @@
+/*
+	This keeps a copy of the OpenGL state (flags, blending, depth, program, textures and framebuffer)
+	so we only call OpenGL when something really changes. All the state changes must go through here,
+	if some code changes it directly call GLState::invalidate() afterwards.
+*/
+
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "includes.h"
+
+class GLState
+{
+public:
+	static const int max_texture_slots = 16;
+
+	//stats
+	static long num_calls; //calls sent to OpenGL
+	static long num_avoided; //calls skipped because the state was already set
+	static long last_frame_calls;
+	static long last_frame_avoided;
+
+	//flags (only GL_BLEND, GL_CULL_FACE and GL_DEPTH_TEST are cached, the rest are sent always)
+	static void enable(GLenum cap);
+	static void disable(GLenum cap);
+	static void set(GLenum cap, bool value) { if (value) enable(cap); else disable(cap); }
+	static bool isEnabled(GLenum cap); //only cached flags, false if unknown
+
+	static void blendFunc(GLenum sfactor, GLenum dfactor);
+	static void depthFunc(GLenum func);
+
+	static void useProgram(GLuint program);
+	static void activeTexture(int slot);
+	static void bindTexture(GLenum target, GLuint texture); //in the active slot
+	static void bindTexture(int slot, GLenum target, GLuint texture);
+	static void bindFramebuffer(GLuint fbo);
+
+	//OpenGL reuses the ids of deleted objects so we must forget them
+	static void onTextureDeleted(GLuint texture);
+	static void onProgramDeleted(GLuint program);
+	static void onFramebufferDeleted(GLuint fbo);
+
+	//forget everything, next calls will be sent to OpenGL
+	static void invalidate();
+	//stores the stats of the frame and resets the counters
+	static void newFrame();
+
+private:
+	enum { BLEND_FLAG, CULL_FACE_FLAG, DEPTH_TEST_FLAG, NUM_FLAGS };
+	enum { TEXTURE_2D_TARGET, TEXTURE_CUBE_MAP_TARGET, TEXTURE_3D_TARGET, TEXTURE_2D_ARRAY_TARGET, NUM_TARGETS };
+
+	static int flags[NUM_FLAGS]; //-1 unknown, 0 disabled, 1 enabled
+	static GLint blend_sfactor;
+	static GLint blend_dfactor;
+	static GLint depth_func;
+	static GLint program;
+	static int active_slot;
+	static GLint textures[max_texture_slots][NUM_TARGETS];
+	static GLint framebuffer;
+
+	static int getFlagIndex(GLenum cap);
+	static int getTargetIndex(GLenum target);
+};
+
+#endif
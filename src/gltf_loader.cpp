@@ -22,114 +22,46 @@ std::string base_folder;
 	bool load_textures = true; //must textures be loadead?
 #endif
 
-void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//copies the accessor into the container, the vertices are not expanded by the indices (see parseGLTFBufferIndices)
+template<typename T> void parseGLTFBuffer(std::vector<T>& container, cgltf_accessor* acc, cgltf_type type)
 {
-	int i = 0;
-
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		assert(!"TO DO");
-	}
+	assert(acc->buffer_view && acc->buffer_view->buffer->data);
+	assert(acc->type == type);
 	int num_elements = acc->count;
-	std::vector<Vector3> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec3);
-	if (acc->stride == sizeof(Vector3))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector3));
-	else
-	{
-		for (int i = 0; i < num_elements; ++i)
-		{
-			memcpy(&unindexed[i], data, sizeof(Vector3));
-			data += acc->stride;
-		}
-	}
-
-	if (!indices_acc)
-	{
-		container = unindexed;
+	container.resize(num_elements);
+	if (!num_elements)
 		return;
-	}
 
-	container.resize(indices_acc->count);
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
+	//floats packed in the same layout than ours, just copy
+	if (acc->component_type == cgltf_component_type_r_32f && !acc->normalized && !acc->is_sparse)
 	{
-		int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
-		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
+		unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
+		if (acc->stride == sizeof(T))
+			memcpy(&container[0], data, num_elements * sizeof(T));
 		else
-			std::cout << "index out of bounds:" << index << std::endl;
-	}
-}
-
-void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
-{
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->offset + acc->buffer_view->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector2> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec2);
-	if (acc->stride == sizeof(Vector2))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector2));
-	else
-	{
-		for (int i = 0; i < num_elements; ++i)
-		{
-			memcpy(&unindexed[i], data, sizeof(Vector2));
-			data += acc->stride;
-		}
-	}
-
-	if (!indices_acc)
-	{
-		container = unindexed;
+			for (int i = 0; i < num_elements; ++i)
+			{
+				memcpy(&container[i], data, sizeof(T));
+				data += acc->stride;
+			}
 		return;
 	}
 
-	container.resize(indices_acc->count);
-
-	assert(indices_acc->sparse.count == 0); //sparse not supported yet
+	//other component types (normalized, quantized by KHR_mesh_quantization) or sparse, let cgltf convert them
+	cgltf_accessor_unpack_floats(acc, (cgltf_float*)&container[0], num_elements * (sizeof(T) / sizeof(float)));
+}
 
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
-	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
-		}
-		if (index < unindexed.size())  //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
-	}
+void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc)
+{
+	parseGLTFBuffer(container, acc, cgltf_type_vec3);
+}
 
+void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc)
+{
+	parseGLTFBuffer(container, acc, cgltf_type_vec2);
 }
 
-void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
+void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc, int num_vertices)
 {
 	container.resize(acc->count);
 	unsigned int *final_indices = (unsigned int*)&container[0];
@@ -138,6 +70,7 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 
 	unsigned char* indices = (unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
 	int stride = acc->stride;
+	int num_out_of_bounds = 0;
 	for (int i = 0; i < acc->count; ++i)
 	{
 		unsigned int index = 0;
@@ -147,9 +80,18 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
 		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
 		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
+		default: assert(0 && "invalid index component type");
+		}
+		if (index >= num_vertices) //sometimes indices are out of bounds
+		{
+			index = 0;
+			num_out_of_bounds++;
 		}
 		final_indices[i] = index;
 	}
+
+	if (num_out_of_bounds)
+		std::cout << "indices out of bounds: " << num_out_of_bounds << std::endl;
 }
 
 std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
@@ -209,10 +151,25 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 				else
 					parseGLTFBufferVector2(mesh->uvs, attr->data);
 			}
-
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
+
+		//keep the geometry indexed, if it is not we remove the duplicated vertices to create the indices
+		if (primitive->indices && primitive->indices->count)
+			parseGLTFBufferIndices(mesh->m_indices, primitive->indices, (int)mesh->vertices.size());
+		else
+			mesh->weldVertices();
+
+		if (Mesh::optimize_meshes)
+			mesh->optimize();
+
+		if (Mesh::generate_lods)
+			mesh->generateLODs();
+
+		if (Mesh::build_meshlets)
+			mesh->buildMeshlets();
+
+		if (Mesh::quantize_meshes)
+			mesh->quantizeBuffers();
 		mesh->uploadToVRAM();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
@@ -520,6 +477,7 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 
 	prefab->updateNodesByName();
 	prefab->updateBounding();
+	prefab->compile();
 
 	//frees all data, including bin
 	cgltf_free(data);
@@ -126,7 +126,7 @@ void mainLoop(SDL_Window* window)
 	long now = start_time;
 	long frames_this_second = 0;
 
-	TaskManager::background.startThread();
+	TaskManager::background.startThreads();
 
 	while (!app->must_exit)
 	{
@@ -200,8 +200,8 @@ void mainLoop(SDL_Window* window)
 		//update app logic
 		app->update(elapsed_time);
 
-		//execute a task in the main task manager (blocking)
-		TaskManager::foreground.fetchTask();
+		//execute the tasks of the main task manager that fit in the frame budget (blocking)
+		TaskManager::foreground.fetchTasks(app->tasks_budget);
 
 		//check errors in opengl only when working in debug
 		#ifdef _DEBUG
@@ -226,7 +226,7 @@ int main(int argc, char **argv)
 		size = getDesktopSize(0);
 
 	//TaskManager tm;
-	//tm.startThread();
+	//tm.startThreads();
 	//Task* t = new Task([]() { std::cout << "TEST" << std::endl; });
 	//tm.addTask(t);
 
@@ -261,6 +261,9 @@ int main(int argc, char **argv)
 	//main loop, application gets inside here till user closes it
 	mainLoop(window);
 
+	//wait for the background workers before destroying anything
+	TaskManager::background.stopThreads();
+
 	//save state and free memory
 	// Cleanup
 	#ifndef SKIP_IMGUI
@@ -6,12 +6,16 @@
 #include "framework.h"
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
 
 #include "camera.h"
 #include "texture.h"
+#include "mesh_optimizer.h"
+#include "obj_loader.h"
 //#include "animation.h"
 #include "extra/coldet/coldet.h"
 
@@ -20,10 +24,15 @@
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::quantize_meshes = false;		//stores the geometry in the compact format (less precision, half the memory)
+bool Mesh::optimize_meshes = true;		//indexes the geometry and sorts it for the GPU caches, stored in the .mbin
+bool Mesh::generate_lods = true;		//simplifies the geometry to render it with less triangles when it is far, stored in the .mbin
+bool Mesh::build_meshlets = true;		//splits the geometry to cull the parts that are not visible, stored in the .mbin
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+int Mesh::s_MeshID = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -32,6 +41,7 @@ long Mesh::num_triangles_rendered = 0;
 
 Mesh::Mesh()
 {
+	m_Id = s_MeshID++;
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
@@ -98,7 +108,11 @@ void Mesh::clear()
 	uvs.clear();
 	colors.clear();
 	interleaved.clear();
+	quantized.clear();
 	m_indices.clear();
+	lods.clear();
+	meshlets.clear();
+	positions_cache.clear();
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
@@ -135,7 +149,11 @@ void Mesh::enableBuffers(Shader* sh)
 		offset_uv = sizeof(Vector3) + sizeof(Vector3);
 	}
 
-	if (vertex_location != -1)
+	//quantized meshes need the shader to decode them
+	sh->setInt(UNIFORM("u_quantized"), quantized.size() ? 1 : 0);
+	if (quantized.size())
+		enableQuantizedBuffers(sh);
+	else if (vertex_location != -1)
 	{
 		glEnableVertexAttribArray(vertex_location);
 		if (vertices_vbo_id || interleaved_vbo_id)
@@ -148,8 +166,11 @@ void Mesh::enableBuffers(Shader* sh)
 		checkGLErrors();
 	}
 
-	normal_location = -1;
-	if (normals.size() || spacing)
+	//the quantized stream already enabled a_normal and a_coord, disableBuffers needs their locations
+	bool has_float_streams = quantized.size() == 0;
+	if (has_float_streams)
+		normal_location = -1;
+	if (has_float_streams && (normals.size() || spacing))
 	{
 		normal_location = sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
@@ -158,7 +179,7 @@ void Mesh::enableBuffers(Shader* sh)
 			if (normals_vbo_id || interleaved_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
+				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)(uintptr_t)offset_normal);
 			}
 			else
 				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
@@ -166,8 +187,9 @@ void Mesh::enableBuffers(Shader* sh)
 		checkGLErrors();
 	}
 
-	uv_location = -1;
-	if (uvs.size() || spacing)
+	if (has_float_streams)
+		uv_location = -1;
+	if (has_float_streams && (uvs.size() || spacing))
 	{
 		uv_location = sh->getAttribLocation("a_coord");
 		if (uv_location != -1)
@@ -176,7 +198,7 @@ void Mesh::enableBuffers(Shader* sh)
 			if (uvs_vbo_id || interleaved_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)(uintptr_t)offset_uv);
 			}
 			else
 				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
@@ -255,7 +277,41 @@ void Mesh::enableBuffers(Shader* sh)
 
 }
 
-void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
+//the vertex, normal and uv attributes come from the quantized stream, the rest of streams are enabled as usual
+void Mesh::enableQuantizedBuffers(Shader* sh)
+{
+	sh->setVector3(UNIFORM("u_quant_offset"), aabb_min);
+	sh->setVector3(UNIFORM("u_quant_scale"), aabb_max - aabb_min);
+
+	if (interleaved_vbo_id)
+		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id);
+	//offsets inside the VBO, or addresses in the CPU if it was not uploaded
+	uintptr_t base = interleaved_vbo_id ? 0 : (uintptr_t)&quantized[0];
+	int spacing = sizeof(tQuantized);
+
+	if (vertex_location != -1)
+	{
+		glEnableVertexAttribArray(vertex_location);
+		glVertexAttribPointer(vertex_location, 3, GL_UNSIGNED_SHORT, GL_TRUE, spacing, (void*)(base + offsetof(tQuantized, vertex)));
+	}
+
+	normal_location = sh->getAttribLocation("a_normal");
+	if (normal_location != -1)
+	{
+		glEnableVertexAttribArray(normal_location);
+		glVertexAttribPointer(normal_location, 2, GL_SHORT, GL_TRUE, spacing, (void*)(base + offsetof(tQuantized, normal)));
+	}
+
+	uv_location = sh->getAttribLocation("a_coord");
+	if (uv_location != -1)
+	{
+		glEnableVertexAttribArray(uv_location);
+		glVertexAttribPointer(uv_location, 2, GL_HALF_FLOAT, GL_FALSE, spacing, (void*)(base + offsetof(tQuantized, uv)));
+	}
+	checkGLErrors();
+}
+
+void Mesh::render(unsigned int primitive, int submesh_id, int num_instances, int lod)
 {
     //return;
 
@@ -265,14 +321,14 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert(getNumVertices() && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 	checkGLErrors();
 
 	//draw call
-	drawCall(primitive, submesh_id, num_instances);
+	drawCall(primitive, submesh_id, num_instances, lod);
 	checkGLErrors();
 
 	//unbind them
@@ -280,22 +336,24 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	checkGLErrors();
 }
 
-void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
+void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances, int lod)
 {
 	int start = 0; //in primitives
-	int size = (int)vertices.size();
+	int size = (int)getNumVertices();
 	if (m_indices.size())
-		size = (int)m_indices.size();
-	else
-	if (interleaved.size())
-		size = (int)interleaved.size();
+		size = (int)getNumIndices();
 
 	if (submesh_id > -1)
 	{
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
+	}
+	else if (lod > 0 && lod < lods.size())
+	{
+		start = lods[lod].start;
+		size = lods[lod].length;
 	}
 
 	//DRAW
@@ -305,8 +363,8 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
+			#ifdef USE_INSTANCING
+				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(unsigned int)), num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
             #endif
@@ -318,20 +376,20 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			{
 				/*if (size != 90)*/ {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(unsigned int)));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
 			else
-				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its an unsigned int pointer
 		}
 	}
 	else
 	{
 		if (num_instances > 0)
 		{
-			#ifdef OPENGL_ES3
+			#ifdef USE_INSTANCING
 				glDrawArraysInstanced(primitive, start, size, num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
@@ -345,6 +403,46 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	num_meshes_rendered++;
 }
 
+void Mesh::renderRanges(unsigned int primitive, const std::vector<sIndexRange>& ranges)
+{
+	Shader* shader = Shader::current;
+	assert(shader && shader->compiled && "no shader or shader not compiled or enabled");
+	assert(indices_vbo_id && "indices must be uploaded to the GPU");
+	if (ranges.empty())
+		return;
+
+	enableBuffers(shader);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
+	int num_indices = 0;
+	#ifdef OPENGL_ES3
+		for (const sIndexRange& range : ranges)
+		{
+			glDrawElements(primitive, range.length, GL_UNSIGNED_INT, (void*)(range.start * sizeof(unsigned int)));
+			num_indices += range.length;
+		}
+	#else
+		static std::vector<GLsizei> counts;
+		static std::vector<const void*> offsets;
+		counts.resize(ranges.size());
+		offsets.resize(ranges.size());
+		for (int i = 0; i < ranges.size(); ++i)
+		{
+			counts[i] = ranges[i].length;
+			offsets[i] = (const void*)(ranges[i].start * sizeof(unsigned int));
+			num_indices += ranges[i].length;
+		}
+		glMultiDrawElements(primitive, &counts[0], GL_UNSIGNED_INT, &offsets[0], (GLsizei)ranges.size());
+	#endif
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	checkGLErrors();
+	disableBuffers(shader);
+
+	num_triangles_rendered += num_indices / 3;
+	num_meshes_rendered++;
+}
+
 void Mesh::disableBuffers(Shader* shader)
 {
 	if (vertex_location != -1) glDisableVertexAttribArray(vertex_location);
@@ -361,19 +459,19 @@ void Mesh::disableBuffers(Shader* shader)
 GLuint instances_buffer_id = 0;
 
 //should be faster but in some system it is slower
-void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
+void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances, int lod)
 {
 	if (!num_instances)
 		return;
 
-	#ifdef OPENGL_ES3
+	#ifdef USE_INSTANCING
 		Shader* shader = Shader::current;
 		assert(shader && "shader must be enabled");
 
 		if (instances_buffer_id == 0)
-			glGenBuffersARB(1, &instances_buffer_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
+			glGenBuffers(1, &instances_buffer_id);
+		glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+		glBufferData(GL_ARRAY_BUFFER, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW);
 
 		int attribLocation = shader->getAttribLocation("u_model");
 		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
@@ -385,13 +483,14 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 		{
 			glEnableVertexAttribArray(attribLocation + k );
 			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
+			const Uint8* addr = (Uint8*)(uintptr_t)offset;
 			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
 			glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
 		}
 
-		//regular render
-		render(primitive, 0, num_instances);
+		//regular render (the instances buffer must be unbound, enableBuffers binds the mesh ones)
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		render(primitive, -1, num_instances, lod);
 
 		//disable instanced attribs
 		for (int k = 0; k < 4; ++k)
@@ -430,7 +529,7 @@ void Mesh::renderFixedPipeline(int primitive)
 		if (normals_vbo_id || interleaved_vbo_id)
 		{
 			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
-			glNormalPointer(GL_FLOAT, interleave_offset, (void*)offset_normal);
+			glNormalPointer(GL_FLOAT, interleave_offset, (void*)(uintptr_t)offset_normal);
 		}
 		else
 			glNormalPointer(GL_FLOAT, interleave_offset, interleave_offset ? &interleaved[0].normal : &normals[0]);
@@ -442,7 +541,7 @@ void Mesh::renderFixedPipeline(int primitive)
 		if (uvs_vbo_id || interleaved_vbo_id)
 		{
 			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
-			glTexCoordPointer(2, GL_FLOAT, interleave_offset, (void*)offset_uv);
+			glTexCoordPointer(2, GL_FLOAT, interleave_offset, (void*)(uintptr_t)offset_uv);
 		}
 		else
 			glTexCoordPointer(2, GL_FLOAT, interleave_offset, interleave_offset ? &interleaved[0].uv : &uvs[0]);
@@ -486,7 +585,7 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 	if (bones_loc != -1)
 	{
 		skeleton->computeFinalBoneMatrices(bone_matrices, this);
-		shader->setUniform("u_bones", bone_matrices );
+		shader->setUniform(UNIFORM("u_bones"), bone_matrices );
 	}
 
 	render(primitive);
@@ -501,7 +600,7 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 
 void Mesh::uploadToVRAM()
 {
-	assert(vertices.size() || interleaved.size());
+	assert(getNumVertices());
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -509,7 +608,15 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
+	if (quantized.size())
+	{
+		// Vertex,Normal,UV quantized
+		if (interleaved_vbo_id == 0)
+			glGenBuffersARB(1, &interleaved_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, quantized.size() * sizeof(tQuantized), &quantized[0], GL_STATIC_DRAW_ARB);
+	}
+	else if (interleaved.size())
 	{
 		// Vertex,Normal,UV
 		if (interleaved_vbo_id == 0)
@@ -600,20 +707,29 @@ bool Mesh::createCollisionModel(bool is_static)
 
 	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
 
-	if (m_indices.size()) //indexed
+	if (m_indices.size()) //indexed, the LODs are not used
 	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
+		unsigned int num_indices = getNumIndices();
+		collision_model->setTriangleNumber((int)num_indices / 3);
 
 		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
+			for (unsigned int i = 0; i < num_indices; i+=3)
 			{
 				auto v1 = interleaved[m_indices[i+0]];
 				auto v2 = interleaved[m_indices[i+1]];
 				auto v3 = interleaved[m_indices[i+2]];
 				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
 			}
+		else if (quantized.size())
+			for (unsigned int i = 0; i < num_indices; i+=3)
+			{
+				Vector3 v1 = getVertexPosition(m_indices[i+0]);
+				Vector3 v2 = getVertexPosition(m_indices[i+1]);
+				Vector3 v3 = getVertexPosition(m_indices[i+2]);
+				collision_model->addTriangle(v1.v, v2.v, v3.v);
+			}
 		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
+		for (unsigned int i = 0; i < num_indices; i+=3)
 		{
 			auto v1 = vertices[m_indices[i+0]];
 			auto v2 = vertices[m_indices[i+1]];
@@ -632,6 +748,17 @@ bool Mesh::createCollisionModel(bool is_static)
 			collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
 		}
 	}
+	else if (quantized.size()) //quantized
+	{
+		collision_model->setTriangleNumber((int)quantized.size() / 3);
+		for (unsigned int i = 0; i < quantized.size(); i+=3)
+		{
+			Vector3 v1 = getVertexPosition(i);
+			Vector3 v2 = getVertexPosition(i + 1);
+			Vector3 v3 = getVertexPosition(i + 2);
+			collision_model->addTriangle(v1.v, v2.v, v3.v);
+		}
+	}
 	else if (vertices.size()) //non interleaved
 	{
 		collision_model->setTriangleNumber((int)vertices.size() / 3);
@@ -735,126 +862,453 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
-typedef struct 
+//moves the vertices to keep only the ones in the list (sorted), in place
+template<typename T> static void compactStream(std::vector<T>& container, const std::vector<unsigned int>& vertices_to_keep, int num_vertices)
 {
-	int version;
-	int header_bytes;
-	int size;
-	int num_indices;
-	Vector3 aabb_min;
-	Vector3	aabb_max;
-	Vector3	center;
-	Vector3	halfsize;
-	float radius;
-	int num_bones;
-	int num_submeshes;
-	Matrix44 bind_matrix;
-	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
-} sMeshInfo;
+	if (container.size() != num_vertices) //streams that are not per vertex are left as they are
+		return;
+	for (unsigned int i = 0; i < vertices_to_keep.size(); ++i)
+		container[i] = container[vertices_to_keep[i]];
+	container.resize(vertices_to_keep.size());
+}
 
-bool Mesh::readBin(const char* filename, bool bFromNetwork)
+bool Mesh::weldVertices()
 {
-	FILE *f;
-	assert(filename);
+	if (m_indices.size() || interleaved.size() || quantized.size() || !vertices.size())
+		return false;
 
-	struct stat stbuffer;
+	//all the streams of a vertex are compared together, so we store them in a single key
+	int num = (int)vertices.size();
+	struct sStream { const char* data; int size; };
+	std::vector<sStream> streams;
+	streams.push_back({ (const char*)&vertices[0], sizeof(Vector3) });
+	if (normals.size() == num) streams.push_back({ (const char*)&normals[0], sizeof(Vector3) });
+	if (uvs.size() == num) streams.push_back({ (const char*)&uvs[0], sizeof(Vector2) });
+	if (m_uvs1.size() == num) streams.push_back({ (const char*)&m_uvs1[0], sizeof(Vector2) });
+	if (colors.size() == num) streams.push_back({ (const char*)&colors[0], sizeof(Vector4) });
+	if (bones.size() == num) streams.push_back({ (const char*)&bones[0], sizeof(Vector4ub) });
+	if (weights.size() == num) streams.push_back({ (const char*)&weights[0], sizeof(Vector4) });
+
+	int key_size = 0;
+	for (sStream& stream : streams)
+		key_size += stream.size;
+	std::vector<char> keys(num * key_size);
+	for (int i = 0; i < num; ++i)
+	{
+		char* key = &keys[i * key_size];
+		for (sStream& stream : streams)
+		{
+			memcpy(key, stream.data + i * stream.size, stream.size);
+			key += stream.size;
+		}
+	}
 
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
+	//open addressing table with the first vertex of every different key
+	unsigned int table_size = 1;
+	while (table_size < num * 2)
+		table_size <<= 1;
+	std::vector<int> table(table_size, -1);
+	std::vector<unsigned int> remap(num);
+	std::vector<unsigned int> unique_vertices;
+	m_indices.resize(num);
+
+	for (int i = 0; i < num; ++i)
+	{
+		const char* key = &keys[i * key_size];
+		uint64 hash = 14695981039346656037ULL; //FNV-1a
+		for (int j = 0; j < key_size; ++j)
+			hash = (hash ^ (uint8)key[j]) * 1099511628211ULL;
+
+		unsigned int slot = (unsigned int)hash & (table_size - 1);
+		while (table[slot] != -1 && memcmp(&keys[table[slot] * key_size], key, key_size) != 0)
+			slot = (slot + 1) & (table_size - 1);
+		if (table[slot] == -1)
+		{
+			table[slot] = i;
+			remap[i] = (unsigned int)unique_vertices.size();
+			unique_vertices.push_back(i);
+		}
+		m_indices[i] = remap[table[slot]];
+	}
+
+	compactStream(vertices, unique_vertices, num);
+	compactStream(normals, unique_vertices, num);
+	compactStream(uvs, unique_vertices, num);
+	compactStream(m_uvs1, unique_vertices, num);
+	compactStream(colors, unique_vertices, num);
+	compactStream(bones, unique_vertices, num);
+	compactStream(weights, unique_vertices, num);
+	return true;
+}
+
+template<typename T> static void remapStream(std::vector<T>& container, const std::vector<int>& remap, int num_used)
+{
+	if (container.size() != remap.size())
+		return;
+	std::vector<T> result(num_used);
+	for (int i = 0; i < remap.size(); ++i)
+		if (remap[i] != -1)
+			result[remap[i]] = container[i];
+	container.swap(result);
+}
+
+void Mesh::remapVertices(const std::vector<int>& remap, int num_used)
+{
+	remapStream(vertices, remap, num_used);
+	remapStream(normals, remap, num_used);
+	remapStream(uvs, remap, num_used);
+	remapStream(m_uvs1, remap, num_used);
+	remapStream(colors, remap, num_used);
+	remapStream(interleaved, remap, num_used);
+	remapStream(quantized, remap, num_used);
+	remapStream(bones, remap, num_used);
+	remapStream(weights, remap, num_used);
+}
+
+bool Mesh::optimize()
+{
+	if (!m_indices.size())
 		return false;
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+	int num_vertices = (int)getNumVertices();
 
-	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+	std::vector<Vector3> positions(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		positions[i] = getVertexPosition(i);
+
+	//triangles cannot move from one submesh to another
+	if (submeshes.size())
+		for (sSubmeshInfo& submesh : submeshes)
+		{
+			optimizeVertexCache(&m_indices[submesh.start], submesh.length, num_vertices);
+			optimizeOverdraw(&m_indices[submesh.start], submesh.length, &positions[0], num_vertices);
+		}
+	else
 	{
-		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
-		return false;
+		optimizeVertexCache(&m_indices[0], (int)getNumIndices(), num_vertices);
+		optimizeOverdraw(&m_indices[0], (int)getNumIndices(), &positions[0], num_vertices);
+	}
+	for (int i = 1; i < lods.size(); ++i)
+	{
+		optimizeVertexCache(&m_indices[lods[i].start], lods[i].length, num_vertices);
+		optimizeOverdraw(&m_indices[lods[i].start], lods[i].length, &positions[0], num_vertices);
 	}
 
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
+	meshlets.clear(); //the triangles moved, they must be built again
+	positions_cache.clear();
 
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
-	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+	std::vector<int> remap;
+	int num_used = optimizeVertexFetch(&m_indices[0], (int)m_indices.size(), num_vertices, remap);
+	remapVertices(remap, num_used);
+	return true;
+}
+
+bool Mesh::generateLODs()
+{
+	if (!m_indices.size() || lods.size())
 		return false;
-	}
 
-	if (info.streams[0] == 'I')
+	int num_vertices = (int)getNumVertices();
+	std::vector<Vector3> positions(num_vertices);
+	Vector3 min_pos = getVertexPosition(0);
+	Vector3 max_pos = min_pos;
+	for (int i = 0; i < num_vertices; ++i)
 	{
-		interleaved.resize(info.size);
-		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
-		pos += sizeof(tInterleaved) * info.size;
+		positions[i] = getVertexPosition(i);
+		min_pos.setMin(positions[i]);
+		max_pos.setMax(positions[i]);
 	}
-	else if (info.streams[0] == 'V')
+
+	//the simplifier measures the error relative to the biggest side of the aabb, we store it relative to the radius
+	Vector3 size = max_pos - min_pos;
+	float radius = size.length() * 0.5f;
+	if (radius == 0.0f)
+		return false;
+	float to_radius = std::max(size.x, std::max(size.y, size.z)) / radius;
+
+	sMeshLOD original = { 0, (int)m_indices.size(), 0.0f };
+	lods.push_back(original);
+
+	//every LOD has half the triangles of the previous one, it is simplified from the previous so it is faster
+	std::vector<unsigned int> source = m_indices;
+	std::vector<unsigned int> simplified;
+	while (lods.size() < MESH_MAX_LODS)
 	{
-		vertices.resize(info.size);
-		memcpy((void*)&vertices[0], pos, sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		int target = (int)(source.size() / 6) * 3;
+		if (target < 32 * 3)
+			break;
+		float error = 0.0f;
+		simplifyMesh(simplified, &source[0], (int)source.size(), &positions[0], num_vertices, target, 0.1f, &error);
+		if (simplified.size() > source.size() * 0.8f)
+			break; //the borders or the max error do not let it simplify more
+		optimizeVertexCache(&simplified[0], (int)simplified.size(), num_vertices);
+
+		//the errors of every step are added, it is an upper bound of the error to the original
+		sMeshLOD lod = { (int)m_indices.size(), (int)simplified.size(), lods.back().error + error * to_radius };
+		m_indices.insert(m_indices.end(), simplified.begin(), simplified.end());
+		lods.push_back(lod);
+		source.swap(simplified);
 	}
 
-	if (info.streams[1] == 'N')
+	if (lods.size() == 1)
 	{
-		normals.resize(info.size);
-		memcpy((void*)&normals[0],pos,sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		lods.clear();
+		return false;
 	}
+	return true;
+}
 
-	if (info.streams[2] == 'U')
+bool Mesh::buildMeshlets()
+{
+	if (!m_indices.size() || meshlets.size())
+		return false;
+
+	int num_vertices = (int)getNumVertices();
+	std::vector<Vector3> positions(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		positions[i] = getVertexPosition(i);
+
+	//meshlets cannot cross submeshes
+	if (submeshes.size())
+		for (sSubmeshInfo& submesh : submeshes)
+			::buildMeshlets(meshlets, &m_indices[0], submesh.start, submesh.length, &positions[0], num_vertices);
+	else
+		::buildMeshlets(meshlets, &m_indices[0], 0, (int)getNumIndices(), &positions[0], num_vertices);
+	return true;
+}
+
+int Mesh::cullMeshlets(const Matrix44& model, Camera* camera, bool backface_culling, std::vector<sIndexRange>& ranges)
+{
+	ranges.clear();
+	if (meshlets.empty())
+		return 0;
+	return ::cullMeshlets(ranges, &meshlets[0], (int)meshlets.size(), model, camera, backface_culling);
+}
+
+int Mesh::getLOD(float projected_radius, float max_pixel_error)
+{
+	int lod = 0;
+	for (int i = 1; i < lods.size() && lods[i].error * projected_radius <= max_pixel_error; ++i)
+		lod = i;
+	return lod;
+}
+
+//rounds to nearest, values too small for a half become zero and too big become infinite
+static uint16 floatToHalf(float value)
+{
+	uint32 bits;
+	memcpy(&bits, &value, sizeof(float));
+	uint16 sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	uint32 mantissa = bits & 0x7fffff;
+	if (exponent <= 0)
+		return sign;
+	if (exponent >= 31)
+		return sign | 0x7c00;
+	uint16 half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		half++; //if the mantissa overflows it goes to the exponent, which is right
+	return half;
+}
+
+//projects the normal in an octahedron and unfolds it in a square, two values are enough
+static void encodeOctahedral(const Vector3& n, int16* result)
+{
+	float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 == 0.0f)
 	{
-		uvs.resize(info.size);
-		memcpy((void*)&uvs[0],pos,sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		result[0] = result[1] = 0;
+		return;
 	}
-
-	if (info.streams[3] == 'C')
+	float x = n.x / l1;
+	float y = n.y / l1;
+	if (n.z < 0.0f)
 	{
-		colors.resize(info.size);
-		memcpy((void*)&colors[0],pos,sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		float folded_x = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = folded_x;
 	}
+	result[0] = (int16)roundf(clamp(x, -1.0f, 1.0f) * 32767.0f);
+	result[1] = (int16)roundf(clamp(y, -1.0f, 1.0f) * 32767.0f);
+}
+
+static uint16 quantizeUnorm16(float value)
+{
+	return (uint16)roundf(clamp(value, 0.0f, 1.0f) * 65535.0f);
+}
+
+bool Mesh::quantizeBuffers()
+{
+	bool is_interleaved = interleaved.size() != 0;
+	int num = is_interleaved ? (int)interleaved.size() : (int)vertices.size();
+	if (!num || quantized.size())
+		return false;
+
+	createCollisionModel(); //with full precision
+	updateBoundingBox(); //positions are stored relative to it
 
-	if (info.streams[4] == 'I')
+	Vector3 size = aabb_max - aabb_min;
+	Vector3 inv_size(size.x ? 1.0f / size.x : 0.0f, size.y ? 1.0f / size.y : 0.0f, size.z ? 1.0f / size.z : 0.0f);
+
+	quantized.resize(num);
+	for (int i = 0; i < num; ++i)
 	{
-		m_indices.resize(info.num_indices);
-		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		Vector3 pos = is_interleaved ? interleaved[i].vertex : vertices[i];
+		Vector3 normal = is_interleaved ? interleaved[i].normal : (normals.size() ? normals[i] : Vector3(0, 1, 0));
+		Vector2 uv = is_interleaved ? interleaved[i].uv : (uvs.size() ? uvs[i] : Vector2(0, 0));
+
+		tQuantized& q = quantized[i];
+		q.vertex[0] = quantizeUnorm16((pos.x - aabb_min.x) * inv_size.x);
+		q.vertex[1] = quantizeUnorm16((pos.y - aabb_min.y) * inv_size.y);
+		q.vertex[2] = quantizeUnorm16((pos.z - aabb_min.z) * inv_size.z);
+		q.vertex[3] = 0;
+		encodeOctahedral(normal, q.normal);
+		q.uv[0] = floatToHalf(uv.x);
+		q.uv[1] = floatToHalf(uv.y);
 	}
 
-	if (info.streams[5] == 'B')
+	//free the memory, not only the size
+	std::vector<tInterleaved>().swap(interleaved);
+	std::vector<Vector3>().swap(vertices);
+	std::vector<Vector3>().swap(normals);
+	std::vector<Vector2>().swap(uvs);
+
+	return true;
+}
+
+Vector3 Mesh::getVertexPosition(unsigned int index)
+{
+	if (quantized.size())
 	{
-		bones.resize(info.size);
-		memcpy((void*)&bones[0], pos, sizeof(Vector4ub) * info.size);
-		pos += sizeof(Vector4ub) * info.size;
+		const uint16* v = quantized[index].vertex;
+		Vector3 size = aabb_max - aabb_min;
+		return Vector3(aabb_min.x + (v[0] / 65535.0f) * size.x, aabb_min.y + (v[1] / 65535.0f) * size.y, aabb_min.z + (v[2] / 65535.0f) * size.z);
 	}
+	if (interleaved.size())
+		return interleaved[index].vertex;
+	return vertices[index];
+}
 
-	if (info.streams[6] == 'W')
+const Vector3* Mesh::getPositions()
+{
+	if (!quantized.size() && !interleaved.size())
+		return vertices.size() ? &vertices[0] : NULL;
+	int num_vertices = (int)getNumVertices();
+	if (positions_cache.size() != num_vertices)
 	{
-		weights.resize(info.size);
-		memcpy((void*)&weights[0], pos, sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		positions_cache.resize(num_vertices);
+		for (int i = 0; i < num_vertices; ++i)
+			positions_cache[i] = getVertexPosition(i);
 	}
+	return &positions_cache[0];
+}
+
+//every stream is stored at an offset aligned to MBIN_ALIGNMENT (from the start of the file)
+//so the file can be mapped in memory and every stream copied with a single memcpy, without parsing
+#define MBIN_ALIGNMENT 16
+
+enum eMeshStream {
+	MBIN_INTERLEAVED,
+	MBIN_VERTICES,
+	MBIN_NORMALS,
+	MBIN_UVS,
+	MBIN_COLORS,
+	MBIN_INDICES,
+	MBIN_BONES,
+	MBIN_WEIGHTS,
+	MBIN_UVS1,
+	MBIN_BONES_INFO,
+	MBIN_SUBMESHES,
+	MBIN_QUANTIZED,
+	MBIN_LODS,
+	MBIN_MESHLETS,
+	MBIN_NUM_STREAMS
+};
+
+typedef struct
+{
+	uint64 offset; //in bytes from the start of the file
+	uint64 size; //in bytes, 0 if the mesh doesnt have this stream
+} sMeshStream;
+
+typedef struct 
+{
+	int version;
+	int header_bytes;
+	int size;
+	int num_indices;
+	Vector3 aabb_min;
+	Vector3	aabb_max;
+	Vector3	center;
+	Vector3	halfsize;
+	float radius;
+	int num_bones;
+	int num_submeshes;
+	Matrix44 bind_matrix;
+	sMeshStream streams[MBIN_NUM_STREAMS];
+	char extra[32]; //unused
+} sMeshInfo;
 
-	if (info.streams[7] == 'u')
+//copies the stream straight from the mapped file to the container (the only copy in the CPU), returns false if the stream is out of the file
+//the streams are not uploaded from the mapping: the collision model, the meshlet culling and the attributes enabled in render use the vectors
+template<typename T> static bool readStream(const MappedFile& file, const sMeshStream& stream, std::vector<T>& container)
+{
+	if (!stream.size)
+		return true;
+	if (stream.offset % MBIN_ALIGNMENT || stream.size % sizeof(T) || stream.offset + stream.size > file.size)
+		return false;
+	const T* start = (const T*)(file.data + stream.offset);
+	container.assign(start, start + stream.size / sizeof(T));
+	return true;
+}
+
+bool Mesh::readBin(const char* filename, bool bFromNetwork)
+{
+	assert(filename);
+
+	MappedFile file;
+	if (!mapFile(filename, file))
+		return false;
+
+	//watermark
+	if (file.size < 4 + sizeof(sMeshInfo) || memcmp(file.data, "MBIN", 4) != 0)
 	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		unmapFile(file);
+		return false;
 	}
 
-	if (info.num_bones)
+	sMeshInfo info;
+	memcpy(&info, file.data + 4, sizeof(sMeshInfo));
+
+	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
 	{
-		bones_info.resize(info.num_bones);
-		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
-		pos += sizeof(BoneInfo) * info.num_bones;
+		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		unmapFile(file);
+		return false;
+	}
+
+	bool valid = readStream(file, info.streams[MBIN_INTERLEAVED], interleaved) &&
+		readStream(file, info.streams[MBIN_VERTICES], vertices) &&
+		readStream(file, info.streams[MBIN_NORMALS], normals) &&
+		readStream(file, info.streams[MBIN_UVS], uvs) &&
+		readStream(file, info.streams[MBIN_COLORS], colors) &&
+		readStream(file, info.streams[MBIN_INDICES], m_indices) &&
+		readStream(file, info.streams[MBIN_BONES], bones) &&
+		readStream(file, info.streams[MBIN_WEIGHTS], weights) &&
+		readStream(file, info.streams[MBIN_UVS1], m_uvs1) &&
+		readStream(file, info.streams[MBIN_BONES_INFO], bones_info) &&
+		readStream(file, info.streams[MBIN_SUBMESHES], submeshes) &&
+		readStream(file, info.streams[MBIN_QUANTIZED], quantized) &&
+		readStream(file, info.streams[MBIN_LODS], lods) &&
+		readStream(file, info.streams[MBIN_MESHLETS], meshlets);
+	unmapFile(file);
+
+	if (!valid)
+	{
+		std::cout << "[ERROR] loading BIN: truncated file: " << filename << std::endl;
+		clear();
+		return false;
 	}
 
 	aabb_max = info.aabb_max;
@@ -864,17 +1318,13 @@ bool Mesh::readBin(const char* filename, bool bFromNetwork)
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
 
-	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
-	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
-
 	createCollisionModel();
 	return true;
 }
 
 bool Mesh::writeBin(const char* filename)
 {
-	assert( vertices.size() || interleaved.size() );
+	assert( getNumVertices() );
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
@@ -885,14 +1335,11 @@ bool Mesh::writeBin(const char* filename)
 		return false;
 	}
 
-	//watermark
-	fwrite("MBIN",sizeof(char),4,f);
-
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
 	info.header_bytes = sizeof(sMeshInfo);
-	info.size = interleaved.size() ? interleaved.size() : vertices.size();
+	info.size = getNumVertices();
 	info.num_indices = m_indices.size();
 	info.aabb_max = aabb_max;
 	info.aabb_min = aabb_min;
@@ -903,47 +1350,52 @@ bool Mesh::writeBin(const char* filename)
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
 
-	info.streams[0] = interleaved.size() ? 'I' : 'V';
-	info.streams[1] = normals.size() ? 'N' : ' ';
-	info.streams[2] = uvs.size() ? 'U' : ' ';
-	info.streams[3] = colors.size() ? 'C' : ' ';
-	info.streams[4] = m_indices.size() ? 'I' : ' ';
-	info.streams[5] = bones.size() ? 'B' : ' ';
-	info.streams[6] = weights.size() ? 'W' : ' ';
-	info.streams[7] = m_uvs1.size() ? 'u' : ' '; //uv second set
-
-	//write info
+	const void* streams_data[MBIN_NUM_STREAMS] = {
+		interleaved.data(), vertices.data(), normals.data(), uvs.data(), colors.data(), m_indices.data(),
+		bones.data(), weights.data(), m_uvs1.data(), bones_info.data(), submeshes.data(), quantized.data(), lods.data(), meshlets.data() };
+	info.streams[MBIN_INTERLEAVED].size = interleaved.size() * sizeof(tInterleaved);
+	info.streams[MBIN_VERTICES].size = vertices.size() * sizeof(Vector3);
+	info.streams[MBIN_NORMALS].size = normals.size() * sizeof(Vector3);
+	info.streams[MBIN_UVS].size = uvs.size() * sizeof(Vector2);
+	info.streams[MBIN_COLORS].size = colors.size() * sizeof(Vector4);
+	info.streams[MBIN_INDICES].size = m_indices.size() * sizeof(unsigned int);
+	info.streams[MBIN_BONES].size = bones.size() * sizeof(Vector4ub);
+	info.streams[MBIN_WEIGHTS].size = weights.size() * sizeof(Vector4);
+	info.streams[MBIN_UVS1].size = m_uvs1.size() * sizeof(Vector2);
+	info.streams[MBIN_BONES_INFO].size = bones_info.size() * sizeof(BoneInfo);
+	info.streams[MBIN_SUBMESHES].size = submeshes.size() * sizeof(sSubmeshInfo);
+	info.streams[MBIN_QUANTIZED].size = quantized.size() * sizeof(tQuantized);
+	info.streams[MBIN_LODS].size = lods.size() * sizeof(sMeshLOD);
+	info.streams[MBIN_MESHLETS].size = meshlets.size() * sizeof(sMeshlet);
+
+	//place the streams after the header
+	uint64 offset = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < MBIN_NUM_STREAMS; ++i)
+	{
+		if (!info.streams[i].size)
+			continue;
+		offset = (offset + MBIN_ALIGNMENT - 1) & ~(uint64)(MBIN_ALIGNMENT - 1);
+		info.streams[i].offset = offset;
+		offset += info.streams[i].size;
+	}
+
+	//watermark and info
+	fwrite("MBIN",sizeof(char),4,f);
 	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
-	//write streams
-	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
-	else
+	//write streams, padding till its offset
+	const char padding[MBIN_ALIGNMENT] = { 0 };
+	uint64 pos = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < MBIN_NUM_STREAMS; ++i)
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3), 1, f);
-		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3), 1, f);
-		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2), 1, f);
+		const sMeshStream& stream = info.streams[i];
+		if (!stream.size)
+			continue;
+		fwrite(padding, 1, stream.offset - pos, f);
+		fwrite(streams_data[i], stream.size, 1, f);
+		pos = stream.offset + stream.size;
 	}
 
-	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4), 1, f);
-
-	if (m_indices.size())
-		fwrite((void*)&m_indices[0], m_indices.size() * sizeof(unsigned int), 1, f);
-
-	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
-	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (m_uvs1.size())
-		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
-
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
-
 	fclose(f);
 	return true;
 }
@@ -1080,138 +1532,22 @@ bool Mesh::loadASE(const char* filename)
 
 bool Mesh::loadOBJ(const char* filename)
 {
-	std::string data;
-	if(!readFile(filename,data))
+	MappedFile file;
+	if (!mapFile(filename, file))
+		return false;
+	sOBJData obj;
+	bool result = parseOBJ(file.data, file.size, obj);
+	unmapFile(file);
+	if (!result)
 		return false;
-	char* pos = &data[0];
-	char line[255];
-	int i = 0;
-
-	std::vector<Vector3> indexed_positions;
-	std::vector<Vector3> indexed_normals;
-	std::vector<Vector2> indexed_uvs;
-
-	const float max_float = 10000000;
-	const float min_float = -10000000;
-	aabb_min.set(max_float,max_float,max_float);
-	aabb_max.set(min_float,min_float,min_float);
-
-	unsigned int vertex_i = 0;
-
-	sSubmeshInfo submesh_info;
-	int last_submesh_vertex = 0;
-	memset(&submesh_info, 0, sizeof(submesh_info));
-
-	//parse file
-	while(*pos != 0)
-	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
-
-		//read one line
-		i = 0;
-		while(i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		memcpy(line,pos,i);
-		line[i] = 0;
-		pos = pos + i;
-
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
-
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line," ");
-
-		if (tokens.empty()) continue;
-
-		if (tokens[0] == "v" && tokens.size() == 4)
-		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_positions.push_back(v);
-
-			aabb_min.setMin( v );
-			aabb_max.setMax( v );
-		}
-		else if (tokens[0] == "vt" && tokens.size() >= 3)
-		{
-			Vector2 v((float)atof(tokens[1].c_str()), 1.0 - (float)atof(tokens[2].c_str()) );
-			indexed_uvs.push_back(v);
-		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
-		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_normals.push_back(v);
-		}
-		else if (tokens[0] == "s") //surface? it appears one time before the faces
-		{
-			//process mesh: ????
-			//if (uvs.size() == 0 && indexed_uvs.size() )
-			//	uvs.resize(1);
-		}
-		else if (tokens[0] == "usemtl") //surface? it appears one time before the faces
-		{
-			if (last_submesh_vertex != vertices.size())
-			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy(submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
-			}
-			else
-				strcpy(submesh_info.material, tokens[1].c_str());
-		}
-		else if (tokens[0] == "g") //surface? it appears one time before the faces
-		{
-			if (last_submesh_vertex != vertices.size())
-			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy( submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
-			}
-		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
-		{
-			Vector3 v1,v2,v3;
-			v1.parseFromText( tokens[1].c_str(), '/' );
-
-			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
-			{
-				v2.parseFromText( tokens[iPoly].c_str(), '/' );
-				v3.parseFromText( tokens[iPoly+1].c_str(), '/' );
-
-				vertices.push_back( indexed_positions[ (unsigned int)(v1.x) -1 ] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v2.x) -1] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v3.x) -1] );
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
-
-				if (indexed_uvs.size() > 0)
-				{
-					uvs.push_back( indexed_uvs[(unsigned int)(v1.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v2.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v3.y) -1] );
-				}
-
-				if (indexed_normals.size() > 0)
-				{
-					normals.push_back( indexed_normals[(unsigned int)(v1.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v2.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v3.z) -1] );
-				}
-			}
-		}
-	}
-
-	box.center = (aabb_max + aabb_min) * 0.5;
-	box.halfsize = (aabb_max - box.center);
-	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
 
-	submesh_info.length = vertices.size() - last_submesh_vertex;
-	submeshes.push_back(submesh_info);
+	vertices.swap(obj.positions);
+	uvs.swap(obj.uvs);
+	normals.swap(obj.normals);
+	m_indices.swap(obj.indices);
+	submeshes.swap(obj.submeshes);
+	updateBoundingBox();
+	radius = (float)fmax(aabb_max.length(), aabb_min.length());
 	return true;
 }
 
@@ -1313,6 +1649,74 @@ void Mesh::createCube(Vector3 size)
 	radius = (float)box.halfsize.length();
 }
 
+void Mesh::createSphere(float radius, int slices, int stacks)
+{
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+
+	//the flat faces are inside the round surface, move the vertices out so the faces touch it
+	radius /= (float)(cos(PI / slices) * cos(PI / (2 * stacks)));
+
+	std::vector<Vector3> ring_points((slices + 1) * (stacks + 1));
+	for (int i = 0; i <= stacks; ++i)
+	{
+		float theta = (float)(PI * i / stacks);
+		for (int j = 0; j <= slices; ++j)
+		{
+			float phi = (float)(2.0 * PI * j / slices);
+			ring_points[i * (slices + 1) + j].set(sin(theta) * cos(phi) * radius, cos(theta) * radius, sin(theta) * sin(phi) * radius);
+		}
+	}
+
+	//counter clockwise from outside
+	for (int i = 0; i < stacks; ++i)
+		for (int j = 0; j < slices; ++j)
+		{
+			Vector3& a = ring_points[i * (slices + 1) + j];
+			Vector3& b = ring_points[i * (slices + 1) + j + 1];
+			Vector3& c = ring_points[(i + 1) * (slices + 1) + j];
+			Vector3& d = ring_points[(i + 1) * (slices + 1) + j + 1];
+			if (i != 0) //the first ring is the pole
+			{
+				vertices.push_back(a); vertices.push_back(b); vertices.push_back(c);
+			}
+			if (i != stacks - 1)
+			{
+				vertices.push_back(b); vertices.push_back(d); vertices.push_back(c);
+			}
+		}
+
+	updateBoundingBox();
+}
+
+void Mesh::createCone(float length, float radius, int slices)
+{
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+
+	radius /= (float)cos(PI / slices);
+
+	Vector3 apex(0.0f, 0.0f, 0.0f);
+	Vector3 base_center(0.0f, 0.0f, length);
+	for (int j = 0; j < slices; ++j)
+	{
+		float phi_a = (float)(2.0 * PI * j / slices);
+		float phi_b = (float)(2.0 * PI * (j + 1) / slices);
+		Vector3 a(cos(phi_a) * radius, sin(phi_a) * radius, length);
+		Vector3 b(cos(phi_b) * radius, sin(phi_b) * radius, length);
+
+		//side and base, counter clockwise from outside
+		vertices.push_back(apex); vertices.push_back(b); vertices.push_back(a);
+		vertices.push_back(base_center); vertices.push_back(a); vertices.push_back(b);
+	}
+
+	updateBoundingBox();
+}
+
 void Mesh::createWireBox()
 {
 	const float _verts[] = { -1,-1,-1,  1,-1,-1,  -1,1,-1,  1,1,-1, -1,-1,1,  1,-1,1, -1,1,1,  1,1,1,    -1,-1,-1, -1,1,-1, 1,-1,-1, 1,1,-1, -1,-1,1, -1,1,1, 1,-1,1, 1,1,1,   -1,-1,-1, -1,-1,1, 1,-1,-1, 1,-1,1, -1,1,-1, -1,1,1, 1,1,-1, 1,1,1 };
@@ -1497,7 +1901,7 @@ void Mesh::updateBoundingBox()
 	else if (interleaved.size())
 	{
 		aabb_max = aabb_min = interleaved[0].vertex;
-		for (int i = 1; i < vertices.size(); ++i)
+		for (int i = 1; i < interleaved.size(); ++i)
 		{
 			aabb_min.setMin(interleaved[i].vertex);
 			aabb_max.setMax(interleaved[i].vertex);
@@ -1520,14 +1924,14 @@ void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
 
 	Shader* sh = Shader::getDefaultShader("flat");
 	sh->enable();
-	sh->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
+	sh->setUniform(UNIFORM("u_viewprojection"), Camera::current->viewprojection_matrix);
 
 	Matrix44 matrix;
 	matrix.translate(box.center.x, box.center.y, box.center.z);
 	matrix.scale(box.halfsize.x, box.halfsize.y, box.halfsize.z);
 
-	sh->setUniform("u_color", Vector4(1, 1, 0, 1));
-	sh->setUniform("u_model", matrix * model);
+	sh->setUniform(UNIFORM("u_color"), Vector4(1, 1, 0, 1));
+	sh->setUniform(UNIFORM("u_model"), matrix * model);
 	wire_box->render(GL_LINES);
 
 	if (world_bounding)
@@ -1536,8 +1940,8 @@ void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
 		matrix.setIdentity();
 		matrix.translate(AABB.center.x, AABB.center.y, AABB.center.z);
 		matrix.scale(AABB.halfsize.x, AABB.halfsize.y, AABB.halfsize.z);
-		sh->setUniform("u_model", matrix);
-		sh->setUniform("u_color", Vector4(0, 1, 1, 1));
+		sh->setUniform(UNIFORM("u_model"), matrix);
+		sh->setUniform(UNIFORM("u_color"), Vector4(0, 1, 1, 1));
 		wire_box->render(GL_LINES);
 	}
 
@@ -1599,19 +2003,25 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 	//try loading the binary version
 	if (use_binary && m->readBin(binfilename.c_str(), bFromNetwork) )
 	{
-		if (interleave_meshes && m->interleaved.size() == 0)
+		if (interleave_meshes && m->interleaved.size() == 0 && m->quantized.size() == 0)
 		{
 			std::cout << "[INTERL] ";
 			m->interleaveBuffers();
 		}
 
+		if (quantize_meshes && m->quantized.size() == 0)
+		{
+			std::cout << "[QUANT] ";
+			m->quantizeBuffers();
+		}
+
 		if (auto_upload_to_vram)
 		{
 			std::cout << "[VRAM] ";
 			m->uploadToVRAM();
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		std::cout << "[OK BIN]  Faces: " << m->getNumTriangles() << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 		sMeshesLoaded[filename] = m;
 		return m;
 	}
@@ -1634,6 +2044,19 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		return NULL;
 	}
 
+	//index the vertices and sort them for the GPU caches
+	if (optimize_meshes)
+	{
+		m->weldVertices();
+		m->optimize();
+	}
+
+	if (generate_lods)
+		m->generateLODs();
+
+	if (build_meshlets)
+		m->buildMeshlets();
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
@@ -1641,6 +2064,12 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	if (quantize_meshes)
+	{
+		std::cout << "[QUANT] ";
+		m->quantizeBuffers();
+	}
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
@@ -1648,7 +2077,7 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->uploadToVRAM();
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK]  Faces: " << m->getNumTriangles() << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
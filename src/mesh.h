@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "framework.h"
+#include "mesh_optimizer.h"
 
 #include <map>
 #include <string>
@@ -11,9 +12,17 @@
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
+class Camera; //for culling
 
-//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+//instancing is core since OpenGL 3.3, the osx build uses a legacy context
+#if defined(OPENGL_ES3) || !defined(__APPLE__)
+	#define USE_INSTANCING
+#endif
+
+//version 16: meshlets
+#define MESH_BIN_VERSION 16 //this is used to regenerate bins if the format changes
+
+#define MESH_MAX_LODS 5 //including the original geometry
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -24,8 +33,16 @@ struct sSubmeshInfo
 {
 	char name[64];
 	char material[64];
-	int start;//in primitive
-	int length;//in primitive
+	int start;//in vertices (in indices if the mesh is indexed)
+	int length;//in vertices (in indices if the mesh is indexed)
+};
+
+//simplified version of the whole mesh, its indices are stored after the original ones and use the same vertices
+struct sMeshLOD
+{
+	int start; //in indices
+	int length; //in indices
+	float error; //max distance to the original surface, relative to the radius of the bounding box
 };
 
 class Mesh
@@ -35,9 +52,15 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool quantize_meshes; //loaded meshes will be stored in the compact vertex format (see quantizeBuffers)
+	static bool optimize_meshes; //loaded meshes will be indexed and reordered for the GPU caches (see optimize)
+	static bool generate_lods; //loaded meshes will have simplified versions (see generateLODs)
+	static bool build_meshlets; //loaded meshes will be split in meshlets (see buildMeshlets)
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static int s_MeshID;
 
+	int m_Id; //unique, used to sort render calls by mesh
 	std::string name;
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
@@ -56,7 +79,19 @@ public:
 
 	std::vector< tInterleaved > interleaved; //to render interleaved
 
+	//compact version of the interleaved vertex (16 bytes instead of 32), the shader decodes it
+	struct tQuantized {
+		uint16 vertex[4]; //position normalized inside the aabb (w is padding)
+		int16 normal[2]; //octahedral encoding
+		uint16 uv[2]; //half floats
+	};
+
+	std::vector< tQuantized > quantized; //if it has data then interleaved, vertices, normals and uvs are empty
+
 	std::vector<unsigned int> m_indices; //for indexed meshes
+	std::vector<sMeshLOD> lods; //empty or the first one is the original geometry, from more to less detail
+	std::vector<sMeshlet> meshlets; //groups of triangles of the original geometry that can be culled separately
+	std::vector<Vector3> positions_cache; //positions decoded from the interleaved or quantized streams, for the CPU
 
 	//for animated meshes
 	std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
@@ -76,7 +111,7 @@ public:
 	unsigned int colors_vbo_id;
 
 	unsigned int indices_vbo_id;
-	unsigned int interleaved_vbo_id;
+	unsigned int interleaved_vbo_id; //also used for the quantized stream
 	unsigned int bones_vbo_id;
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
@@ -86,21 +121,32 @@ public:
 
 	void clear();
 
-	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
-	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
+	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0, int lod = 0 );
+	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number, int lod = 0);
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
 	//void renderAnimated(unsigned int primitive, Skeleton *sk);
 
 	void enableBuffers(Shader* shader);
-	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
+	void enableQuantizedBuffers(Shader* shader);
+	void drawCall(unsigned int primitive, int submesh_id, int num_instances, int lod = 0); //the lod is ignored when rendering a submesh
+	void renderRanges(unsigned int primitive, const std::vector<sIndexRange>& ranges); //one draw call with several ranges of indices
 	void disableBuffers(Shader* shader);
 
 	bool readBin(const char* filename, bool bFromNetwork);
 	bool writeBin(const char* filename);
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices() { return quantized.size() ? (unsigned int)quantized.size() : interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	Vector3 getVertexPosition(unsigned int index); //works with any vertex format
+	const Vector3* getPositions(); //all the positions in one array, decoded the first time if the vertices are interleaved or quantized
+	unsigned int getNumIndices() { return lods.size() ? lods[0].length : (unsigned int)m_indices.size(); } //of the original geometry, without the LODs
+	unsigned int getNumTriangles() { return (m_indices.size() ? getNumIndices() : getNumVertices()) / 3; } //welded vertices are shared by several triangles
+	int getLOD(float projected_radius, float max_pixel_error); //the simplest LOD whose error on screen is smaller than max_pixel_error
+
+	//fills ranges with the meshlets inside the frustum (and facing the camera if backface_culling), consecutive ones are merged.
+	//Returns the number of indices visible
+	int cullMeshlets(const Matrix44& model, Camera* camera, bool backface_culling, std::vector<sIndexRange>& ranges);
 
 	//collision testing
 	void* collision_model;
@@ -119,6 +165,8 @@ public:
 	void createPlane(float size);
 	void createSubdividedPlane(float size = 1, int subdivisions = 256, bool centered = false);
 	void createCube(Vector3 size);
+	void createSphere(float radius, int slices = 16, int stacks = 12); //the triangles are outside of the sphere, to use as a volume
+	void createCone(float length, float radius, int slices = 16); //apex in the origin and base in +Z, the triangles are outside of the round cone
 	void createWireBox();
 	void createGrid(float dist);
 	void displace(Image* heightmap, float altitude);
@@ -129,6 +177,12 @@ public:
 	//optimize meshes
 	void uploadToVRAM();
 	bool interleaveBuffers();
+	bool weldVertices(); //for non indexed meshes, removes the duplicated vertices and creates the indices (submeshes are still valid)
+	bool optimize(); //reorders triangles (per submesh) and vertices for the vertex cache, overdraw and vertex fetch, only indexed meshes
+	void remapVertices(const std::vector<int>& remap, int num_used); //moves every vertex to its new index (-1 removes it)
+	bool quantizeBuffers(); //converts the vertices, normals and uvs to the quantized format, the collision model is created before
+	bool generateLODs(); //appends simplified versions of the indices, only indexed meshes (call it after optimize)
+	bool buildMeshlets(); //splits the original geometry (per submesh) in meshlets, only indexed meshes (call it after optimize)
 
 private:
 	bool loadASE(const char* filename);
@@ -0,0 +1,637 @@
+#include "mesh_optimizer.h"
+#include "camera.h"
+
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <unordered_map>
+
+//the cache is simulated with timestamps: a vertex is in a FIFO cache if less than cache_size vertices entered after it
+struct sCacheSimulator {
+	std::vector<int> cache_time;
+	int timestamp;
+	int cache_size;
+
+	sCacheSimulator(int num_vertices, int cache_size) : cache_time(num_vertices, 0), timestamp(cache_size + 1), cache_size(cache_size) {}
+
+	bool isInCache(unsigned int v) { return timestamp - cache_time[v] <= cache_size; }
+	//returns true if it was a miss
+	bool use(unsigned int v)
+	{
+		if (isInCache(v))
+			return false;
+		cache_time[v] = timestamp++;
+		return true;
+	}
+	void flush() { timestamp += cache_size + 1; }
+};
+
+sVertexCacheStats analyzeVertexCache(const unsigned int* indices, int num_indices, int num_vertices, int cache_size)
+{
+	sVertexCacheStats stats;
+	memset(&stats, 0, sizeof(stats));
+	if (num_indices < 3)
+		return stats;
+
+	sCacheSimulator cache(num_vertices, cache_size);
+	std::vector<bool> used(num_vertices, false);
+	int num_used = 0;
+	for (int i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		assert(v < num_vertices);
+		if (cache.use(v))
+			stats.num_transformed++;
+		if (!used[v])
+		{
+			used[v] = true;
+			num_used++;
+		}
+	}
+
+	stats.acmr = stats.num_transformed / (float)(num_indices / 3);
+	stats.atvr = stats.num_transformed / (float)num_used;
+	return stats;
+}
+
+void optimizeVertexCache(unsigned int* indices, int num_indices, int num_vertices, int cache_size)
+{
+	int num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return;
+
+	//triangles of every vertex, stored in a single array
+	std::vector<int> live(num_vertices, 0); //triangles not emitted yet
+	for (int i = 0; i < num_triangles * 3; ++i)
+		live[indices[i]]++;
+	std::vector<int> offsets(num_vertices + 1, 0);
+	for (int v = 0; v < num_vertices; ++v)
+		offsets[v + 1] = offsets[v] + live[v];
+	std::vector<int> adjacency(num_triangles * 3);
+	std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+	for (int t = 0; t < num_triangles; ++t)
+		for (int k = 0; k < 3; ++k)
+			adjacency[fill[indices[t * 3 + k]]++] = t;
+
+	sCacheSimulator cache(num_vertices, cache_size);
+	std::vector<bool> emitted(num_triangles, false);
+	std::vector<unsigned int> dead_end; //recently used vertices, to continue from them when we get stuck
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> result;
+	result.reserve(num_triangles * 3);
+	int cursor = 0; //to find unprocessed vertices when the dead end stack is empty
+
+	int fanning = indices[0];
+	while (fanning >= 0)
+	{
+		//emit all the triangles around the fanning vertex
+		candidates.clear();
+		for (int i = offsets[fanning]; i < offsets[fanning + 1]; ++i)
+		{
+			int t = adjacency[i];
+			if (emitted[t])
+				continue;
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = indices[t * 3 + k];
+				result.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				cache.use(v);
+			}
+			emitted[t] = true;
+		}
+
+		//next one: the candidate that will be still in the cache after emitting its triangles and entered first
+		int best = -1;
+		int best_priority = -1;
+		for (unsigned int v : candidates)
+		{
+			if (live[v] <= 0)
+				continue;
+			int priority = 0;
+			int age = cache.timestamp - cache.cache_time[v];
+			if (age + 2 * live[v] <= cache_size)
+				priority = age;
+			if (priority > best_priority)
+			{
+				best = v;
+				best_priority = priority;
+			}
+		}
+
+		//dead end, continue from the last vertices used or from any vertex with triangles
+		while (best == -1 && !dead_end.empty())
+		{
+			unsigned int v = dead_end.back();
+			dead_end.pop_back();
+			if (live[v] > 0)
+				best = v;
+		}
+		while (best == -1 && cursor < num_triangles * 3)
+		{
+			unsigned int v = indices[cursor++];
+			if (live[v] > 0)
+				best = v;
+		}
+		fanning = best;
+	}
+
+	assert(result.size() == num_triangles * 3);
+	memcpy(indices, &result[0], result.size() * sizeof(unsigned int));
+}
+
+struct sTriangleCluster {
+	int start; //in triangles
+	int length;
+	float sort_key;
+};
+
+void optimizeOverdraw(unsigned int* indices, int num_indices, const Vector3* positions, int num_vertices, float threshold, int cache_size)
+{
+	int num_triangles = num_indices / 3;
+	if (num_triangles < 2)
+		return;
+
+	float mesh_acmr = analyzeVertexCache(indices, num_triangles * 3, num_vertices, cache_size).acmr;
+
+	//split in clusters: a cluster starts where the cache was flushed (the three vertices missed) or when the
+	//cluster already uses the cache as well as the whole mesh, every cluster starts with an empty cache so they can be reordered
+	std::vector<sTriangleCluster> clusters;
+	sCacheSimulator cache(num_vertices, cache_size);
+	int cluster_misses = 0;
+	for (int t = 0; t < num_triangles; ++t)
+	{
+		int misses = 0;
+		for (int k = 0; k < 3; ++k)
+			misses += cache.use(indices[t * 3 + k]) ? 1 : 0;
+
+		bool new_cluster = clusters.empty() || misses == 3;
+		if (!new_cluster)
+		{
+			sTriangleCluster& cluster = clusters.back();
+			new_cluster = cluster_misses <= threshold * mesh_acmr * cluster.length;
+		}
+		if (new_cluster)
+		{
+			if (!clusters.empty() && misses < 3)
+			{
+				//the triangle is evaluated again from an empty cache as it starts a cluster
+				cache.flush();
+				misses = 0;
+				for (int k = 0; k < 3; ++k)
+					misses += cache.use(indices[t * 3 + k]) ? 1 : 0;
+			}
+			sTriangleCluster cluster = { t, 0, 0.0f };
+			clusters.push_back(cluster);
+			cluster_misses = 0;
+		}
+		clusters.back().length++;
+		cluster_misses += misses;
+	}
+
+	//clusters in the outside of the mesh facing outwards go first
+	Vector3 mesh_center;
+	float mesh_area = 0.0f;
+	std::vector<Vector3> cluster_centers(clusters.size());
+	std::vector<Vector3> cluster_normals(clusters.size());
+	for (int i = 0; i < clusters.size(); ++i)
+	{
+		sTriangleCluster& cluster = clusters[i];
+		Vector3 center;
+		Vector3 normal; //not normalized, the length is twice the area
+		float area = 0.0f;
+		for (int t = cluster.start; t < cluster.start + cluster.length; ++t)
+		{
+			const Vector3& a = positions[indices[t * 3 + 0]];
+			const Vector3& b = positions[indices[t * 3 + 1]];
+			const Vector3& c = positions[indices[t * 3 + 2]];
+			Vector3 triangle_normal = (b - a).cross(c - a);
+			float triangle_area = triangle_normal.length();
+			center = center + (a + b + c) * (triangle_area / 3.0f);
+			normal = normal + triangle_normal;
+			area += triangle_area;
+		}
+		mesh_center = mesh_center + center;
+		mesh_area += area;
+		cluster_centers[i] = area > 0.0f ? center * (1.0f / area) : positions[indices[cluster.start * 3]];
+		cluster_normals[i] = normal;
+	}
+	if (mesh_area > 0.0f)
+		mesh_center = mesh_center * (1.0f / mesh_area);
+
+	for (int i = 0; i < clusters.size(); ++i)
+	{
+		Vector3 normal = cluster_normals[i];
+		float length = normal.length();
+		clusters[i].sort_key = length > 0.0f ? (cluster_centers[i] - mesh_center).dot(normal * (1.0f / length)) : 0.0f;
+	}
+
+	std::stable_sort(clusters.begin(), clusters.end(), [](const sTriangleCluster& a, const sTriangleCluster& b) { return a.sort_key > b.sort_key; });
+
+	std::vector<unsigned int> result;
+	result.reserve(num_triangles * 3);
+	for (sTriangleCluster& cluster : clusters)
+		result.insert(result.end(), indices + cluster.start * 3, indices + (cluster.start + cluster.length) * 3);
+	memcpy(indices, &result[0], result.size() * sizeof(unsigned int));
+}
+
+int optimizeVertexFetch(unsigned int* indices, int num_indices, int num_vertices, std::vector<int>& remap)
+{
+	remap.assign(num_vertices, -1);
+	int num_used = 0;
+	for (int i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		if (remap[v] == -1)
+			remap[v] = num_used++;
+		indices[i] = remap[v];
+	}
+	return num_used;
+}
+
+//symmetric 4x4 matrix of the sum of squared distances to a set of planes
+struct sQuadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+	double w; //sum of the weights of the planes
+
+	void addPlane(double a, double b, double c, double d, double weight)
+	{
+		a2 += a * a * weight; ab += a * b * weight; ac += a * c * weight; ad += a * d * weight;
+		b2 += b * b * weight; bc += b * c * weight; bd += b * d * weight;
+		c2 += c * c * weight; cd += c * d * weight;
+		d2 += d * d * weight;
+		w += weight;
+	}
+
+	void add(const sQuadric& q)
+	{
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+		w += q.w;
+	}
+
+	//weighted mean of the squared distances to the planes, so it is a squared distance whatever the area
+	double evaluate(const Vector3& p) const
+	{
+		if (w <= 0.0)
+			return 0.0;
+		double x = p.x, y = p.y, z = p.z;
+		double error = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+			+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+			+ c2 * z * z + 2 * cd * z
+			+ d2;
+		error /= w;
+		return error > 0.0 ? error : 0.0;
+	}
+};
+
+struct sCollapse {
+	unsigned int from;
+	unsigned int to;
+	double error;
+};
+
+static Vector3 triangleNormal(const Vector3& a, const Vector3& b, const Vector3& c)
+{
+	return (b - a).cross(c - a);
+}
+
+int simplifyMesh(std::vector<unsigned int>& result, const unsigned int* indices, int num_indices, const Vector3* positions, int num_vertices, int target_num_indices, float max_error, float* result_error)
+{
+	result.assign(indices, indices + (num_indices / 3) * 3);
+	if (result_error)
+		*result_error = 0.0f;
+	if (result.size() <= target_num_indices)
+		return (int)result.size();
+
+	//work in a normalized space so the errors do not depend on the size of the mesh
+	Vector3 min_pos = positions[result[0]];
+	Vector3 max_pos = min_pos;
+	for (unsigned int v : result)
+	{
+		min_pos.setMin(positions[v]);
+		max_pos.setMax(positions[v]);
+	}
+	Vector3 size = max_pos - min_pos;
+	float extent = std::max(size.x, std::max(size.y, size.z));
+	float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+	std::vector<Vector3> points(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		points[i] = (positions[i] - min_pos) * scale;
+
+	std::vector<bool> locked(num_vertices, false);
+
+	//vertices sharing position (seams of normals or uvs) cannot move or they would open cracks
+	std::unordered_map<uint64, unsigned int> vertex_by_position;
+	std::vector<unsigned int> position_id(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const Vector3& p = positions[i];
+		uint32 x, y, z;
+		memcpy(&x, &p.x, 4); memcpy(&y, &p.y, 4); memcpy(&z, &p.z, 4);
+		uint64 key = ((uint64)x * 73856093ULL) ^ ((uint64)y * 19349663ULL << 16) ^ ((uint64)z * 83492791ULL << 32);
+		auto it = vertex_by_position.find(key);
+		if (it != vertex_by_position.end() && positions[it->second].x == p.x && positions[it->second].y == p.y && positions[it->second].z == p.z)
+		{
+			position_id[i] = it->second;
+			locked[i] = locked[it->second] = true;
+		}
+		else
+		{
+			vertex_by_position[key] = i;
+			position_id[i] = i;
+		}
+	}
+
+	//borders and non manifold edges (not shared by exactly two triangles) are locked too
+	std::unordered_map<uint64, int> edge_count;
+	for (int i = 0; i < result.size(); i += 3)
+		for (int k = 0; k < 3; ++k)
+		{
+			uint64 a = position_id[result[i + k]];
+			uint64 b = position_id[result[i + (k + 1) % 3]];
+			edge_count[a < b ? (a << 32) | b : (b << 32) | a]++;
+		}
+	for (int i = 0; i < result.size(); i += 3)
+		for (int k = 0; k < 3; ++k)
+		{
+			uint64 a = position_id[result[i + k]];
+			uint64 b = position_id[result[i + (k + 1) % 3]];
+			if (edge_count[a < b ? (a << 32) | b : (b << 32) | a] != 2)
+				locked[result[i + k]] = locked[result[i + (k + 1) % 3]] = true;
+		}
+
+	//quadric of every vertex: the planes of its triangles weighted by their area
+	std::vector<sQuadric> quadrics(num_vertices);
+	memset(&quadrics[0], 0, num_vertices * sizeof(sQuadric));
+	for (int i = 0; i < result.size(); i += 3)
+	{
+		const Vector3& a = points[result[i]];
+		Vector3 normal = triangleNormal(a, points[result[i + 1]], points[result[i + 2]]);
+		float length = normal.length();
+		if (length == 0.0f)
+			continue;
+		normal = normal * (1.0f / length);
+		double d = -normal.dot(a);
+		for (int k = 0; k < 3; ++k)
+			quadrics[result[i + k]].addPlane(normal.x, normal.y, normal.z, d, length * 0.5f);
+	}
+
+	double max_error_squared = (double)max_error * max_error;
+	double worst_error = 0.0;
+	std::vector<int> offsets(num_vertices + 1);
+	std::vector<int> adjacency;
+	std::vector<sCollapse> collapses;
+	std::vector<unsigned int> remap(num_vertices);
+	std::vector<bool> touched(num_vertices);
+
+	//every pass collapses the cheapest edges that do not touch each other, till there is nothing to do
+	while (result.size() > target_num_indices)
+	{
+		int num_triangles = (int)result.size() / 3;
+
+		//triangles of every vertex
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for (unsigned int v : result)
+			offsets[v + 1]++;
+		for (int v = 0; v < num_vertices; ++v)
+			offsets[v + 1] += offsets[v];
+		adjacency.resize(result.size());
+		std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+		for (int t = 0; t < num_triangles; ++t)
+			for (int k = 0; k < 3; ++k)
+				adjacency[fill[result[t * 3 + k]]++] = t;
+
+		collapses.clear();
+		for (int t = 0; t < num_triangles; ++t)
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int from = result[t * 3 + k];
+				unsigned int to = result[t * 3 + (k + 1) % 3];
+				for (int j = 0; j < 2; ++j, std::swap(from, to))
+				{
+					if (locked[from])
+						continue;
+					sQuadric q = quadrics[from];
+					q.add(quadrics[to]);
+					sCollapse collapse = { from, to, q.evaluate(points[to]) };
+					if (collapse.error <= max_error_squared)
+						collapses.push_back(collapse);
+				}
+			}
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.error < b.error; });
+
+		for (int i = 0; i < num_vertices; ++i)
+			remap[i] = i;
+		std::fill(touched.begin(), touched.end(), false);
+		int num_removed = 0; //triangles
+		int target_removed = num_triangles - target_num_indices / 3;
+
+		for (sCollapse& collapse : collapses)
+		{
+			if (num_removed >= target_removed)
+				break;
+			unsigned int from = collapse.from;
+			unsigned int to = collapse.to;
+			if (touched[from] || touched[to])
+				continue;
+
+			//the triangles that remain must not flip
+			bool valid = true;
+			int removed = 0;
+			for (int i = offsets[from]; i < offsets[from + 1] && valid; ++i)
+			{
+				const unsigned int* tri = &result[adjacency[i] * 3];
+				if (tri[0] == to || tri[1] == to || tri[2] == to)
+				{
+					removed++;
+					continue;
+				}
+				Vector3 before = triangleNormal(points[tri[0]], points[tri[1]], points[tri[2]]);
+				Vector3 after = triangleNormal(points[tri[0] == from ? to : tri[0]], points[tri[1] == from ? to : tri[1]], points[tri[2] == from ? to : tri[2]]);
+				valid = before.dot(after) > 0.0f;
+			}
+			if (!valid)
+				continue;
+
+			//the one ring cannot change in this pass or the flip test would not be valid
+			for (int i = offsets[from]; i < offsets[from + 1]; ++i)
+				for (int k = 0; k < 3; ++k)
+					touched[result[adjacency[i] * 3 + k]] = true;
+
+			remap[from] = to;
+			quadrics[to].add(quadrics[from]);
+			worst_error = std::max(worst_error, collapse.error);
+			num_removed += removed;
+		}
+
+		if (!num_removed)
+			break;
+
+		//apply the collapses and remove the degenerated triangles
+		int num_indices_left = 0;
+		for (int t = 0; t < num_triangles; ++t)
+		{
+			unsigned int a = remap[result[t * 3]];
+			unsigned int b = remap[result[t * 3 + 1]];
+			unsigned int c = remap[result[t * 3 + 2]];
+			if (a == b || b == c || c == a)
+				continue;
+			result[num_indices_left++] = a;
+			result[num_indices_left++] = b;
+			result[num_indices_left++] = c;
+		}
+		result.resize(num_indices_left);
+	}
+
+	if (result_error)
+		*result_error = (float)sqrt(worst_error);
+	return (int)result.size();
+}
+
+//computes the bounding sphere and the normal cone of the meshlet
+static void computeMeshletBounds(sMeshlet& meshlet, const unsigned int* indices, const Vector3* positions)
+{
+	Vector3 min_pos = positions[indices[meshlet.start]];
+	Vector3 max_pos = min_pos;
+	Vector3 axis;
+	for (int i = meshlet.start; i < meshlet.start + meshlet.length; i += 3)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			min_pos.setMin(positions[indices[i + k]]);
+			max_pos.setMax(positions[indices[i + k]]);
+		}
+		Vector3 normal = triangleNormal(positions[indices[i]], positions[indices[i + 1]], positions[indices[i + 2]]);
+		float length = normal.length();
+		if (length > 0.0f)
+			axis = axis + normal * (1.0f / length);
+	}
+
+	meshlet.center = (min_pos + max_pos) * 0.5f;
+	meshlet.radius = 0.0f;
+	for (int i = meshlet.start; i < meshlet.start + meshlet.length; ++i)
+		meshlet.radius = std::max(meshlet.radius, meshlet.center.distance(positions[indices[i]]));
+
+	//the cone contains all the normals, if it is wider than 90 degrees some triangle always faces the eye
+	meshlet.cone_axis = axis;
+	meshlet.cone_cutoff = 1.0f;
+	float axis_length = axis.length();
+	if (axis_length == 0.0f)
+		return;
+	axis = axis * (1.0f / axis_length);
+	float min_dot = 1.0f;
+	for (int i = meshlet.start; i < meshlet.start + meshlet.length; i += 3)
+	{
+		Vector3 normal = triangleNormal(positions[indices[i]], positions[indices[i + 1]], positions[indices[i + 2]]);
+		float length = normal.length();
+		if (length > 0.0f)
+			min_dot = std::min(min_dot, axis.dot(normal) / length);
+	}
+	meshlet.cone_axis = axis;
+	if (min_dot > 0.0f)
+		meshlet.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+}
+
+void buildMeshlets(std::vector<sMeshlet>& meshlets, const unsigned int* indices, int start, int length, const Vector3* positions, int num_vertices, int max_vertices, int max_triangles)
+{
+	int num_triangles = length / 3;
+	if (!num_triangles)
+		return;
+
+	std::vector<int> vertex_meshlet(num_vertices, -1); //last meshlet that used the vertex, to count them
+	sMeshlet meshlet;
+	meshlet.start = start;
+	meshlet.length = 0;
+	int meshlet_id = 0;
+	int meshlet_vertices = 0;
+	Vector3 meshlet_normal; //sum of the normals to keep the cone narrow
+
+	for (int t = 0; t < num_triangles; ++t)
+	{
+		const unsigned int* tri = indices + start + t * 3;
+		int new_vertices = 0;
+		for (int k = 0; k < 3; ++k)
+			if (vertex_meshlet[tri[k]] != meshlet_id)
+				new_vertices++;
+		Vector3 normal = triangleNormal(positions[tri[0]], positions[tri[1]], positions[tri[2]]);
+		float normal_length = normal.length();
+		if (normal_length > 0.0f)
+			normal = normal * (1.0f / normal_length);
+
+		//close the meshlet if it is full or if the triangle would open too much the cone (once it has some triangles)
+		int meshlet_triangles = meshlet.length / 3;
+		float sum_length = meshlet_normal.length();
+		bool full = meshlet_vertices + new_vertices > max_vertices || meshlet_triangles + 1 > max_triangles;
+		bool diverges = meshlet_triangles >= max_triangles / 4 && sum_length > 0.0f && normal.dot(meshlet_normal) < 0.25f * sum_length;
+		if (meshlet_triangles && (full || diverges))
+		{
+			computeMeshletBounds(meshlet, indices, positions);
+			meshlets.push_back(meshlet);
+			meshlet.start += meshlet.length;
+			meshlet.length = 0;
+			meshlet_id++;
+			meshlet_vertices = 0;
+			meshlet_normal = Vector3();
+			new_vertices = 3; //every vertex is new in the next meshlet
+		}
+
+		for (int k = 0; k < 3; ++k)
+			vertex_meshlet[tri[k]] = meshlet_id;
+		meshlet_vertices += new_vertices;
+		meshlet_normal = meshlet_normal + normal;
+		meshlet.length += 3;
+	}
+
+	computeMeshletBounds(meshlet, indices, positions);
+	meshlets.push_back(meshlet);
+}
+
+int cullMeshlets(std::vector<sIndexRange>& ranges, const sMeshlet* meshlets, int num_meshlets, const Matrix44& model, Camera* camera, bool backface_culling)
+{
+	ranges.clear();
+
+	//the spheres are moved to world space, the radius uses the biggest scale
+	Vector3 axis_x(model.m[0], model.m[1], model.m[2]);
+	Vector3 axis_y(model.m[4], model.m[5], model.m[6]);
+	Vector3 axis_z(model.m[8], model.m[9], model.m[10]);
+	float sx = axis_x.length(), sy = axis_y.length(), sz = axis_z.length();
+	float scale = std::max(sx, std::max(sy, sz));
+
+	//the cones are only valid with uniform scales and perspective cameras, and mirrored models flip the winding of the triangles
+	if (scale - std::min(sx, std::min(sy, sz)) > scale * 0.01f || camera->type != Camera::PERSPECTIVE || axis_x.cross(axis_y).dot(axis_z) < 0.0f)
+		backface_culling = false;
+
+	int num_visible = 0;
+	for (int i = 0; i < num_meshlets; ++i)
+	{
+		const sMeshlet& meshlet = meshlets[i];
+		Vector3 center = model * meshlet.center;
+		float radius = meshlet.radius * scale;
+		if (camera->testSphereInFrustum(center, radius) == CLIP_OUTSIDE)
+			continue;
+		if (backface_culling && meshlet.cone_cutoff < 1.0f)
+		{
+			Vector3 axis = model.rotateVector(meshlet.cone_axis) * (1.0f / scale);
+			if (isMeshletBackfacing(center, radius, axis, meshlet.cone_cutoff, camera->eye))
+				continue;
+		}
+
+		if (ranges.size() && ranges.back().start + ranges.back().length == meshlet.start)
+			ranges.back().length += meshlet.length;
+		else
+		{
+			sIndexRange range = { meshlet.start, meshlet.length };
+			ranges.push_back(range);
+		}
+		num_visible += meshlet.length;
+	}
+	return num_visible;
+}
@@ -0,0 +1,80 @@
+/*
+	Functions to reorder the indices and vertices of a mesh to make a better use of the GPU:
+	- vertex cache: triangles sharing vertices are drawn close so the transformed vertices are reused (Tipsify, Sander et al. 2007)
+	- overdraw: clusters of triangles facing outwards are drawn first so the rest fail the depth test
+	- vertex fetch: vertices are stored in the order they are used
+	- simplification: edge collapses driven by the quadric error metric (Garland and Heckbert 1997), to create LODs
+	- meshlets: small groups of triangles with bounds to cull parts of big meshes
+	They work only with indexed triangle lists and do not need a GPU, so they can be run at load time.
+*/
+
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <vector>
+#include "framework.h"
+
+#define VERTEX_CACHE_SIZE 16 //FIFO size used to optimize and to simulate, most GPUs are close to this
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 128
+
+class Camera;
+
+struct sVertexCacheStats {
+	int num_transformed; //times the vertex shader is executed (cache misses)
+	float acmr; //average cache miss ratio: transformed vertices per triangle (0.5 is the best, 3 the worst)
+	float atvr; //average transformed vertex ratio: transformed vertices per used vertex (1 is the best)
+};
+
+//simulates a FIFO vertex cache
+sVertexCacheStats analyzeVertexCache(const unsigned int* indices, int num_indices, int num_vertices, int cache_size = VERTEX_CACHE_SIZE);
+
+//reorders the triangles to reuse the vertices in the cache
+void optimizeVertexCache(unsigned int* indices, int num_indices, int num_vertices, int cache_size = VERTEX_CACHE_SIZE);
+
+//reorders clusters of triangles (must be called after optimizeVertexCache) to reduce overdraw,
+//threshold is how much the ACMR can get worse (1.05 means 5%), smaller clusters are sorted better but use worse the cache
+void optimizeOverdraw(unsigned int* indices, int num_indices, const Vector3* positions, int num_vertices, float threshold = 1.05f, int cache_size = VERTEX_CACHE_SIZE);
+
+//renames the vertices in the order they are used, remap has the new index of every old vertex (-1 if it is not used)
+//returns the number of vertices used, the streams must be reordered with the remap
+int optimizeVertexFetch(unsigned int* indices, int num_indices, int num_vertices, std::vector<int>& remap);
+
+//removes triangles collapsing edges till the target number of indices or the max error is reached,
+//vertices are moved onto other existing vertices so the result uses the same vertex buffer.
+//Borders, seams (several vertices in the same position) and non manifold edges are kept.
+//The error is a distance relative to the size of the mesh (the biggest side of its aabb), returns the number of indices
+int simplifyMesh(std::vector<unsigned int>& result, const unsigned int* indices, int num_indices, const Vector3* positions, int num_vertices, int target_num_indices, float max_error, float* result_error = NULL);
+
+//consecutive triangles of the indices with the bounds needed to cull them
+struct sMeshlet {
+	Vector3 center; //bounding sphere
+	float radius;
+	Vector3 cone_axis; //average direction of the triangle normals
+	float cone_cutoff; //sin of the angle between the axis and the farthest normal, 1 if the meshlet cannot be backface culled
+	int start; //in indices
+	int length; //in indices
+};
+
+struct sIndexRange
+{
+	int start; //in indices
+	int length; //in indices
+};
+
+//splits the triangles in the range [start, start + length) of indices in meshlets, they are appended to the vector.
+//The triangles are not reordered so it must be called after optimizeVertexCache, which keeps close the triangles that share vertices
+void buildMeshlets(std::vector<sMeshlet>& meshlets, const unsigned int* indices, int start, int length, const Vector3* positions, int num_vertices, int max_vertices = MESHLET_MAX_VERTICES, int max_triangles = MESHLET_MAX_TRIANGLES);
+
+//true if all the triangles of the meshlet face away from the eye (everything in the same space)
+inline bool isMeshletBackfacing(const Vector3& center, float radius, const Vector3& cone_axis, float cone_cutoff, const Vector3& eye)
+{
+	Vector3 to_center = center - eye;
+	return to_center.dot(cone_axis) >= cone_cutoff * to_center.length() + radius;
+}
+
+//fills ranges with the meshlets (in local space) inside the frustum of the camera, and facing it if backface_culling.
+//Consecutive meshlets are merged in one range, returns the number of indices visible
+int cullMeshlets(std::vector<sIndexRange>& ranges, const sMeshlet* meshlets, int num_meshlets, const Matrix44& model, Camera* camera, bool backface_culling);
+
+#endif
@@ -0,0 +1,338 @@
+#include "obj_loader.h"
+#include "task.h"
+
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+//usemtl or g found in a chunk, before the corner with that index
+struct sOBJGroup {
+	int corner;
+	bool is_material;
+	std::string name;
+};
+
+struct sOBJChunk {
+	const char* start;
+	const char* end;
+	int num_positions, num_uvs, num_normals; //lines of this chunk
+	int first_position, first_uv, first_normal; //global index of the first one of this chunk
+	std::vector<int> corners; //v, vt, vn of the triangulated faces (global and starting in 0, -1 if missing)
+	std::vector<sOBJGroup> groups;
+};
+
+static inline const char* skipSpaces(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+	return p;
+}
+
+static inline const char* nextLine(const char* p, const char* end)
+{
+	const char* next = (const char*)memchr(p, '\n', end - p);
+	return next ? next + 1 : end;
+}
+
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+//powers of ten that are exact in a double
+static const double exact_powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+//parses [+-]digits[.digits][(e|E)[+-]digits], the first 19 significant digits are accumulated in an integer
+//so the only rounding is the final multiplication (atof is much slower because it handles locales)
+static const char* parseFloat(const char* p, const char* end, float& result)
+{
+	p = skipSpaces(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	uint64 mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	for (; p < end && isDigit(*p); ++p)
+	{
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa)
+				digits++;
+		}
+		else
+			exponent++;
+	}
+	if (p < end && *p == '.')
+		for (++p; p < end && isDigit(*p); ++p)
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa)
+					digits++;
+				exponent--;
+			}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negative_exponent = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative_exponent = *p++ == '-';
+		int value = 0;
+		for (; p < end && isDigit(*p); ++p)
+			if (value < 10000)
+				value = value * 10 + (*p - '0');
+		exponent += negative_exponent ? -value : value;
+	}
+
+	double value = (double)mantissa;
+	if (exponent < 0)
+		value = exponent >= -22 ? value / exact_powers[-exponent] : value * pow(10.0, exponent);
+	else if (exponent > 0)
+		value = exponent <= 22 ? value * exact_powers[exponent] : value * pow(10.0, exponent);
+	result = (float)(negative ? -value : value);
+	return p;
+}
+
+//returns false if there is no number
+static inline bool parseInt(const char*& p, const char* end, int& result)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	if (p >= end || !isDigit(*p))
+		return false;
+	int value = 0;
+	for (; p < end && isDigit(*p); ++p)
+		value = value * 10 + (*p - '0');
+	result = negative ? -value : value;
+	return true;
+}
+
+//OBJ indices start in 1 and negative ones are relative to the last element defined, returns -1 if it is not valid
+static inline int resolveIndex(int index, int count_before, int total)
+{
+	int result = index > 0 ? index - 1 : count_before + index;
+	return index != 0 && result >= 0 && result < total ? result : -1;
+}
+
+//the name after the keyword, till the end of the line
+static std::string parseName(const char* p, const char* end)
+{
+	p = skipSpaces(p, end);
+	const char* name_end = p;
+	while (name_end < end && *name_end != '\n' && *name_end != '\r')
+		++name_end;
+	while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+		--name_end;
+	return std::string(p, name_end);
+}
+
+static void countChunk(sOBJChunk& chunk)
+{
+	chunk.num_positions = chunk.num_uvs = chunk.num_normals = 0;
+	for (const char* p = chunk.start; p < chunk.end; p = nextLine(p, chunk.end))
+	{
+		p = skipSpaces(p, chunk.end);
+		if (p + 1 >= chunk.end || *p != 'v')
+			continue;
+		if (p[1] == ' ' || p[1] == '\t')
+			chunk.num_positions++;
+		else if (p[1] == 't')
+			chunk.num_uvs++;
+		else if (p[1] == 'n')
+			chunk.num_normals++;
+	}
+}
+
+static void parseChunk(sOBJChunk& chunk, Vector3* positions, Vector2* uvs, Vector3* normals, int num_positions, int num_uvs, int num_normals)
+{
+	int position_i = chunk.first_position;
+	int uv_i = chunk.first_uv;
+	int normal_i = chunk.first_normal;
+	const char* end = chunk.end;
+	int face[3][3]; //first, previous and current corner of the polygon
+
+	for (const char* p = chunk.start; p < end; p = nextLine(p, end))
+	{
+		p = skipSpaces(p, end);
+		if (p + 1 >= end)
+			continue;
+
+		if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			Vector3& v = positions[position_i++];
+			p = parseFloat(p + 1, end, v.x);
+			p = parseFloat(p, end, v.y);
+			p = parseFloat(p, end, v.z);
+		}
+		else if (p[0] == 'v' && p[1] == 't')
+		{
+			Vector2& uv = uvs[uv_i++];
+			p = parseFloat(p + 2, end, uv.x);
+			p = parseFloat(p, end, uv.y);
+			uv.y = 1.0f - uv.y;
+		}
+		else if (p[0] == 'v' && p[1] == 'n')
+		{
+			Vector3& n = normals[normal_i++];
+			p = parseFloat(p + 2, end, n.x);
+			p = parseFloat(p, end, n.y);
+			p = parseFloat(p, end, n.z);
+		}
+		else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			//corners are v, v/vt, v//vn or v/vt/vn, polygons are triangulated as a fan
+			int num_corners = 0;
+			p = skipSpaces(p + 1, end);
+			while (p < end && *p != '\n' && *p != '\r')
+			{
+				int* corner = face[num_corners < 2 ? num_corners : 2];
+				int index = 0;
+				if (!parseInt(p, end, index))
+					break;
+				corner[0] = resolveIndex(index, position_i, num_positions);
+				corner[1] = corner[2] = -1;
+				if (p < end && *p == '/')
+				{
+					++p;
+					if (parseInt(p, end, index))
+						corner[1] = resolveIndex(index, uv_i, num_uvs);
+					if (p < end && *p == '/')
+					{
+						++p;
+						if (parseInt(p, end, index))
+							corner[2] = resolveIndex(index, normal_i, num_normals);
+					}
+				}
+				p = skipSpaces(p, end);
+
+				//triangles using positions that do not exist are skipped
+				num_corners++;
+				if (num_corners >= 3 && face[0][0] != -1 && face[1][0] != -1 && face[2][0] != -1)
+				{
+					chunk.corners.insert(chunk.corners.end(), face[0], face[0] + 3);
+					chunk.corners.insert(chunk.corners.end(), face[1], face[1] + 3);
+					chunk.corners.insert(chunk.corners.end(), face[2], face[2] + 3);
+				}
+				if (num_corners >= 3)
+					memcpy(face[1], face[2], sizeof(face[2]));
+			}
+		}
+		else if (p[0] == 'g' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			sOBJGroup group = { (int)chunk.corners.size() / 3, false, parseName(p + 1, end) };
+			chunk.groups.push_back(group);
+		}
+		else if (end - p > 6 && strncmp(p, "usemtl", 6) == 0)
+		{
+			sOBJGroup group = { (int)chunk.corners.size() / 3, true, parseName(p + 6, end) };
+			chunk.groups.push_back(group);
+		}
+	}
+}
+
+bool parseOBJ(const char* data, size_t size, sOBJData& obj)
+{
+	//split in chunks at the end of a line
+	std::vector<sOBJChunk> chunks;
+	const char* end = data + size;
+	for (const char* p = data; p < end; )
+	{
+		sOBJChunk chunk;
+		chunk.start = p;
+		chunk.end = end - p > OBJ_CHUNK_SIZE ? nextLine(p + OBJ_CHUNK_SIZE, end) : end;
+		chunks.push_back(chunk);
+		p = chunk.end;
+	}
+	int num_chunks = (int)chunks.size();
+
+	TaskManager::background.parallelFor(num_chunks, 1, [&](int start, int end, int chunk) { countChunk(chunks[chunk]); });
+
+	int num_positions = 0, num_uvs = 0, num_normals = 0;
+	for (sOBJChunk& chunk : chunks)
+	{
+		chunk.first_position = num_positions;
+		chunk.first_uv = num_uvs;
+		chunk.first_normal = num_normals;
+		num_positions += chunk.num_positions;
+		num_uvs += chunk.num_uvs;
+		num_normals += chunk.num_normals;
+	}
+
+	//every chunk writes its elements in its place
+	std::vector<Vector3> positions(num_positions);
+	std::vector<Vector2> uvs(num_uvs);
+	std::vector<Vector3> normals(num_normals);
+	TaskManager::background.parallelFor(num_chunks, 1, [&](int start, int end, int chunk) {
+		parseChunk(chunks[chunk], positions.data(), uvs.data(), normals.data(), num_positions, num_uvs, num_normals);
+	});
+
+	//merge the chunks in order, the vertices of every position are in a list to find the ones with the same uv and normal
+	std::vector<int> first_vertex(num_positions, -1);
+	std::vector<int> next_vertex;
+	std::vector<int> vertex_uv;
+	std::vector<int> vertex_normal;
+
+	obj.positions.clear();
+	obj.uvs.clear();
+	obj.normals.clear();
+	obj.indices.clear();
+	obj.submeshes.clear();
+
+	sSubmeshInfo submesh_info;
+	memset(&submesh_info, 0, sizeof(submesh_info));
+
+	for (sOBJChunk& chunk : chunks)
+	{
+		int group_i = 0;
+		int num_corners = (int)chunk.corners.size() / 3;
+		for (int c = 0; c <= num_corners; ++c)
+		{
+			//a group or material starts a new submesh if the current one has triangles
+			for (; group_i < chunk.groups.size() && chunk.groups[group_i].corner == c; ++group_i)
+			{
+				sOBJGroup& group = chunk.groups[group_i];
+				int num_indices = (int)obj.indices.size();
+				if (num_indices != submesh_info.start)
+				{
+					submesh_info.length = num_indices - submesh_info.start;
+					obj.submeshes.push_back(submesh_info);
+					submesh_info.start = num_indices;
+				}
+				char* target = group.is_material ? submesh_info.material : submesh_info.name;
+				strncpy(target, group.name.c_str(), sizeof(submesh_info.name) - 1);
+				target[sizeof(submesh_info.name) - 1] = 0;
+			}
+			if (c == num_corners)
+				break;
+
+			const int* corner = &chunk.corners[c * 3];
+			int position = corner[0];
+			int vertex = first_vertex[position];
+			while (vertex != -1 && (vertex_uv[vertex] != corner[1] || vertex_normal[vertex] != corner[2]))
+				vertex = next_vertex[vertex];
+			if (vertex == -1)
+			{
+				vertex = (int)obj.positions.size();
+				obj.positions.push_back(positions[position]);
+				if (num_uvs)
+					obj.uvs.push_back(corner[1] != -1 ? uvs[corner[1]] : Vector2());
+				if (num_normals)
+					obj.normals.push_back(corner[2] != -1 ? normals[corner[2]] : Vector3());
+				vertex_uv.push_back(corner[1]);
+				vertex_normal.push_back(corner[2]);
+				next_vertex.push_back(first_vertex[position]);
+				first_vertex[position] = vertex;
+			}
+			obj.indices.push_back(vertex);
+		}
+	}
+
+	submesh_info.length = (int)obj.indices.size() - submesh_info.start;
+	if (submesh_info.length || obj.submeshes.empty())
+		obj.submeshes.push_back(submesh_info);
+
+	return true;
+}
@@ -0,0 +1,29 @@
+/*
+	Fast OBJ importer. The file is split in chunks that are parsed in parallel by the background TaskManager:
+	- a first pass counts the v, vt and vn lines of every chunk so every chunk knows the global index of its data
+	- a second pass parses the numbers in place (no per line allocations) and triangulates the faces
+	- the chunks are merged in order, the corners with the same v/vt/vn become one vertex of an indexed mesh
+*/
+
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include <cstddef>
+#include <vector>
+#include "mesh.h"
+
+#define OBJ_CHUNK_SIZE (1 << 20) //bytes parsed by every task
+
+//indexed geometry of the file, the streams are swapped into the Mesh (see Mesh::loadOBJ)
+struct sOBJData {
+	std::vector<Vector3> positions;
+	std::vector<Vector2> uvs; //empty if the file has no vt
+	std::vector<Vector3> normals; //empty if the file has no vn
+	std::vector<unsigned int> indices;
+	std::vector<sSubmeshInfo> submeshes; //in indices
+};
+
+//fills obj with the geometry of the file, data does not need to end with a zero
+bool parseOBJ(const char* data, size_t size, sOBJData& obj);
+
+#endif
@@ -0,0 +1,309 @@
+#include "occlusion.h"
+#include "culling.h"
+#include "camera.h"
+#include "task.h"
+
+#include <cmath>
+#include <algorithm>
+#include <cassert>
+
+#ifdef CULLING_SSE
+	#include <emmintrin.h>
+#endif
+
+#define OCCLUSION_DEPTH_TOLERANCE 1.0001f //boxes must be a bit behind the occluders to be hidden
+
+OcclusionBuffer::OcclusionBuffer(int width, int height)
+{
+	assert(width % 4 == 0 && width % OCCLUSION_TILE == 0 && height % OCCLUSION_TILE == 0);
+	this->width = width;
+	this->height = height;
+	depth.resize(width * height, 0.0f);
+	tiles.resize((width / OCCLUSION_TILE) * (height / OCCLUSION_TILE), 0.0f);
+	orthographic = false;
+	near_plane = 0.1f;
+	num_occluders = 0;
+	num_triangles = 0;
+}
+
+void OcclusionBuffer::begin(const Matrix44& viewprojection, bool orthographic, float near_plane)
+{
+	this->viewprojection = viewprojection;
+	this->orthographic = orthographic;
+	this->near_plane = near_plane;
+	occluders.clear();
+	std::fill(depth.begin(), depth.end(), 0.0f);
+	std::fill(tiles.begin(), tiles.end(), 0.0f);
+	num_occluders = 0;
+	num_triangles = 0;
+}
+
+void OcclusionBuffer::begin(Camera* camera)
+{
+	begin(camera->viewprojection_matrix, camera->type == Camera::ORTHOGRAPHIC, camera->near_plane);
+}
+
+void OcclusionBuffer::addOccluder(const Matrix44& model, const Vector3* positions, const unsigned int* indices, int num_indices, bool two_sided)
+{
+	sOccluder occluder;
+	occluder.mvp = model * viewprojection;
+	occluder.positions = positions;
+	occluder.indices = indices;
+	occluder.num_indices = num_indices;
+	occluder.two_sided = two_sided;
+	occluders.push_back(occluder);
+}
+
+void OcclusionBuffer::setupTriangles(const sOccluder& occluder, std::vector<sTriangle>& triangles)
+{
+	triangles.clear();
+	for (int i = 0; i + 2 < occluder.num_indices; i += 3)
+	{
+		float x[3], y[3], d[3];
+		bool clipped = false;
+		for (int k = 0; k < 3 && !clipped; ++k)
+		{
+			const Vector3& p = occluder.positions[occluder.indices[i + k]];
+			Vector4 clip = occluder.mvp * Vector4(p.x, p.y, p.z, 1.0f);
+			if (orthographic)
+			{
+				clipped = clip.z < -1.0f;
+				d[k] = (1.0f - clip.z) * 0.5f;
+			}
+			else
+			{
+				clipped = clip.w < near_plane;
+				d[k] = 1.0f / clip.w;
+				clip.x *= d[k];
+				clip.y *= d[k];
+			}
+			x[k] = (clip.x * 0.5f + 0.5f) * width;
+			y[k] = (clip.y * 0.5f + 0.5f) * height;
+		}
+		if (clipped)
+			continue;
+
+		//counter clockwise triangles have positive area, the back faces are flipped or skipped
+		float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (area < 0.0f && occluder.two_sided)
+		{
+			std::swap(x[1], x[2]);
+			std::swap(y[1], y[2]);
+			std::swap(d[1], d[2]);
+			area = -area;
+		}
+		if (area <= 1e-6f)
+			continue;
+
+		//only the pixel centers inside the triangle are written
+		sTriangle tri;
+		tri.min_x = std::max(0, (int)ceilf(std::min(x[0], std::min(x[1], x[2])) - 0.5f));
+		tri.max_x = std::min(width - 1, (int)floorf(std::max(x[0], std::max(x[1], x[2])) - 0.5f));
+		tri.min_y = std::max(0, (int)ceilf(std::min(y[0], std::min(y[1], y[2])) - 0.5f));
+		tri.max_y = std::min(height - 1, (int)floorf(std::max(y[0], std::max(y[1], y[2])) - 0.5f));
+		if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+			continue;
+
+		//edge k goes from vertex k to the next one, it is positive inside
+		for (int k = 0; k < 3; ++k)
+		{
+			int next = (k + 1) % 3;
+			tri.edge_a[k] = y[k] - y[next];
+			tri.edge_b[k] = x[next] - x[k];
+			tri.edge_c[k] = -(tri.edge_a[k] * x[k] + tri.edge_b[k] * y[k]);
+		}
+
+		//the weight of vertex 1 is the edge 2 (2 to 0) and the one of vertex 2 the edge 0 (0 to 1)
+		float inv_area = 1.0f / area;
+		float d1 = (d[1] - d[0]) * inv_area;
+		float d2 = (d[2] - d[0]) * inv_area;
+		tri.depth_a = d1 * tri.edge_a[2] + d2 * tri.edge_a[0];
+		tri.depth_b = d1 * tri.edge_b[2] + d2 * tri.edge_b[0];
+		tri.depth_c = d[0] + d1 * tri.edge_c[2] + d2 * tri.edge_c[0];
+		triangles.push_back(tri);
+	}
+}
+
+void OcclusionBuffer::rasterizeBand(int band)
+{
+	int band_min_y = band * OCCLUSION_TILE;
+	int band_max_y = band_min_y + OCCLUSION_TILE - 1;
+
+	for (int o = 0; o < occluder_triangles.size(); ++o)
+	{
+		const std::vector<sTriangle>& triangles = occluder_triangles[o];
+		for (int t = 0; t < triangles.size(); ++t)
+		{
+			const sTriangle& tri = triangles[t];
+			if (tri.max_y < band_min_y || tri.min_y > band_max_y)
+				continue;
+			int min_y = std::max(tri.min_y, band_min_y);
+			int max_y = std::min(tri.max_y, band_max_y);
+
+#ifdef CULLING_SSE
+			//4 pixels at a time, the rows are aligned to 4 and the pixels out of the triangle fail the edge test
+			int min_x = tri.min_x & ~3;
+			__m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			__m128 zero = _mm_setzero_ps();
+			__m128 edge_a[3], step[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				edge_a[k] = _mm_set1_ps(tri.edge_a[k]);
+				step[k] = _mm_set1_ps(tri.edge_a[k] * 4.0f);
+			}
+			__m128 depth_a = _mm_set1_ps(tri.depth_a);
+			__m128 depth_step = _mm_set1_ps(tri.depth_a * 4.0f);
+
+			for (int y = min_y; y <= max_y; ++y)
+			{
+				float py = y + 0.5f;
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)min_x), offsets);
+				__m128 e[3];
+				for (int k = 0; k < 3; ++k)
+					e[k] = _mm_add_ps(_mm_mul_ps(edge_a[k], px), _mm_set1_ps(tri.edge_b[k] * py + tri.edge_c[k]));
+				__m128 z = _mm_add_ps(_mm_mul_ps(depth_a, px), _mm_set1_ps(tri.depth_b * py + tri.depth_c));
+
+				float* row = &depth[y * width];
+				for (int x = min_x; x <= tri.max_x; x += 4)
+				{
+					__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)), _mm_cmpge_ps(e[2], zero));
+					if (_mm_movemask_ps(inside))
+					{
+						__m128 old = _mm_loadu_ps(row + x);
+						__m128 closest = _mm_max_ps(old, z);
+						_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, closest), _mm_andnot_ps(inside, old)));
+					}
+					for (int k = 0; k < 3; ++k)
+						e[k] = _mm_add_ps(e[k], step[k]);
+					z = _mm_add_ps(z, depth_step);
+				}
+			}
+#else
+			for (int y = min_y; y <= max_y; ++y)
+			{
+				float py = y + 0.5f;
+				float* row = &depth[y * width];
+				for (int x = tri.min_x; x <= tri.max_x; ++x)
+				{
+					float px = x + 0.5f;
+					if (tri.edge_a[0] * px + tri.edge_b[0] * py + tri.edge_c[0] < 0.0f ||
+						tri.edge_a[1] * px + tri.edge_b[1] * py + tri.edge_c[1] < 0.0f ||
+						tri.edge_a[2] * px + tri.edge_b[2] * py + tri.edge_c[2] < 0.0f)
+						continue;
+					float z = tri.depth_a * px + tri.depth_b * py + tri.depth_c;
+					if (z > row[x])
+						row[x] = z;
+				}
+			}
+#endif
+		}
+	}
+
+	//farthest depth of the tiles of the band
+	int num_tiles_x = width / OCCLUSION_TILE;
+	for (int tile_x = 0; tile_x < num_tiles_x; ++tile_x)
+	{
+		float farthest = depth[band_min_y * width + tile_x * OCCLUSION_TILE];
+		for (int y = band_min_y; y <= band_max_y; ++y)
+		{
+			const float* row = &depth[y * width + tile_x * OCCLUSION_TILE];
+			for (int x = 0; x < OCCLUSION_TILE; ++x)
+				farthest = std::min(farthest, row[x]);
+		}
+		tiles[band * num_tiles_x + tile_x] = farthest;
+	}
+}
+
+void OcclusionBuffer::rasterize()
+{
+	num_occluders = (int)occluders.size();
+	if (occluder_triangles.size() < occluders.size())
+		occluder_triangles.resize(occluders.size());
+
+	TaskManager::background.parallelFor(num_occluders, 1, [&](int start, int end, int chunk) {
+		setupTriangles(occluders[chunk], occluder_triangles[chunk]);
+	});
+	occluder_triangles.resize(num_occluders);
+
+	num_triangles = 0;
+	for (int i = 0; i < num_occluders; ++i)
+		num_triangles += (int)occluder_triangles[i].size();
+
+	int num_bands = height / OCCLUSION_TILE;
+	TaskManager::background.parallelFor(num_bands, 1, [&](int start, int end, int chunk) {
+		rasterizeBand(chunk);
+	});
+	occluders.clear();
+}
+
+bool OcclusionBuffer::projectBox(const BoundingBox& box, sScreenRect& rect) const
+{
+	rect.min_x = rect.min_y = 1e10f;
+	rect.max_x = rect.max_y = -1e10f;
+	rect.depth = 0.0f;
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner(box.center.x + (i & 1 ? box.halfsize.x : -box.halfsize.x),
+			box.center.y + (i & 2 ? box.halfsize.y : -box.halfsize.y),
+			box.center.z + (i & 4 ? box.halfsize.z : -box.halfsize.z));
+		Vector4 clip = viewprojection * Vector4(corner.x, corner.y, corner.z, 1.0f);
+		float d;
+		if (orthographic)
+		{
+			if (clip.z < -1.0f)
+				return false;
+			d = (1.0f - clip.z) * 0.5f;
+		}
+		else
+		{
+			if (clip.w < near_plane)
+				return false;
+			d = 1.0f / clip.w;
+			clip.x *= d;
+			clip.y *= d;
+		}
+		float x = (clip.x * 0.5f + 0.5f) * width;
+		float y = (clip.y * 0.5f + 0.5f) * height;
+		rect.min_x = std::min(rect.min_x, x);
+		rect.max_x = std::max(rect.max_x, x);
+		rect.min_y = std::min(rect.min_y, y);
+		rect.max_y = std::max(rect.max_y, y);
+		rect.depth = std::max(rect.depth, d);
+	}
+	return true;
+}
+
+bool OcclusionBuffer::testBox(const BoundingBox& box) const
+{
+	sScreenRect rect;
+	if (!projectBox(box, rect))
+		return true;
+
+	//all the pixels touched by the box (not only the centers, to be conservative)
+	int min_x = std::max(0, (int)floorf(rect.min_x));
+	int max_x = std::min(width - 1, (int)floorf(rect.max_x));
+	int min_y = std::max(0, (int)floorf(rect.min_y));
+	int max_y = std::min(height - 1, (int)floorf(rect.max_y));
+	if (min_x > max_x || min_y > max_y)
+		return true; //out of the screen, the frustum culling decides
+	float box_depth = rect.depth * OCCLUSION_DEPTH_TOLERANCE;
+
+	int num_tiles_x = width / OCCLUSION_TILE;
+	for (int tile_y = min_y / OCCLUSION_TILE; tile_y <= max_y / OCCLUSION_TILE; ++tile_y)
+		for (int tile_x = min_x / OCCLUSION_TILE; tile_x <= max_x / OCCLUSION_TILE; ++tile_x)
+		{
+			//every pixel of the tile is closer than the box
+			if (box_depth < tiles[tile_y * num_tiles_x + tile_x])
+				continue;
+
+			int start_x = std::max(min_x, tile_x * OCCLUSION_TILE);
+			int end_x = std::min(max_x, tile_x * OCCLUSION_TILE + OCCLUSION_TILE - 1);
+			int start_y = std::max(min_y, tile_y * OCCLUSION_TILE);
+			int end_y = std::min(max_y, tile_y * OCCLUSION_TILE + OCCLUSION_TILE - 1);
+			for (int y = start_y; y <= end_y; ++y)
+				for (int x = start_x; x <= end_x; ++x)
+					if (box_depth >= depth[y * width + x])
+						return true;
+		}
+	return false;
+}
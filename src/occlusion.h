@@ -0,0 +1,82 @@
+/*
+	Software occlusion culling. The triangles of a few big occluders are rasterized in the CPU to a low resolution
+	depth buffer, then the bounding boxes of the objects are tested against it: an object is hidden if all the pixels
+	covered by its box are closer than the closest point of the box.
+	- the depth stored is 1/w (or the inverted z for orthographic cameras), it is linear in screen space and bigger is closer
+	- the buffer is split in bands of tiles rasterized in parallel by the background TaskManager (4 pixels at a time with SSE)
+	- every tile keeps its farthest depth (a hierarchical level) so most boxes are solved without reading the pixels
+	It does not use the GPU, the results can be checked in the CPU.
+*/
+
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <vector>
+#include "framework.h"
+
+class Camera;
+
+#define OCCLUSION_WIDTH 256 //must be a multiple of 4 and of the tile size
+#define OCCLUSION_HEIGHT 128
+#define OCCLUSION_TILE 8 //pixels per side of the tiles, every band of tiles is a task
+
+class OcclusionBuffer
+{
+public:
+	//bounds of a box on screen
+	struct sScreenRect {
+		float min_x, min_y, max_x, max_y; //in pixels
+		float depth; //of the closest corner
+	};
+
+	int width;
+	int height;
+	std::vector<float> depth; //per pixel, 0 is empty
+	std::vector<float> tiles; //farthest depth of every tile
+
+	Matrix44 viewprojection;
+	bool orthographic;
+	float near_plane;
+
+	int num_occluders; //of the last rasterize
+	int num_triangles; //front facing and in front of the near plane
+
+	OcclusionBuffer(int width = OCCLUSION_WIDTH, int height = OCCLUSION_HEIGHT);
+
+	//clears the buffer and the occluders
+	void begin(const Matrix44& viewprojection, bool orthographic, float near_plane);
+	void begin(Camera* camera);
+
+	//the pointers must be valid till rasterize, the triangles that cross the near plane are skipped
+	void addOccluder(const Matrix44& model, const Vector3* positions, const unsigned int* indices, int num_indices, bool two_sided = false);
+	void rasterize();
+
+	//false if the box is in front of the near plane
+	bool projectBox(const BoundingBox& box, sScreenRect& rect) const;
+	//false if the box is hidden by the occluders
+	bool testBox(const BoundingBox& box) const;
+
+private:
+	//screen space triangle: edge functions and depth plane, evaluated in the pixel centers
+	struct sTriangle {
+		float edge_a[3], edge_b[3], edge_c[3];
+		float depth_a, depth_b, depth_c;
+		int min_x, max_x, min_y, max_y;
+	};
+
+	struct sOccluder {
+		Matrix44 mvp;
+		const Vector3* positions;
+		const unsigned int* indices;
+		int num_indices;
+		bool two_sided;
+	};
+
+	std::vector<sOccluder> occluders;
+	std::vector< std::vector<sTriangle> > occluder_triangles; //one per occluder
+
+	void setupTriangles(const sOccluder& occluder, std::vector<sTriangle>& triangles);
+	void rasterizeBand(int band);
+};
+
+#endif
@@ -18,7 +18,7 @@ using namespace GTR;
 
 int Node::s_NodeID = 0;
 
-Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
+Node::Node() : parent(NULL), prefab(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF), dirty(true), children_dirty(false)
 {
 	m_Id = s_NodeID++;
 }
@@ -37,6 +37,13 @@ Node::~Node()
 
 void Node::clear()
 {
+	if (children.size())
+	{
+		Prefab* owner = getPrefab();
+		if (owner)
+			owner->needs_compile = true;
+	}
+
 	//delete children
 	for (int i = 0; i < children.size(); ++i)
 	{
@@ -57,6 +64,17 @@ BoundingBox Node::getBoundingBox()
 	return transformBoundingBox(model, aabb);
 }
 
+void Node::addChild(Node* child)
+{
+	assert(child->parent == NULL);
+	children.push_back(child);
+	child->parent = this;
+	child->markDirty();
+	Prefab* owner = getPrefab();
+	if (owner)
+		owner->needs_compile = true;
+}
+
 void Node::removeChild(Node* child)
 {
 	assert(child->parent == this);
@@ -65,12 +83,74 @@ void Node::removeChild(Node* child)
 		Node* node = children[i];
 		if (node != child)
 			continue;
+		//the flat nodes of the prefab point to it, they cannot be used till it is compiled again
+		Prefab* owner = getPrefab();
+		if (owner)
+			owner->needs_compile = true;
 		child->parent = NULL;
 		children.erase(children.begin() + i);
+		child->markDirty(); //now it is the root of its tree
 		return;
 	}
 }
 
+void Node::setVisible(bool v)
+{
+	if (visible == v)
+		return;
+	visible = v;
+	Prefab* owner = getPrefab();
+	if (owner)
+		owner->needs_compile = true;
+}
+
+void Node::markDirty()
+{
+	dirty = true;
+	//the parents above an already flagged one are flagged too
+	for (Node* node = parent; node && !node->children_dirty; node = node->parent)
+		node->children_dirty = true;
+}
+
+Prefab* Node::getPrefab()
+{
+	Node* root = this;
+	while (root->parent)
+		root = root->parent;
+	return root->prefab;
+}
+
+Matrix44 Node::getGlobalMatrix()
+{
+	//the topmost dirty node, its subtree is outdated
+	Node* root = this;
+	Node* outdated = NULL;
+	for (Node* node = this; node; node = node->parent)
+	{
+		if (node->dirty)
+			outdated = node;
+		root = node;
+	}
+	if (!outdated)
+		return global_model;
+
+	//the prefab updates its flat nodes too
+	if (root->prefab)
+		root->prefab->updateGlobalMatrices();
+	else
+		outdated->updateGlobalMatrices();
+	return global_model;
+}
+
+void Node::updateGlobalMatrices()
+{
+	global_model = parent ? model * parent->global_model : model;
+	global_bounding = mesh ? transformBoundingBox(global_model, mesh->box) : BoundingBox();
+	dirty = children_dirty = false;
+	for (int i = 0; i < children.size(); ++i)
+		children[i]->updateGlobalMatrices();
+}
+
 Node* Node::findNode(const char* name)
 {
 	if (this->name == name)
@@ -133,6 +213,7 @@ void Node::operator = (const Node& node)
 	layers = node.layers;
 	model = node.model;
 	aabb = node.aabb;
+	markDirty();
 
 	//clone children
 	for (int i = 0; i < node.children.size(); ++i)
@@ -152,7 +233,8 @@ void Node::renderInMenu()
 	ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.75f, 0.75f, 0.75f, 1.0f));
 
 	//Model edit
-	ImGuiMatrix44(model, "Model");
+	if (ImGuiMatrix44(model, "Model"))
+		markDirty();
 
 	//Material
 	if (material && ImGui::TreeNode(material, "Material"))
@@ -179,10 +261,16 @@ void Node::renderInMenu()
 
 Prefab::Prefab()
 {
+	compile_version = 0;
+	transform_version = 0;
+	needs_compile = true;
+	root.prefab = this;
 }
 
 Prefab::~Prefab()
 {
+	root.prefab = NULL;
+
 	if (name.size())
 	{
 		auto it = sPrefabsLoaded.find(name);
@@ -198,6 +286,84 @@ void Prefab::updateBounding()
 
 std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
 
+static void flattenNode(sFlatNodes& flat, Node* node, int parent, bool visible)
+{
+	int index = flat.size();
+	visible = visible && node->visible;
+	flat.nodes.push_back(node);
+	flat.parents.push_back(parent);
+	flat.subtree_ends.push_back(0);
+	flat.models.push_back(node->model);
+	flat.global_models.push_back(parent == -1 ? node->model : node->model * flat.global_models[parent]);
+	flat.global_boundings.push_back(node->mesh ? transformBoundingBox(flat.global_models[index], node->mesh->box) : BoundingBox());
+	flat.meshes.push_back(node->mesh);
+	flat.materials.push_back(node->material);
+	flat.transform_versions.push_back(1);
+	if (node->mesh && node->material && visible)
+		flat.mesh_nodes.push_back(index);
+
+	node->global_model = flat.global_models[index];
+	node->global_bounding = flat.global_boundings[index];
+	node->dirty = node->children_dirty = false;
+
+	for (int i = 0; i < node->children.size(); ++i)
+		flattenNode(flat, node->children[i], index, visible);
+	flat.subtree_ends[index] = flat.size();
+}
+
+void Prefab::compile()
+{
+	flat = sFlatNodes();
+	flattenNode(flat, &root, -1, true);
+	needs_compile = false;
+	compile_version++;
+	transform_version++;
+}
+
+//recomputes the dirty nodes and everything below them, the branches without flags are skipped
+bool Prefab::updateGlobalMatrices()
+{
+	if (needs_compile)
+	{
+		compile();
+		return true;
+	}
+	if (!root.dirty && !root.children_dirty)
+		return false;
+
+	int i = 0;
+	while (i < flat.size())
+	{
+		Node* node = flat.nodes[i];
+		if (node->dirty)
+		{
+			int end = flat.subtree_ends[i];
+			for (; i < end; ++i)
+			{
+				Node* child = flat.nodes[i];
+				int parent = flat.parents[i];
+				flat.models[i] = child->model;
+				flat.global_models[i] = parent == -1 ? child->model : child->model * flat.global_models[parent];
+				if (flat.meshes[i])
+					flat.global_boundings[i] = transformBoundingBox(flat.global_models[i], flat.meshes[i]->box);
+				flat.transform_versions[i]++;
+				child->global_model = flat.global_models[i];
+				child->global_bounding = flat.global_boundings[i];
+				child->dirty = child->children_dirty = false;
+			}
+		}
+		else if (node->children_dirty)
+		{
+			node->children_dirty = false;
+			i++;
+		}
+		else
+			i = flat.subtree_ends[i];
+	}
+	transform_version++;
+	return true;
+}
+
 Prefab* Prefab::Get(const char* filename)
 {
 	assert(filename);
@@ -218,6 +384,7 @@ Prefab* Prefab::Get(const char* filename)
 	std::string name = filename;
 	prefab->registerPrefab(name);
 	prefab->updateBounding();
+	prefab->updateGlobalMatrices(); //compiles it if the loader did not
 	return prefab;
 }
 
@@ -15,6 +15,8 @@ class Camera;
 
 namespace GTR {
 
+	class Prefab;
+
 	class Primitive {
 	public:
 		Material* material;
@@ -34,21 +36,27 @@ namespace GTR {
 
 	public:
 		std::string name;
-		bool visible;
+		bool visible; //change it with setVisible, the hidden nodes are left out when the prefab is compiled
 		int layers;
 
 		Mesh* mesh;
 		//std::vector<Primitive*> primitives;
 		Material* material;
 
-		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
-		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
+		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent), call markDirty after changing it
+		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the root of the prefab, prefabs are shared)
+		BoundingBox global_bounding; //of the mesh, transformed by global_model
+
+		//the global matrices are only recomputed in the branches with dirty nodes (by Prefab::updateGlobalMatrices)
+		bool dirty; //model changed, the global_model of the node and its children is outdated
+		bool children_dirty; //some node below is dirty
 
 		BoundingBox aabb; //node bounding box in world space
 
 		//info to create the tree
 		Node* parent;
 		std::vector<Node*> children;
+		Prefab* prefab; //only in the root of a prefab, it is told when the tree changes
 
 		//ctor
 		Node();
@@ -64,23 +72,21 @@ namespace GTR {
 
 		Node* findNode(const char* name);
 
-		//add node to children list
-		void addChild(Node* child)
-		{
-			assert(child->parent == NULL);
-			children.push_back(child);
-			child->parent = this;
-		}
+		//add node to children list, the prefab of the tree is compiled again before it is used
+		void addChild(Node* child);
 		void removeChild(Node* child);
 
-		//compute the global matrix taking into account its parent
-		Matrix44 getGlobalMatrix(bool fast = false) { 
-			if (parent)
-				global_model = model * (fast ? parent->global_model : parent->getGlobalMatrix());
-			else
-				global_model = model;
-			return global_model;
-		}
+		void setModel(const Matrix44& m) { model = m; markDirty(); }
+		void setVisible(bool v);
+		//flags the node and its parents, the global matrices are updated in the next Prefab::updateGlobalMatrices
+		void markDirty();
+		//the prefab whose tree contains the node, NULL if it is not in one
+		Prefab* getPrefab();
+
+		//the global matrix taking into account its parents, the outdated ones of the tree are updated first
+		Matrix44 getGlobalMatrix();
+		//recomputes the global matrix of the node and its children, for trees that are not in a prefab
+		void updateGlobalMatrices();
 
 		bool testRay(const Ray& ray, Vector3& result, int layers = 0xFF, float max_dist = 3.4e+38F);
 		Vector3 localToGlobal(Vector3 v) { return global_model * v; }
@@ -88,6 +94,23 @@ namespace GTR {
 		void operator = (const Node& node);
 	};
 
+	//the nodes of a prefab compiled in arrays in depth first order (a parent is always before its children),
+	//the updates and the render collection run over contiguous memory instead of following the pointers of the tree
+	struct sFlatNodes {
+		std::vector<Node*> nodes; //to read the authoring data when it changes
+		std::vector<int> parents; //-1 for the root
+		std::vector<int> subtree_ends; //index after the last node below it
+		std::vector<Matrix44> models; //relative to the parent
+		std::vector<Matrix44> global_models; //relative to the root of the prefab
+		std::vector<BoundingBox> global_boundings; //of the mesh
+		std::vector<Mesh*> meshes;
+		std::vector<Material*> materials;
+		std::vector<unsigned int> transform_versions; //incremented every time the global matrix changes
+		std::vector<int> mesh_nodes; //the visible nodes with mesh and material
+
+		int size() const { return (int)nodes.size(); }
+	};
+
 	//a Prefab represent a set of objects in a tree structure
 	//used to load info from GLTF files
 	class Prefab
@@ -102,12 +125,21 @@ namespace GTR {
 		Node root;
 		BoundingBox bounding;
 
+		sFlatNodes flat;
+		unsigned int compile_version; //incremented by compile, the indices of the flat nodes change
+		unsigned int transform_version; //incremented when the global matrix of any node changes
+		bool needs_compile; //nodes were added, removed or hidden, the flat nodes are outdated
+
 		//dtor
 		Prefab();
 		~Prefab();
 
 		void updateBounding();
 		void updateNodesByName();
+		//flattens the tree, updateGlobalMatrices calls it when the nodes change
+		void compile();
+		//compiles the prefab if needed, then does nothing if no node moved since the last call, true if any global matrix changed
+		bool updateGlobalMatrices();
 		Node* getNodeByName(const char* name);
 
 				//Manager to cache loaded prefabs
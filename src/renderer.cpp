@@ -12,16 +12,40 @@
 #include "fbo.h"
 #include <algorithm>
 #include <vector>
+#include <unordered_map>
 #include "sphericalharmonics.h"
+#include "task.h"
+#include "glstate.h"
 
 using namespace GTR;
 
+//the structs of the uniform buffers must match the std140 layout of the blocks in the shader atlas
+static_assert(sizeof(Renderer::sFrameBlock) == 96, "FrameBlock layout");
+static_assert(sizeof(Renderer::sLightData) == 144, "LightData layout");
+static_assert(sizeof(Renderer::sMaterialData) == 48, "MaterialData layout");
+
 Renderer::Renderer()
 {
 	light_mode = eLightMode::MULTI;
 	pipeline = ePipeline::DEFERRED;
 
 	render_shadowmaps = false;
+	collect_chunk_size = 64;
+#ifdef USE_INSTANCING
+	use_instancing = true;
+#else
+	use_instancing = false;
+#endif
+	use_lods = true;
+	use_cluster_culling = true;
+	use_occlusion_culling = true;
+	max_occluders = 32;
+	max_occluder_triangles = 20000;
+	occluder_min_size = 16.0f;
+	occlusion_tested_calls = occlusion_culled_calls = 0;
+	lod_pixel_error = 1.0f;
+	lod_viewport_height = 1.0f;
+	memset(calls_frustum, 0, sizeof(calls_frustum));
 
 	//GBUFFERS
 	gbuffers_fbo = NULL;
@@ -58,10 +82,30 @@ Renderer::Renderer()
 	volumetric_fbo = NULL;
 	direct_light = NULL;
 
+	//CLUSTERED LIGHTING
+	clusters_grid_texture = NULL;
+	clusters_indices_texture = NULL;
+	clustered_lights_texture = NULL;
+
 	//DECALS
 	decals_fbo = NULL;
 	cube.createCube(Vector3(1.0, 1.0, 1.0));
 
+	//DEFERRED LIGHT VOLUMES
+	sphere_volume.createSphere(1.0f);
+	cone_volume.createCone(1.0f, 1.0f);
+	sphere_volume.uploadToVRAM(); //core profile, they cannot be drawn from client memory
+	cone_volume.uploadToVRAM();
+	deferred_volume_lights = 0;
+	deferred_fullscreen_lights = 0;
+
+	//UNIFORM BUFFERS
+	frame_buffer = new UniformBuffer(FRAME_BLOCK, sizeof(sFrameBlock));
+	lights_buffer = new UniformBuffer(LIGHTS_BLOCK, sizeof(sLightsBlock));
+	materials_buffer = new UniformBuffer(MATERIALS_BLOCK, max_materials * sizeof(sMaterialData));
+	frame_block_uploaded = false;
+	frame_time = 0;
+
 	//POSTFX
 	postFX_textureA = NULL;
 	postFX_textureB = NULL;
@@ -107,22 +151,16 @@ void Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 	lights.clear();
 	render_calls.clear();
 	decals.clear();
+	frame_time = getTime();
+	occlusion_tested_calls = occlusion_culled_calls = 0;
 
-	//Collect info from entities
+	//Collect info from entities (the prefabs are in the BVH of the scene)
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
 		BaseEntity* ent = scene->entities[i];
 		if (!ent->visible)
 			continue;
 
-		//is a prefab!
-		if (ent->entity_type == PREFAB)
-		{
-			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if(pent->prefab)
-				renderPrefab(ent->model, pent->prefab, camera);
-		}
-
 		//is a light!
 		if (ent->entity_type == LIGHT)
 		{
@@ -139,15 +177,24 @@ void Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 		}
 	}
 
-	std::sort(render_calls.begin(), render_calls.end(), sort_distance());
+	scene->updateBVH();
+	collectRenderCalls(scene, camera, render_calls);
+	sortRenderCalls();
+	if (use_occlusion_culling)
+		cullOccludedCalls(camera);
+	buildRenderBatches();
+	uploadMaterialsBlock();
 
 	//Generate shadowmaps
 	for (int i = 0; i < lights.size(); ++i)
 	{
 		LightEntity* light = lights[i];
 		if (light->cast_shadows)
-			generateShadowmap(light);
+			generateShadowmap(light, scene);
 	}
+
+	//after the shadowmaps, they update the light cameras
+	uploadLightsBlock();
 	
 	if (pipeline == FORWARD) renderForward(camera, scene);
 	else if (pipeline == DEFERRED) renderDeferred(camera, scene);
@@ -179,13 +226,29 @@ void GTR::Renderer::renderForward(Camera* camera, GTR::Scene* scene)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	checkGLErrors();
 
+	uploadFrameBlock(camera);
 	renderSkybox(camera);
 
+	if (light_mode == CLUSTERED && camera->type == Camera::PERSPECTIVE)
+		buildLightClusters(camera);
+
+	cullRenderCalls(camera);
+	for (int i = 0; i < render_batches.size(); ++i)
+	{
+		RenderBatch& batch = render_batches[i];
+		int num_instances = collectBatchInstances(batch);
+		if (num_instances)
+			renderMeshWithMaterialandLighting(&instance_models[0], num_instances, batch.mesh, batch.material, camera, batch.lod);
+	}
+
+	//blended calls are not batched, they must keep the back to front order
 	for (int i = 0; i < render_calls.size(); ++i)
 	{
 		RenderCall& rc = render_calls[i];
-		if (camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
-			renderMeshWithMaterialandLighting(rc.model, rc.mesh, rc.material, camera);
+		if (rc.material->alpha_mode != eAlphaMode::BLEND)
+			continue;
+		if (calls_culler.isVisible(i))
+			renderMeshWithMaterialandLighting(rc.model, rc.mesh, rc.material, camera, rc.lod);
 	}
 
 	for (int i = 0; i < probes.size(); ++i)
@@ -245,6 +308,8 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 		postFX_textureD = new Texture(width, height, GL_RGB, GL_FLOAT, false);
 	}
 
+	uploadFrameBlock(camera);
+
 	//------GBUFFERS-------
 	gbuffers_fbo->bind();
 
@@ -253,12 +318,14 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	checkGLErrors();
 
-	//Renderizar cada objecto con un GBUffer shader
-	for (int i = 0; i < render_calls.size(); ++i)
+	//Renderizar cada objecto con un GBUffer shader (the blended ones are rendered later)
+	cullRenderCalls(camera);
+	for (int i = 0; i < render_batches.size(); ++i)
 	{
-		RenderCall& rc = render_calls[i];
-		if (camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
-			renderMeshWithMaterialToGBuffers(rc.model, rc.mesh, rc.material, camera);
+		RenderBatch& batch = render_batches[i];
+		int num_instances = collectBatchInstances(batch);
+		if (num_instances)
+			renderMeshWithMaterialToGBuffers(&instance_models[0], num_instances, batch.mesh, batch.material, camera, batch.lod);
 	}
 
 	gbuffers_fbo->unbind();
@@ -278,18 +345,16 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 		shader = Shader::Get("decal");
 		shader->enable();
 
-		shader->setUniform("u_gb0_texture", decals_fbo->color_textures[0], 0);
-		shader->setUniform("u_gb1_texture", decals_fbo->color_textures[1], 1);
-		shader->setUniform("u_gb2_texture", decals_fbo->color_textures[2], 2);
-		shader->setUniform("u_depth_texture", decals_fbo->depth_texture, 3);
+		shader->setUniform(UNIFORM("u_gb0_texture"), decals_fbo->color_textures[0], 0);
+		shader->setUniform(UNIFORM("u_gb1_texture"), decals_fbo->color_textures[1], 1);
+		shader->setUniform(UNIFORM("u_gb2_texture"), decals_fbo->color_textures[2], 2);
+		shader->setUniform(UNIFORM("u_depth_texture"), decals_fbo->depth_texture, 3);
 
-		shader->setUniform("u_camera_position", camera->eye);
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+		shader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+		shader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
 
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 		for (int i = 0; i < decals.size(); i++)
 		{
@@ -298,15 +363,15 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 			Texture* decal_texture = Texture::Get(decal->texture.c_str());
 			if (!decal_texture) 
 				continue;
-			shader->setUniform("u_decal_texture", decal_texture, 4);
-			shader->setUniform("u_model", decal->model);
+			shader->setUniform(UNIFORM("u_decal_texture"), decal_texture, 4);
+			shader->setUniform(UNIFORM("u_model"), decal->model);
 
 			Matrix44 imodel = decal->model;
-			imodel.inverse(); 
-			shader->setUniform("u_imodel", imodel); //World space to local
+			imodel.inverseAffine();
+			shader->setUniform(UNIFORM("u_imodel"), imodel); //World space to local
 			cube.render(GL_TRIANGLES);
 		}
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 
 		gbuffers_fbo->unbind();
 	}
@@ -315,20 +380,20 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 	//-------SSAO-------
 	ssao_fbo->bind();
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
 
 	if (ssao_plus) {shader = Shader::Get("ssao_plus");}
 	else { shader = Shader::Get("ssao"); }
 	
 	shader->enable();
 
-	shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 1);
-	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_inverse_viewprojection", inv_vp);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-	shader->setUniform3Array("u_points", (float*)&random_points[0], random_points.size());
+	shader->setUniform(UNIFORM("u_gb1_texture"), gbuffers_fbo->color_textures[1], 1);
+	shader->setUniform(UNIFORM("u_depth_texture"), gbuffers_fbo->depth_texture, 3);
+	shader->setUniform(UNIFORM("u_viewprojection"), camera->viewprojection_matrix);
+	shader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+	shader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
+	shader->setUniform3Array(UNIFORM("u_points"), (float*)&random_points[0], random_points.size());
 
 	quad->render(GL_TRIANGLES);
 
@@ -339,48 +404,13 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 
 	gbuffers_fbo->depth_texture->copyTo(NULL);
 	
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_DEPTH_TEST);
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	renderSkybox(camera);
-	//we need a fullscreen quad
-	shader = Shader::Get("deferred");
-	shader->enable();
-
-	GbuffersShader(shader, scene, camera); //gb0, gb1, gb2, depth
-	shader->setUniform("u_ssao_texture", ssao_fbo->color_textures[0], 5);
-
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_inverse_viewprojection", inv_vp);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-
-	if (!lights.size())
-	{
-		shader->setUniform("u_light_color", Vector3());
-		quad->render(GL_TRIANGLES);
-	}
-	else
-		for (int i = 0; i < lights.size(); ++i)
-		{
-			LightEntity* light = lights[3]; //3 direccional porque sino solo coge la primera del json :/
-
-			if (i == 0)
-				glDisable(GL_BLEND);
-			else {
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-				glEnable(GL_BLEND);
-			}
-
-			uploadLightToShader(light, shader);
-
-			//do the draw call that renders the mesh into the screen
-			quad->render(GL_TRIANGLES);
-
-			shader->setUniform("u_ambient_light", Vector3());
-		}
-	glDisable(GL_CULL_FACE);
+	renderDeferredLights(camera, scene, inv_vp, width, height);
+	GLState::disable(GL_CULL_FACE);
 
 	//-------IRRADIANCE-------
 	if (probes_texture) {
@@ -388,43 +418,43 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 		shader->enable();
 
 		GbuffersShader(shader, scene, camera);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-		shader->setUniform("u_irr", true);
-
-		shader->setUniform("u_ssao_texture", ssao_fbo->color_textures[0], 5);
-		shader->setUniform("u_irr_texture", probes_texture, 6);
-		shader->setUniform("u_irr_start", start_irr);
-		shader->setUniform("u_irr_end", end_irr);
-		shader->setUniform("u_irr_dim", dim_irr);
-
-		shader->setUniform("u_irr_normal_distance", 0.1f);
-		shader->setUniform("u_num_probes", probes_texture->height);
-		shader->setUniform("u_irr_delta", end_irr - start_irr);
-
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		shader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+		shader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
+		shader->setUniform(UNIFORM("u_irr"), true);
+
+		shader->setUniform(UNIFORM("u_ssao_texture"), ssao_fbo->color_textures[0], 5);
+		shader->setUniform(UNIFORM("u_irr_texture"), probes_texture, 6);
+		shader->setUniform(UNIFORM("u_irr_start"), start_irr);
+		shader->setUniform(UNIFORM("u_irr_end"), end_irr);
+		shader->setUniform(UNIFORM("u_irr_dim"), dim_irr);
+
+		shader->setUniform(UNIFORM("u_irr_normal_distance"), 0.1f);
+		shader->setUniform(UNIFORM("u_num_probes"), probes_texture->height);
+		shader->setUniform(UNIFORM("u_irr_delta"), end_irr - start_irr);
+
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 		
 		quad->render(GL_TRIANGLES);
 
-	}else { shader->setUniform("u_irr", false); }
+	}else { shader->setUniform(UNIFORM("u_irr"), false); }
 	
 
 	//-------ALPHA-------
 	//gbuffers_fbo->depth_texture->copyTo(NULL); //Depth buffer
 	
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_BLEND);
 
 	for (int i = 0; i < render_calls.size(); i++) {
 		RenderCall& rc = render_calls[i];
 		if (rc.material->alpha_mode == eAlphaMode::BLEND)
-			if (camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
-				renderMeshWithMaterialToGBuffers(rc.model, rc.mesh, rc.material, camera);
+			if (calls_culler.isVisible(i))
+				renderMeshWithMaterialToGBuffers(rc.model, rc.mesh, rc.material, camera, rc.lod);
 	}
 
 	illumination_fbo->unbind();
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
 
 	applyFX(illumination_fbo->color_textures[0], gbuffers_fbo->depth_texture, camera);
 
@@ -434,10 +464,10 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 		shader = Shader::Get("tonemapping");
 		shader->enable();
 
-		shader->setUniform("u_scale", u_scale);
-		shader->setUniform("u_average_lum", u_average_lum);
-		shader->setUniform("u_lumwhite2", u_lumwhite2);
-		shader->setUniform("u_igamma", u_igamma);
+		shader->setUniform(UNIFORM("u_scale"), u_scale);
+		shader->setUniform(UNIFORM("u_average_lum"), u_average_lum);
+		shader->setUniform(UNIFORM("u_lumwhite2"), u_lumwhite2);
+		shader->setUniform(UNIFORM("u_igamma"), u_igamma);
 
 		illumination_fbo->color_textures[0]->toViewport(shader);
 	}
@@ -455,14 +485,14 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 
 		shader = Shader::Get("volumetric");
 		shader->enable();
-		shader->setUniform("u_camera_position", camera->eye);
-		shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
-		shader->setUniform("u_air_density", scene->air_density * 0.001f);
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)volumetric_fbo->color_textures[0]->width, 1.0 / (float)volumetric_fbo->color_textures[0]->height));
+		shader->setUniform(UNIFORM("u_camera_position"), camera->eye);
+		shader->setUniform(UNIFORM("u_depth_texture"), gbuffers_fbo->depth_texture, 3);
+		shader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+		shader->setUniform(UNIFORM("u_air_density"), scene->air_density * 0.001f);
+		shader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)volumetric_fbo->color_textures[0]->width, 1.0 / (float)volumetric_fbo->color_textures[0]->height));
 		
-		glDisable(GL_BLEND);
-		glBlendFunc(GL_ONE, GL_ONE);
+		GLState::disable(GL_BLEND);
+		GLState::blendFunc(GL_ONE, GL_ONE);
 
 		for (int i = 0; i < lights.size(); ++i)
 		{
@@ -475,16 +505,16 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 		}
 		
 		volumetric_fbo->unbind();
-		glEnable(GL_BLEND);
+		GLState::enable(GL_BLEND);
 		//glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 		volumetric_fbo->color_textures[0]->toViewport();
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 	}
 
 	if (show_gbuffers)
 	{
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 		glViewport(0, height * 0.5, width * 0.5, height * 0.5);
 		gbuffers_fbo->color_textures[0]->toViewport();
 		glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
@@ -496,14 +526,14 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene)
 
 		Shader* shader = Shader::getDefaultShader("depth");
 		shader->enable();
-		shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+		shader->setUniform(UNIFORM("u_camera_nearfar"), Vector2(camera->near_plane, camera->far_plane));
 		gbuffers_fbo->depth_texture->toViewport(shader);
 		glViewport(0, 0, width, height);
 	}
 
 	if (show_ssao)
 	{
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 		ssao_fbo->color_textures[0]->toViewport();
 	}
 }
@@ -526,8 +556,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 		fbo->bind();
 		fxshader = Shader::Get("blur");
 		fxshader->enable();
-		fxshader->setUniform("u_intensity", 1.0f);
-		fxshader->setUniform("u_offset", vec2(pow(1.0f, i) / current_texture->width, 0.0) * blur); //Horizontal
+		fxshader->setUniform(UNIFORM("u_intensity"), 1.0f);
+		fxshader->setUniform(UNIFORM("u_offset"), vec2(pow(1.0f, i) / current_texture->width, 0.0) * blur); //Horizontal
 		current_texture->toViewport(fxshader);
 		fbo->unbind();
 
@@ -535,8 +565,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 		fbo->bind();
 		fxshader = Shader::Get("blur");
 		fxshader->enable();
-		fxshader->setUniform("u_intensity", 1.0f);
-		fxshader->setUniform("u_offset", vec2(0.0f, pow(1.0f, i) / current_texture->height) * blur); //Vertical
+		fxshader->setUniform(UNIFORM("u_intensity"), 1.0f);
+		fxshader->setUniform(UNIFORM("u_offset"), vec2(0.0f, pow(1.0f, i) / current_texture->height) * blur); //Vertical
 		postFX_textureA->toViewport(fxshader);
 		fbo->unbind();
 		current_texture = postFX_textureB;
@@ -547,9 +577,9 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("bloom");
 	fxshader->enable();
-	fxshader->setUniform("u_intensity", bloom_intensity);
-	fxshader->setUniform("threshold", bloom_threshold);
-	fxshader->setUniform("soft_threshold", bloom_soft_threshold);
+	fxshader->setUniform(UNIFORM("u_intensity"), bloom_intensity);
+	fxshader->setUniform(UNIFORM("threshold"), bloom_threshold);
+	fxshader->setUniform(UNIFORM("soft_threshold"), bloom_soft_threshold);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -561,15 +591,15 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fxshader = Shader::Get("dof");
 	fxshader->enable();
 
-	fxshader->setUniform("u_depth_texture", depth_texture, 1);
-	fxshader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+	fxshader->setUniform(UNIFORM("u_depth_texture"), depth_texture, 1);
+	fxshader->setUniform(UNIFORM("u_camera_nearfar"), Vector2(camera->near_plane, camera->far_plane));
 
-	fxshader->setUniform("u_size", (float)20.0f);
-	fxshader->setUniform("u_aperture", (float)aperture);
-	fxshader->setUniform("u_focal_length", 1.0f / tan(camera->fov * float(DEG2RAD) * 0.5f));
-	fxshader->setUniform("u_plane_focus", (float)focus_plane);
+	fxshader->setUniform(UNIFORM("u_size"), (float)20.0f);
+	fxshader->setUniform(UNIFORM("u_aperture"), (float)aperture);
+	fxshader->setUniform(UNIFORM("u_focal_length"), 1.0f / tan(camera->fov * float(DEG2RAD) * 0.5f));
+	fxshader->setUniform(UNIFORM("u_plane_focus"), (float)focus_plane);
 
-	fxshader->setUniform("u_iRes", Vector2(1.0f / (float)width, 1.0f / (float)height));
+	fxshader->setUniform(UNIFORM("u_iRes"), Vector2(1.0f / (float)width, 1.0f / (float)height));
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -580,9 +610,9 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("motionblur");
 	fxshader->enable();
-	fxshader->setUniform("u_depth_texture", depth_texture, 1);
-	fxshader->setUniform("u_inverse_viewprojection", inv_vp);
-	fxshader->setUniform("u_viewprojection_old", vp_matrix_last);
+	fxshader->setUniform(UNIFORM("u_depth_texture"), depth_texture, 1);
+	fxshader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+	fxshader->setUniform(UNIFORM("u_viewprojection_old"), vp_matrix_last);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -595,8 +625,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("greyscale");
 	fxshader->enable();
-	fxshader->setUniform("u_saturation", saturation);
-	fxshader->setUniform("u_vigneting", vigneting);
+	fxshader->setUniform(UNIFORM("u_saturation"), saturation);
+	fxshader->setUniform(UNIFORM("u_vigneting"), vigneting);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -607,7 +637,7 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("contrast");
 	fxshader->enable();
-	fxshader->setUniform("u_intensity", contrast);
+	fxshader->setUniform(UNIFORM("u_intensity"), contrast);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureC;
@@ -617,7 +647,7 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("threshold");
 	fxshader->enable();
-	fxshader->setUniform("u_threshold", threshold);
+	fxshader->setUniform(UNIFORM("u_threshold"), threshold);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureD;
@@ -627,8 +657,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("mix");
 	fxshader->enable();
-	fxshader->setUniform("u_intensity", mix_factor);
-	fxshader->setUniform("u_textureB", postFX_textureC, 1);
+	fxshader->setUniform(UNIFORM("u_intensity"), mix_factor);
+	fxshader->setUniform(UNIFORM("u_textureB"), postFX_textureC, 1);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -639,9 +669,9 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("grain");
 	fxshader->enable();
-	fxshader->setUniform("amount", float(abs(cos(getTime()))));
-	fxshader->setUniform("tDiffuse", postFX_textureB, 1);
-	fxshader->setUniform("noise_amount", noise_amount);
+	fxshader->setUniform(UNIFORM("amount"), float(abs(cos(getTime()))));
+	fxshader->setUniform(UNIFORM("tDiffuse"), postFX_textureB, 1);
+	fxshader->setUniform(UNIFORM("noise_amount"), noise_amount);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -652,8 +682,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("chromatic_aberration");
 	fxshader->enable();
-	fxshader->setUniform("u_amount", chroma);
-	fxshader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+	fxshader->setUniform(UNIFORM("u_amount"), chroma);
+	fxshader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -664,8 +694,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("lens_distortion");
 	fxshader->enable();
-	fxshader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-	fxshader->setUniform("u_resolution", distortion);
+	fxshader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
+	fxshader->setUniform(UNIFORM("u_resolution"), distortion);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -677,8 +707,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("lut");
 	fxshader->enable();
-	fxshader->setUniform("u_amount", lut_amount);
-	fxshader->setUniform("u_textureB", postFX_textureD, 1);
+	fxshader->setUniform(UNIFORM("u_amount"), lut_amount);
+	fxshader->setUniform(UNIFORM("u_textureB"), postFX_textureD, 1);
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -690,8 +720,8 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fbo->bind();
 	fxshader = Shader::Get("fxaa");
 	fxshader->enable();
-	fxshader->setUniform("u_viewportSize", Vector2((float)width, (float)height));
-	fxshader->setUniform("u_iViewportSize", Vector2(1.0 / (float)width, 1.0 / (float)height));
+	fxshader->setUniform(UNIFORM("u_viewportSize"), Vector2((float)width, (float)height));
+	fxshader->setUniform(UNIFORM("u_iViewportSize"), Vector2(1.0 / (float)width, 1.0 / (float)height));
 	current_texture->toViewport(fxshader);
 	fbo->unbind();
 	current_texture = postFX_textureA;
@@ -701,23 +731,162 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	fxshader = Shader::Get("tonemapping");
 	fxshader->enable();
 
-	fxshader->setUniform("u_scale", u_scale);
-	fxshader->setUniform("u_average_lum", u_average_lum);
-	fxshader->setUniform("u_lumwhite2", u_lumwhite2);
-	fxshader->setUniform("u_igamma", u_igamma);
-	glDisable(GL_BLEND);
+	fxshader->setUniform(UNIFORM("u_scale"), u_scale);
+	fxshader->setUniform(UNIFORM("u_average_lum"), u_average_lum);
+	fxshader->setUniform(UNIFORM("u_lumwhite2"), u_lumwhite2);
+	fxshader->setUniform(UNIFORM("u_igamma"), u_igamma);
+	GLState::disable(GL_BLEND);
 
 	current_texture->toViewport(fxshader); //fxshader
 
 }
 
+//the scale of the unit sphere or cone of the light volume, the cone is only used if it is smaller than the sphere
+static Matrix44 getLightVolumeModel(LightEntity* light, bool& use_cone)
+{
+	Matrix44 model;
+	use_cone = light->light_type == SPOT && light->cone_angle < 45.0f;
+	if (use_cone)
+	{
+		//the basis of the cone from the front of the light (setFrontAndOrthonormalize fails with vertical fronts)
+		Vector3 front = light->model.frontVector().normalize();
+		Vector3 helper = fabs(front.y) < 0.99f ? Vector3(0.0f, 1.0f, 0.0f) : Vector3(1.0f, 0.0f, 0.0f);
+		Vector3 right = helper.cross(front).normalize();
+		Vector3 up = front.cross(right);
+		float radius = light->max_dist * (float)tan(light->cone_angle * DEG2RAD);
+		right = right * radius;
+		up = up * radius;
+		front = front * light->max_dist;
+		model.m[0] = right.x; model.m[1] = right.y; model.m[2] = right.z;
+		model.m[4] = up.x; model.m[5] = up.y; model.m[6] = up.z;
+		model.m[8] = front.x; model.m[9] = front.y; model.m[10] = front.z;
+	}
+	else
+		model.setScale(light->max_dist, light->max_dist, light->max_dist);
+
+	Vector3 position = light->model.getTranslation();
+	model.m[12] = position.x;
+	model.m[13] = position.y;
+	model.m[14] = position.z;
+	return model;
+}
+
+void Renderer::renderDeferredLights(Camera* camera, Scene* scene, const Matrix44& inv_vp, int width, int height)
+{
+	Mesh* quad = Mesh::getQuad();
+	Vector3 camera_front = (camera->center - camera->eye).normalize();
+
+	deferred_volume_lights = 0;
+	deferred_fullscreen_lights = 0;
+
+	//full screen passes: the directional lights and the volumes the depth test can not use (their back faces are clipped by the far plane)
+	std::vector<LightEntity*> volume_lights;
+	Shader* shader = Shader::Get("deferred");
+	shader->enable();
+	GbuffersShader(shader, scene, camera); //gb0, gb1, gb2, depth
+	shader->setUniform(UNIFORM("u_ssao_texture"), ssao_fbo->color_textures[0], 5);
+	shader->setUniform(UNIFORM("u_camera_position"), camera->eye);
+	shader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+	shader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
+
+	//the first pass replaces the background and adds the ambient and the emissive, the rest are added
+	bool first_pass = true;
+	shader->setUniform(UNIFORM("u_ambient_light"), scene->ambient_light);
+	shader->setUniform(UNIFORM("u_add_emissive"), true);
+	GLState::disable(GL_BLEND);
+
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		if (light->light_type != DIRECTIONAL)
+		{
+			Vector3 position = light->model.getTranslation();
+			if (camera->testSphereInFrustum(position, light->max_dist) == CLIP_OUTSIDE)
+				continue;
+			if ((position - camera->eye).dot(camera_front) + light->max_dist < camera->far_plane)
+			{
+				volume_lights.push_back(light);
+				continue;
+			}
+		}
+
+		uploadLightToShader(light, shader);
+		quad->render(GL_TRIANGLES);
+		deferred_fullscreen_lights++;
+
+		if (first_pass)
+		{
+			first_pass = false;
+			shader->setUniform(UNIFORM("u_ambient_light"), Vector3());
+			shader->setUniform(UNIFORM("u_add_emissive"), false);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
+			GLState::enable(GL_BLEND);
+		}
+	}
+
+	//no full screen light, only the ambient and the emissive
+	if (first_pass)
+	{
+		//a black directional light, the point ones divide by max_dist
+		shader->setUniform(UNIFORM("u_light_type"), (int)DIRECTIONAL);
+		shader->setUniform(UNIFORM("u_light_color"), Vector3());
+		shader->setVector3(UNIFORM("u_light_vector"), Vector3(0.0f, 1.0f, 0.0f));
+		shader->setUniform(UNIFORM("u_light_cast_shadows"), 0);
+		quad->render(GL_TRIANGLES);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
+		GLState::enable(GL_BLEND);
+	}
+
+	if (!volume_lights.size())
+		return;
+
+	//the back faces of the volume only pass where the scene is in front of them, the pixels behind the volume
+	//or outside of it on screen are never shaded (the illumination fbo has a copy of the depth of the gbuffers)
+	shader = Shader::Get("deferred_volume");
+	if (!shader)
+		return;
+	shader->enable();
+	GbuffersShader(shader, scene, camera);
+	shader->setUniform(UNIFORM("u_viewprojection"), camera->viewprojection_matrix);
+	shader->setUniform(UNIFORM("u_ssao_texture"), ssao_fbo->color_textures[0], 5);
+	shader->setUniform(UNIFORM("u_camera_position"), camera->eye);
+	shader->setUniform(UNIFORM("u_inverse_viewprojection"), inv_vp);
+	shader->setUniform(UNIFORM("u_iRes"), Vector2(1.0 / (float)width, 1.0 / (float)height));
+	shader->setUniform(UNIFORM("u_ambient_light"), Vector3());
+	shader->setUniform(UNIFORM("u_add_emissive"), false);
+
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_GREATER);
+	glDepthMask(false);
+	GLState::enable(GL_CULL_FACE);
+	glCullFace(GL_FRONT);
+
+	for (int i = 0; i < volume_lights.size(); ++i)
+	{
+		LightEntity* light = volume_lights[i];
+		bool use_cone;
+		shader->setUniform(UNIFORM("u_model"), getLightVolumeModel(light, use_cone));
+		uploadLightToShader(light, shader);
+		if (use_cone)
+			cone_volume.render(GL_TRIANGLES);
+		else
+			sphere_volume.render(GL_TRIANGLES);
+		deferred_volume_lights++;
+	}
+
+	glCullFace(GL_BACK);
+	glDepthMask(true);
+	GLState::depthFunc(GL_LESS);
+	GLState::disable(GL_DEPTH_TEST);
+}
+
 void Renderer::GbuffersShader(Shader* shader, Scene* scene, Camera* camera)
 {
-	shader->setUniform("u_gb0_texture", gbuffers_fbo->color_textures[0], 1);
-	shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 2);
-	shader->setUniform("u_gb2_texture", gbuffers_fbo->color_textures[2], 3);
+	shader->setUniform(UNIFORM("u_gb0_texture"), gbuffers_fbo->color_textures[0], 1);
+	shader->setUniform(UNIFORM("u_gb1_texture"), gbuffers_fbo->color_textures[1], 2);
+	shader->setUniform(UNIFORM("u_gb2_texture"), gbuffers_fbo->color_textures[2], 3);
 
-	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	shader->setUniform(UNIFORM("u_depth_texture"), gbuffers_fbo->depth_texture, 4);
 }
 
 
@@ -730,13 +899,13 @@ void GTR::Renderer::showShadowmap(LightEntity* light)
 	Shader* shader = Shader::getDefaultShader("depth");
 	shader->enable();
 	if (light->light_type == eLightType::DIRECTIONAL)
-		shader->setUniform("u_camera_nearfar", Vector2(0, 1));
+		shader->setUniform(UNIFORM("u_camera_nearfar"), Vector2(0, 1));
 	else
-		shader->setUniform("u_camera_nearfar", Vector2(light->light_camera->near_plane, light->light_camera->far_plane));
+		shader->setUniform(UNIFORM("u_camera_nearfar"), Vector2(light->light_camera->near_plane, light->light_camera->far_plane));
 	light->shadowmap->toViewport(shader);
 }
 
-void Renderer::generateShadowmap(LightEntity* light)
+void Renderer::generateShadowmap(LightEntity* light, Scene* scene)
 {
 	if (light->light_type != eLightType::SPOT && light->light_type != eLightType::DIRECTIONAL)
 		return;
@@ -781,65 +950,419 @@ void Renderer::generateShadowmap(LightEntity* light)
 		return;
 	
 	light_camera->enable();
+	uploadFrameBlock(light_camera);
 
 	glClear(GL_DEPTH_BUFFER_BIT);
 
-	for (int i = 0; i < render_calls.size(); ++i)
+	//the casters are the nodes inside the frustum of the light, not the ones seen by the camera,
+	//they use their own buffers so the calls of the view are kept
+	float view_frustum[6][4];
+	memcpy(view_frustum, calls_frustum, sizeof(view_frustum));
+	render_calls.swap(shadow_render_calls);
+	render_batches.swap(shadow_render_batches);
+	render_calls.clear();
+	collectRenderCalls(scene, light_camera, render_calls);
+	sortRenderCalls();
+	if (use_occlusion_culling)
+		cullOccludedCalls(light_camera);
+	buildRenderBatches();
+
+	//batches only contain opaque calls
+	cullRenderCalls(light_camera);
+	for (int i = 0; i < render_batches.size(); ++i)
 	{
-		RenderCall& rc = render_calls[i];
-		if (rc.material->alpha_mode == eAlphaMode::BLEND)
-			continue;
-		if (light_camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
-			renderFlatMesh(rc.model, rc.mesh, rc.material, light_camera);
+		RenderBatch& batch = render_batches[i];
+		int num_instances = collectBatchInstances(batch);
+		if (num_instances)
+			renderFlatMesh(&instance_models[0], num_instances, batch.mesh, batch.material, light_camera, batch.lod);
 	}
 
+	render_calls.swap(shadow_render_calls);
+	render_batches.swap(shadow_render_batches);
+	memcpy(calls_frustum, view_frustum, sizeof(calls_frustum));
+
 	light->fbo->unbind();
 	view_camera->enable();
+	uploadFrameBlock(view_camera);
+}
+
+//collects the calls of the visible nodes in chunks in the worker threads, every chunk writes in its own buffer and they are merged in order
+void Renderer::collectRenderCalls(GTR::Scene* scene, Camera* camera, std::vector<RenderCall>& calls)
+{
+	visible_nodes.clear();
+	scene->queryFrustum(camera, visible_nodes);
+	memcpy(calls_frustum, camera->frustum, sizeof(calls_frustum));
+
+	//the LODs are chosen by their size in pixels of the render target, read here because the workers cannot use GL
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	lod_viewport_height = (float)viewport[3];
+
+	int num_nodes = (int)visible_nodes.size();
+	int num_chunks = (num_nodes + collect_chunk_size - 1) / collect_chunk_size;
+	if (chunk_render_calls.size() < num_chunks)
+		chunk_render_calls.resize(num_chunks);
+
+	TaskManager::background.parallelFor(num_nodes, collect_chunk_size, [&](int start, int end, int chunk) {
+		std::vector<RenderCall>& chunk_calls = chunk_render_calls[chunk];
+		chunk_calls.clear();
+		for (int i = start; i < end; ++i)
+		{
+			sSceneNode* scene_node = visible_nodes[i];
+			addRenderCall(scene_node->model, scene_node->world_bounding, scene_node->mesh, scene_node->material, camera, chunk_calls);
+		}
+	});
+
+	for (int i = 0; i < num_chunks; ++i)
+		calls.insert(calls.end(), chunk_render_calls[i].begin(), chunk_render_calls[i].end());
 }
 
 //renders all the prefab
 void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+{
+	prefab->updateGlobalMatrices(); //compiles it if its nodes changed
+	renderPrefab(model, prefab, camera, render_calls);
+}
+
+//collects the render calls of the prefab, it can be called from several threads at the same time
+//(the prefab must be compiled and its global matrices updated before with updateGlobalMatrices, Scene::updateBVH does it)
+void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<RenderCall>& calls)
 {
 	assert(prefab && "PREFAB IS NULL");
-	//assign the model to the root node
-	renderNode(model, &prefab->root, camera);
+
+	//the visible nodes with mesh are already in a list, their global matrix is relative to the prefab (prefabs are shared between entities)
+	const GTR::sFlatNodes& flat = prefab->flat;
+	for (int i = 0; i < flat.mesh_nodes.size(); ++i)
+	{
+		int index = flat.mesh_nodes[i];
+		Matrix44 node_model = flat.global_models[index] * model;
+
+		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
+		BoundingBox world_bounding = transformBoundingBox(node_model, flat.meshes[index]->box);
+
+		//if bounding box is inside the camera frustum then the object is probably visible
+		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+			addRenderCall(node_model, world_bounding, flat.meshes[index], flat.materials[index], camera, calls);
+	}
+}
+
+void Renderer::addRenderCall(const Matrix44& model, const BoundingBox& world_bounding, Mesh* mesh, GTR::Material* material, Camera* camera, std::vector<RenderCall>& calls)
+{
+	RenderCall rc;
+	rc.material = material;
+	rc.model = model;
+	rc.mesh = mesh;
+	rc.distance_to_camera = camera->eye.distance(world_bounding.center);
+	rc.world_bounding = world_bounding;
+	rc.lod = 0;
+	//the size on screen is only known with perspective (the orthographic shadowmaps use the full mesh)
+	if (use_lods && mesh->lods.size() && camera->type == Camera::PERSPECTIVE)
+	{
+		//radius of the bounding sphere in pixels
+		float radius = world_bounding.halfsize.length();
+		float projected_radius = radius / (std::max(rc.distance_to_camera, radius) * tan(camera->fov * 0.5f * DEG2RAD)) * lod_viewport_height * 0.5f;
+		rc.lod = mesh->getLOD(projected_radius, lod_pixel_error);
+	}
+	rc.computeSortKey(camera->far_plane);
+	calls.push_back(rc);
+}
+
+void RenderCall::computeSortKey(float far_plane)
+{
+	//sqrt gives more precision to the objects close to the camera
+	float depth = sqrtf(clamp(distance_to_camera / far_plane, 0.0f, 1.0f));
+	uint64 depth24 = (uint64)(depth * 0xFFFFFF);
+	uint64 two_sided = material->two_sided ? 1 : 0;
+	uint64 material_id = (uint64)material->m_Id & 0xFFFFF;
+
+	sort_key = (uint64)material->alpha_mode << 62;
+	if (material->alpha_mode == eAlphaMode::BLEND)
+		sort_key |= ((0xFFFFFF - depth24) << 38) | (two_sided << 37) | (material_id << 17) | ((uint64)mesh->m_Id & 0x1FFFF);
+	else
+		sort_key |= ((depth24 >> 18) << 56) | (two_sided << 55) | (material_id << 35) | (((uint64)mesh->m_Id & 0xFFFFF) << 15) | ((depth24 >> 3) & 0x7FFF);
+}
+
+void Renderer::sortRenderCalls()
+{
+	int num = (int)render_calls.size();
+	sort_keys.resize(num * 2);
+	sort_indices.resize(num * 2);
+	for (int i = 0; i < num; ++i)
+	{
+		sort_keys[i] = render_calls[i].sort_key;
+		sort_indices[i] = i;
+	}
+
+	//sort only the keys, the calls are moved once at the end
+	radixSort(&sort_keys[0], &sort_indices[0], num, &sort_keys[num], &sort_indices[num]);
+
+	sorted_render_calls.resize(num);
+	for (int i = 0; i < num; ++i)
+		sorted_render_calls[i] = render_calls[sort_indices[i]];
+	render_calls.swap(sorted_render_calls);
+}
+
+int Renderer::cullOccludedCalls(Camera* camera)
+{
+	int num_calls = (int)render_calls.size();
+	occlusion_buffer.begin(camera);
+
+	//the occluders are the first opaque calls big enough on screen, with the LOD that fits the resolution of the buffer
+	int num_occluders = 0;
+	int num_triangles = 0;
+	for (int i = 0; i < num_calls && num_occluders < max_occluders; ++i)
+	{
+		RenderCall& rc = render_calls[i];
+		if (rc.material->alpha_mode != eAlphaMode::NO_ALPHA || !rc.mesh->m_indices.size())
+			continue;
+		OcclusionBuffer::sScreenRect rect;
+		if (!occlusion_buffer.projectBox(rc.world_bounding, rect))
+			continue;
+		float size = std::min(rect.max_x - rect.min_x, rect.max_y - rect.min_y);
+		if (size < occluder_min_size)
+			continue;
+
+		int start = 0;
+		int length = (int)rc.mesh->getNumIndices();
+		if (rc.mesh->lods.size())
+		{
+			sMeshLOD& lod = rc.mesh->lods[rc.mesh->getLOD(size * 0.5f, 1.0f)];
+			start = lod.start;
+			length = lod.length;
+		}
+		if (num_triangles + length / 3 > max_occluder_triangles)
+			continue;
+		num_triangles += length / 3;
+		occlusion_buffer.addOccluder(rc.model, rc.mesh->getPositions(), &rc.mesh->m_indices[start], length, rc.material->two_sided);
+		num_occluders++;
+	}
+	if (!num_occluders)
+		return 0;
+	occlusion_buffer.rasterize();
+
+	calls_occluded.resize(num_calls);
+	TaskManager::background.parallelFor(num_calls, collect_chunk_size, [&](int start, int end, int chunk) {
+		for (int i = start; i < end; ++i)
+			calls_occluded[i] = !occlusion_buffer.testBox(render_calls[i].world_bounding);
+	});
+
+	//keeps the order of the visible ones
+	int num_visible = 0;
+	for (int i = 0; i < num_calls; ++i)
+		if (!calls_occluded[i])
+		{
+			if (num_visible != i)
+				render_calls[num_visible] = render_calls[i];
+			num_visible++;
+		}
+	render_calls.resize(num_visible);
+
+	occlusion_tested_calls += num_calls;
+	occlusion_culled_calls += num_calls - num_visible;
+	return num_calls - num_visible;
+}
+
+void Renderer::buildRenderBatches()
+{
+	render_batches.clear();
+	std::unordered_map<uint64, int> batch_by_key; //mesh id, lod and material id -> index in render_batches
+
+	for (int i = 0; i < render_calls.size(); ++i)
+	{
+		RenderCall& rc = render_calls[i];
+		if (rc.material->alpha_mode == eAlphaMode::BLEND)
+			continue;
+
+		//batches keep the order of their first call, so they are still sorted front to back
+		if (use_instancing)
+		{
+			uint64 key = ((uint64)rc.mesh->m_Id << 36) | ((uint64)rc.lod << 32) | (uint32)rc.material->m_Id;
+			auto it = batch_by_key.find(key);
+			if (it != batch_by_key.end())
+			{
+				render_batches[it->second].calls.push_back(i);
+				continue;
+			}
+			batch_by_key[key] = (int)render_batches.size();
+		}
+
+		RenderBatch batch;
+		batch.mesh = rc.mesh;
+		batch.material = rc.material;
+		batch.lod = rc.lod;
+		batch.calls.push_back(i);
+		render_batches.push_back(batch);
+	}
 }
 
-//renders a node of the prefab and its children
-void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+//the boxes of all the calls are tested at once with SIMD, unless they were collected for this camera
+//(the BVH query tested them already, only the passes with other cameras, like the probes, need it)
+void Renderer::cullRenderCalls(Camera* camera)
 {
-	if (!node->visible)
+	if (memcmp(camera->frustum, calls_frustum, sizeof(calls_frustum)) == 0)
+	{
+		calls_culler.setAllVisible((int)render_calls.size());
 		return;
+	}
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	calls_culler.clear();
+	calls_culler.reserve((int)render_calls.size());
+	for (int i = 0; i < render_calls.size(); ++i)
+		calls_culler.add(render_calls[i].world_bounding.center, render_calls[i].world_bounding.halfsize);
+	calls_culler.cull(camera);
+}
 
-	//does this node have a mesh? then we must render it
-	if (node->mesh && node->material)
+int Renderer::collectBatchInstances(RenderBatch& batch)
+{
+	instance_models.clear();
+	for (int i = 0; i < batch.calls.size(); ++i)
 	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
-		
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) )
+		int call = batch.calls[i];
+		if (calls_culler.isVisible(call))
+			instance_models.push_back(render_calls[call].model);
+	}
+	return (int)instance_models.size();
+}
+
+void Renderer::drawMesh(Mesh* mesh, const Matrix44* models, int num_instances, int lod)
+{
+	//big meshes are usually unique and partially visible, only the visible meshlets are rendered
+	if (use_cluster_culling && num_instances == 1 && lod == 0 && mesh->meshlets.size() > 1 && mesh->indices_vbo_id && Camera::current)
+	{
+		//the cones can be used only if the GPU culls the back faces too
+		int num_visible = mesh->cullMeshlets(models[0], Camera::current, GLState::isEnabled(GL_CULL_FACE), visible_ranges);
+		if (num_visible < (int)mesh->getNumIndices())
 		{
-			//render node mesh
-			RenderCall rc;
-			rc.material = node->material;
-			rc.model = node_model;
-			rc.mesh = node->mesh;
-			rc.distance_to_camera = camera->eye.distance(node->mesh->box.center);
-			rc.world_bounding = world_bounding;
-			render_calls.push_back(rc);
+			mesh->renderRanges(GL_TRIANGLES, visible_ranges);
+			return;
 		}
 	}
 
-	//iterate recursively with children
-	for (int i = 0; i < node->children.size(); ++i)
-		renderNode(prefab_model, node->children[i], camera);
+	if (num_instances > 1)
+		mesh->renderInstanced(GL_TRIANGLES, models, num_instances, lod);
+	else
+		mesh->render(GL_TRIANGLES, -1, 0, lod);
+}
+
+void Renderer::uploadFrameBlock(Camera* camera)
+{
+	sFrameBlock block;
+	block.viewprojection = camera->viewprojection_matrix;
+	block.camera_position = camera->eye;
+	block.time = frame_time;
+	block.ambient_light = GTR::Scene::instance->ambient_light;
+	block.padding = 0;
+
+	//it is called every time a camera is used, most of the times it did not change
+	if (frame_block_uploaded && memcmp(&block, &frame_block, sizeof(sFrameBlock)) == 0)
+		return;
+	frame_block = block;
+	frame_block_uploaded = true;
+	frame_buffer->upload(&frame_block, sizeof(sFrameBlock));
+}
+
+static void fillLightData(GTR::LightEntity* light, Renderer::sLightData& data)
+{
+	data.position = light->model.getTranslation();
+	data.max_dist = light->max_dist;
+	data.color = light->color;
+	data.intensity = light->intensity;
+	data.direction = light->model.frontVector();
+	data.type = (int)light->light_type;
+	data.vector = light->model * Vector3() - light->target;
+	data.cast_shadows = light->shadowmap && light->cast_shadows ? 1 : 0;
+	data.cone.set(light->cone_angle, light->cone_exp, cos(light->cone_angle * DEG2RAD), light->shadow_bias);
+	if (data.cast_shadows)
+	data.shadow_viewproj = light->light_camera->viewprojection_matrix;
 }
 
-void Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::uploadLightsBlock()
+{
+	//the directional lights first, the clustered pass only reads those from the block
+	block_lights.clear();
+	for (int i = 0; i < lights.size(); ++i)
+		if (lights[i]->light_type == DIRECTIONAL)
+			block_lights.push_back(lights[i]);
+	for (int i = 0; i < lights.size(); ++i)
+		if (lights[i]->light_type != DIRECTIONAL)
+			block_lights.push_back(lights[i]);
+
+	lights_block.num_lights = std::min((int)block_lights.size(), max_lights);
+	for (int i = 0; i < lights_block.num_lights; ++i)
+		fillLightData(block_lights[i], lights_block.lights[i]);
+
+	//only the lights in use
+	lights_buffer->upload(&lights_block, offsetof(sLightsBlock, lights) + lights_block.num_lights * sizeof(sLightData));
+}
+
+int Renderer::getLightSlot(int index)
+{
+	if (index < lights_block.num_lights)
+		return index;
+
+	//like the materials, the draws already issued keep the light they used
+	int slot = max_lights;
+	fillLightData(block_lights[index], lights_block.lights[slot]);
+	lights_buffer->upload(&lights_block.lights[slot], sizeof(sLightData), offsetof(sLightsBlock, lights) + slot * sizeof(sLightData));
+	return slot;
+}
+
+static void fillMaterialData(GTR::Material* material, Renderer::sMaterialData& data)
+{
+	data.color = material->color;
+	data.emissive = material->emissive_factor;
+	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	data.alpha_cutoff = material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0;
+	data.roughness = material->roughness_factor;
+	data.metallic = material->metallic_factor;
+	data.padding[0] = data.padding[1] = 0;
+}
+
+void Renderer::uploadMaterialsBlock()
+{
+	//forget the slots of the previous frame
+	for (int i = 0; i < frame_material_ids.size(); ++i)
+		material_slots[frame_material_ids[i]] = -1;
+	frame_material_ids.clear();
+	materials_data.clear();
+	if (material_slots.size() < Material::s_MaterialID)
+		material_slots.resize(Material::s_MaterialID, -1);
+
+	//the last slot is kept as scratch for the materials that do not fit
+	for (int i = 0; i < render_calls.size(); ++i)
+	{
+		Material* material = render_calls[i].material;
+		if (material_slots[material->m_Id] != -1 || materials_data.size() == max_materials - 1)
+			continue;
+		material_slots[material->m_Id] = (int)materials_data.size();
+		frame_material_ids.push_back(material->m_Id);
+		materials_data.resize(materials_data.size() + 1);
+		fillMaterialData(material, materials_data.back());
+	}
+
+	if (materials_data.size())
+		materials_buffer->upload(&materials_data[0], (int)(materials_data.size() * sizeof(sMaterialData)));
+}
+
+int Renderer::getMaterialSlot(Material* material)
+{
+	if (material->m_Id < material_slots.size() && material_slots[material->m_Id] != -1)
+		return material_slots[material->m_Id];
+
+	//GL keeps the data of the draws already issued, so the scratch slot can be reused by every draw
+	int slot = max_materials - 1;
+	sMaterialData data;
+	fillMaterialData(material, data);
+	materials_buffer->upload(&data, sizeof(sMaterialData), slot * sizeof(sMaterialData));
+	return slot;
+}
+
+void Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod)
+{
+	renderMeshWithMaterialToGBuffers(&model, 1, mesh, material, camera, lod);
+}
+
+void Renderer::renderMeshWithMaterialToGBuffers(const Matrix44* models, int num_instances, Mesh* mesh, GTR::Material* material, Camera* camera, int lod)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -869,20 +1392,20 @@ void Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh
 
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
-	shader = Shader::Get("gbuffers");
+	shader = Shader::Get(num_instances > 1 ? "gbuffers_instanced" : "gbuffers");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -891,42 +1414,32 @@ void Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh
 		return;
 	shader->enable();
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
-	float t = getTime();
-	shader->setUniform("u_time", t);
+	//upload uniforms (camera and material properties are in the uniform buffers)
+	if (num_instances == 1)
+		shader->setUniform(UNIFORM("u_model"), models[0]);
+	shader->setUniform(UNIFORM("u_material_index"), getMaterialSlot(material));
 
-	shader->setUniform("u_color", material->color);
 	if (texture)
-		shader->setUniform("u_texture", texture, 0);
-
-	shader->setUniform("u_emissive", material->emissive_factor);
+		shader->setUniform(UNIFORM("u_texture"), texture, 0);
 	if (emissive_texture)
-		shader->setUniform("u_emissive_texture", emissive_texture, 1);
-
-	shader->setUniform("u_roughness", material->roughness_factor);
-	shader->setUniform("u_metallic", material->metallic_factor);
+		shader->setUniform(UNIFORM("u_emissive_texture"), emissive_texture, 1);
 	if (roughness_texture)
-		shader->setUniform("u_roughness_texture", roughness_texture, 2);
-
+		shader->setUniform(UNIFORM("u_roughness_texture"), roughness_texture, 2);
 	if (normalmap_texture)
-		shader->setUniform("u_texture_normals", normalmap_texture, 3);
+		shader->setUniform(UNIFORM("u_texture_normals"), normalmap_texture, 3);
 
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
-
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh, models, num_instances, lod);
 
-	//disable shader
-	shader->disable();
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+}
 
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod)
+{
+	renderFlatMesh(&model, 1, mesh, material, camera, lod);
 }
 
-void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderFlatMesh(const Matrix44* models, int num_instances, Mesh* mesh, GTR::Material* material, Camera* camera, int lod)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -939,13 +1452,13 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
 	//chose a shader
-	shader = Shader::Get("shadowmap");
+	shader = Shader::Get(num_instances > 1 ? "shadowmap_instanced" : "shadowmap");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -954,25 +1467,27 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 		return;
 	shader->enable();
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_model", model);
+	//upload uniforms (the camera is in the frame uniform buffer)
+	if (num_instances == 1)
+		shader->setUniform(UNIFORM("u_model"), models[0]);
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	shader->setUniform(UNIFORM("u_alpha_cutoff"), material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 
-	glDepthFunc(GL_LESS);
-	glDisable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+	GLState::disable(GL_BLEND);
 
 	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
-
-	//disable shader
-	shader->disable();
+	drawMesh(mesh, models, num_instances, lod);
 }
 
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterialandLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshWithMaterialandLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod)
+{
+	renderMeshWithMaterialandLighting(&model, 1, mesh, material, camera, lod);
+}
+
+void Renderer::renderMeshWithMaterialandLighting(const Matrix44* models, int num_instances, Mesh* mesh, GTR::Material* material, Camera* camera, int lod)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material )
@@ -1001,24 +1516,29 @@ void Renderer::renderMeshWithMaterialandLighting(const Matrix44 model, Mesh* mes
 
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 
 	//select if render both sides of the triangles
 	if(material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
     assert(glGetError() == GL_NO_ERROR);
 
-	//Change light_mode
-	if (light_mode == SINGLE)
-		shader = Shader::Get("singlelight");
-	else if (light_mode == MULTI)
-		shader = Shader::Get("multilight");
+	//Change light_mode (the clusters are only built for perspective cameras)
+	eLightMode mode = light_mode;
+	if (mode == CLUSTERED && camera->type != Camera::PERSPECTIVE)
+		mode = SINGLE;
+	if (mode == SINGLE)
+		shader = Shader::Get(num_instances > 1 ? "singlelight_instanced" : "singlelight");
+	else if (mode == MULTI)
+		shader = Shader::Get(num_instances > 1 ? "multilight_instanced" : "multilight");
+	else if (mode == CLUSTERED)
+		shader = Shader::Get(num_instances > 1 ? "clustered_instanced" : "clustered");
  
     assert(glGetError() == GL_NO_ERROR);
 
@@ -1027,162 +1547,199 @@ void Renderer::renderMeshWithMaterialandLighting(const Matrix44 model, Mesh* mes
 		return;
 	shader->enable();
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model );
-	float t = getTime();
-	shader->setUniform("u_time", t );
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_color", material->color);
-	if (texture)
-		shader->setUniform("u_texture", texture, 0);
+	//upload uniforms (camera, lights and material properties are in the uniform buffers)
+	if (num_instances == 1)
+		shader->setUniform(UNIFORM("u_model"), models[0]);
+	shader->setUniform(UNIFORM("u_material_index"), getMaterialSlot(material));
 
-	shader->setUniform("u_emissive", material->emissive_factor);
+	if (texture)
+		shader->setUniform(UNIFORM("u_texture"), texture, 0);
 	if (emissive_texture)
-		shader->setUniform("u_emissive_texture", emissive_texture, 1);
-
-	shader->setUniform("u_roughness", material->roughness_factor);
-	shader->setUniform("u_metallic", material->metallic_factor);
+		shader->setUniform(UNIFORM("u_emissive_texture"), emissive_texture, 1);
 	if (roughness_texture)
-		shader->setUniform("u_roughness_texture", roughness_texture, 2);
-
+		shader->setUniform(UNIFORM("u_roughness_texture"), roughness_texture, 2);
 	if (normalmap_texture)
-		shader->setUniform("u_texture_normals", normalmap_texture, 3);
-
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+		shader->setUniform(UNIFORM("u_texture_normals"), normalmap_texture, 3);
 
 	Texture* reflection = skybox;
 	if (probe && !is_rendering_reflections)
 		reflection = probe->texture;
-	shader->setUniform("u_skybox_texture", reflection, 8);
-
-	if (light_mode == SINGLE)
-		renderSinglePass(shader, mesh);
-	else if (light_mode == MULTI)
-		renderMultiPass(shader, mesh, material);
+	shader->setUniform(UNIFORM("u_skybox_texture"), reflection, 8);
+
+	if (mode == SINGLE)
+		renderSinglePass(shader, mesh, models, num_instances, lod);
+	else if (mode == MULTI)
+		renderMultiPass(shader, mesh, material, models, num_instances, lod);
+	else if (mode == CLUSTERED)
+		renderClusteredPass(shader, mesh, models, num_instances, lod);
 	else
-		mesh->render(GL_TRIANGLES);
-
-	//disable shader
-	shader->disable();
+		drawMesh(mesh, models, num_instances, lod);
 
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
 }
 
 void Renderer::uploadLightToShader(GTR::LightEntity* light, Shader* shader)
 {
-	shader->setUniform("u_light_type", (int)light->light_type);
+	shader->setUniform(UNIFORM("u_light_type"), (int)light->light_type);
 
-	shader->setUniform("u_light_color", light->color); //* light->intensity
-	shader->setUniform("u_light_position", light->model.getTranslation());
-	shader->setUniform("u_light_max_dist", light->max_dist);
+	shader->setUniform(UNIFORM("u_light_color"), light->color); //* light->intensity
+	shader->setUniform(UNIFORM("u_light_position"), light->model.getTranslation());
+	shader->setUniform(UNIFORM("u_light_max_dist"), light->max_dist);
 
-	shader->setUniform("u_light_cone_exp", Vector3(light->cone_angle, light->cone_exp, cos(light->cone_angle * DEG2RAD)));
-	shader->setVector3("u_light_direction", light->model.frontVector());
-	shader->setUniform("u_light_intensity", light->intensity);
+	shader->setUniform(UNIFORM("u_light_cone_exp"), Vector3(light->cone_angle, light->cone_exp, cos(light->cone_angle * DEG2RAD)));
+	shader->setVector3(UNIFORM("u_light_direction"), light->model.frontVector());
+	shader->setUniform(UNIFORM("u_light_intensity"), light->intensity);
 
 	if (light->shadowmap && light->cast_shadows)
 	{
-		shader->setUniform("u_light_cast_shadows", 1);
-		shader->setTexture("u_light_shadowmap", light->shadowmap, 8);
-		shader->setUniform("u_shadow_viewproj", light->light_camera->viewprojection_matrix);
-		shader->setUniform("u_light_shadowbias", light->shadow_bias);
+		shader->setUniform(UNIFORM("u_light_cast_shadows"), 1);
+		shader->setTexture(UNIFORM("u_light_shadowmap"), light->shadowmap, 8);
+		shader->setUniform(UNIFORM("u_shadow_viewproj"), light->light_camera->viewprojection_matrix);
+		shader->setUniform(UNIFORM("u_light_shadowbias"), light->shadow_bias);
 	}
 	else
-		shader->setUniform("u_light_cast_shadows", 0);
+		shader->setUniform(UNIFORM("u_light_cast_shadows"), 0);
 
 	if (light->light_type == DIRECTIONAL) {
 
-		shader->setVector3("u_light_vector", light->model * Vector3() - light->target);
+		shader->setVector3(UNIFORM("u_light_vector"), light->model * Vector3() - light->target);
 	}
 }
 
-void Renderer::renderMultiPass(Shader* shader, Mesh* mesh, Material* material)
+void Renderer::renderMultiPass(Shader* shader, Mesh* mesh, Material* material, const Matrix44* models, int num_instances, int lod)
 {	
-	glDepthFunc(GL_LEQUAL); 
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	GLState::depthFunc(GL_LEQUAL); 
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
-	if (!lights.size())
+	//the lights are in the lights uniform buffer, every pass only selects one
+	int num_lights = (int)block_lights.size();
+	if (!num_lights)
 	{
-		shader->setUniform("u_light_color", Vector3());
-		mesh->render(GL_TRIANGLES);
+		shader->setUniform(UNIFORM("u_light_index"), 0); //out of range, only ambient and emissive
+		drawMesh(mesh, models, num_instances, lod);
 	}
 	else
 	{
-		for (int i = 0; i < lights.size(); ++i)
+		for (int i = 0; i < num_lights; ++i)
 		{
 			if (i == 0)
 			{
 				if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 				{
-					glEnable(GL_BLEND);
-					glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+					GLState::enable(GL_BLEND);
+					GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 				}
 				else
-					glDisable(GL_BLEND);
+					GLState::disable(GL_BLEND);
 			}
 			else
 			{
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-				glEnable(GL_BLEND);
+				GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
+				GLState::enable(GL_BLEND);
 			}
 
-			LightEntity* light = lights[i];
-			uploadLightToShader(light, shader);
-
-			mesh->render(GL_TRIANGLES);
+			LightEntity* light = block_lights[i];
+			shader->setUniform(UNIFORM("u_light_index"), getLightSlot(i));
+			if (light->shadowmap && light->cast_shadows)
+				shader->setUniform(UNIFORM("u_light_shadowmap"), light->shadowmap, 9);
 
-			shader->setUniform("u_ambient_light", Vector3());
-			shader->setUniform("u_emissive", Vector3());
+			drawMesh(mesh, models, num_instances, lod);
 		}
 	}
 }
 
-void Renderer::renderSinglePass(Shader* shader, Mesh* mesh)
+void Renderer::renderSinglePass(Shader* shader, Mesh* mesh, const Matrix44* models, int num_instances, int lod)
 {
-	glDepthFunc(GL_LEQUAL);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	GLState::depthFunc(GL_LEQUAL);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
-	Vector3 light_position[max_lights];
-	Vector3 light_color[max_lights];
-	float light_max_distances[max_lights];
-	int light_type[max_lights];
-	float light_intensity[max_lights];
-	float light_cutoff[max_lights];
-	float light_cone_exp[max_lights];
-	Vector3 light_direction[max_lights];
+	//the shader loops through the lights in the lights uniform buffer
+	drawMesh(mesh, models, num_instances, lod);
+}
 
-	for (int i = 0; i < lights.size(); ++i) {
+//textures read with texelFetch, the integer ones are incomplete without nearest filtering
+static void uploadDataTexture(Texture*& texture, int width, int height, unsigned int format, unsigned int type, unsigned int internal_format, const void* data)
+{
+	if (!texture)
+		texture = new Texture();
+	if (texture->width != width || texture->height != height)
+		texture->create(width, height, format, type, false, (Uint8*)data, internal_format);
+	else
+		texture->upload(format, type, false, (Uint8*)data, internal_format);
+	texture->bind();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	texture->unbind();
+}
 
+void Renderer::buildLightClusters(Camera* camera)
+{
+	light_clusters.begin(camera);
+	clustered_lights_data.clear();
+	for (int i = 0; i < lights.size(); ++i)
+	{
 		LightEntity* light = lights[i];
+		if (light->light_type == DIRECTIONAL)
+			continue;
+		Vector3 position = light->model.getTranslation();
+		Vector3 front = light->model.frontVector().normalize();
+		Vector3 color = light->color * light->intensity;
+		float cos_angle = -2.0f; //points are never outside the cone
+		if (light->light_type == SPOT)
+		{
+			light_clusters.addSpotLight(position, light->max_dist, front, light->cone_angle);
+			cos_angle = cos(light->cone_angle * DEG2RAD);
+		}
+		else
+			light_clusters.addPointLight(position, light->max_dist);
 
-		light_position[i] = light->model * Vector3();
-		light_color[i] = light->color;
-		light_max_distances[i] = light->max_dist;
-		light_type[i] = (int)light->light_type;
-		light_intensity[i] = light->intensity;
-		light_cutoff[i] = cos(light->cone_angle * DEG2RAD);
-		light_cone_exp[i] = light->cone_exp;
-		light_direction[i] = light->model.frontVector();
+		float data[12] = { position.x, position.y, position.z, light->max_dist, color.x, color.y, color.z, light->cone_exp, front.x, front.y, front.z, cos_angle };
+		clustered_lights_data.insert(clustered_lights_data.end(), data, data + 12);
 	}
+	light_clusters.build();
+
+	//the tiles are relative to the viewport
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	clusters_viewport.set((float)viewport[0], (float)viewport[1], (float)viewport[2], (float)viewport[3]);
+
+	//textures can not be empty
+	int num_lights = (int)light_clusters.lights.size();
+	if (!num_lights)
+		clustered_lights_data.resize(12, 0.0f);
+	std::vector<uint32>& indices = light_clusters.indices;
+	int indices_height = std::max(1, ((int)indices.size() + CLUSTER_INDICES_WIDTH - 1) / CLUSTER_INDICES_WIDTH);
+	indices.resize(indices_height * CLUSTER_INDICES_WIDTH, 0);
+
+	uploadDataTexture(clusters_grid_texture, CLUSTERS_PER_SLICE, CLUSTERS_Z, GL_RG_INTEGER, GL_UNSIGNED_INT, GL_RG32UI, &light_clusters.grid[0]);
+	uploadDataTexture(clusters_indices_texture, CLUSTER_INDICES_WIDTH, indices_height, GL_RED_INTEGER, GL_UNSIGNED_INT, GL_R32UI, &indices[0]);
+	uploadDataTexture(clustered_lights_texture, 3, std::max(1, num_lights), GL_RGBA, GL_FLOAT, GL_RGBA32F, &clustered_lights_data[0]);
+}
 
-	shader->setUniform3Array("u_light_position", (float*)&light_position, max_lights);
-	shader->setUniform3Array("u_light_color", (float*)&light_color, max_lights);
-	shader->setUniform1Array("u_light_max_dist", (float*)&light_max_distances, max_lights);
-	shader->setUniform1Array("u_light_type", (int*)&light_type, max_lights);
-	shader->setUniform1Array("u_light_intensity", (float*)&light_intensity, max_lights);
-	shader->setUniform1Array("u_light_cutoff", (float*)&light_cutoff, max_lights);
-	shader->setUniform1Array("u_light_cone_exp", (float*)&light_cone_exp, max_lights);
-	shader->setUniform1("u_num_lights", (int)lights.size());
-	shader->setUniform3Array("u_light_direction", (float*)&light_direction, max_lights);
-
-
-	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
+void Renderer::renderClusteredPass(Shader* shader, Mesh* mesh, const Matrix44* models, int num_instances, int lod)
+{
+	GLState::depthFunc(GL_LEQUAL);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
+
+	shader->setUniform(UNIFORM("u_clusters_grid"), clusters_grid_texture, 10);
+	shader->setUniform(UNIFORM("u_clusters_indices"), clusters_indices_texture, 11);
+	shader->setUniform(UNIFORM("u_clustered_lights"), clustered_lights_texture, 12);
+	shader->setUniform3(UNIFORM("u_clusters_size"), CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z);
+	shader->setUniform(UNIFORM("u_clusters_params"), Vector4(light_clusters.near_plane, light_clusters.far_plane, light_clusters.slice_scale, 0.0f));
+	shader->setUniform(UNIFORM("u_clusters_viewport"), clusters_viewport);
+
+	//the directional lights are in the lights uniform buffer, only the main one has shadows
+	int shadow_light_index = -1;
+	for (int i = 0; i < lights_block.num_lights; ++i)
+		if (block_lights[i] == direct_light && direct_light->light_type == DIRECTIONAL && direct_light->shadowmap && direct_light->cast_shadows)
+			shadow_light_index = i;
+	shader->setUniform(UNIFORM("u_shadow_light_index"), shadow_light_index);
+	if (shadow_light_index != -1)
+		shader->setUniform(UNIFORM("u_light_shadowmap"), direct_light->shadowmap, 9);
+
+	drawMesh(mesh, models, num_instances, lod);
 }
 
 std::vector<Vector3> GTR::generateSpherePoints(int num, float radius, bool hemi)
@@ -1217,19 +1774,18 @@ void GTR::Renderer::renderProbe(Vector3 pos, float size, float* coeffs)
 	Shader* shader = Shader::Get("probe");
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj", false);
 
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
 
 	Matrix44 model;
 	model.setTranslation(pos.x, pos.y, pos.z);
 	model.scale(size, size, size);
 
+	uploadFrameBlock(camera);
 	shader->enable();
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
-	shader->setUniform3Array("u_coeffs", coeffs, 9);
+	shader->setUniform(UNIFORM("u_model"), model);
+	shader->setUniform3Array(UNIFORM("u_coeffs"), coeffs, 9);
 
 	mesh->render(GL_TRIANGLES);
 }
@@ -1248,6 +1804,12 @@ void GTR::Renderer::captureProbe(sProbe& p, GTR::Scene* scene)
 		irr_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT);
 	}
 
+	//the calls of the view were culled for the main camera, every face collects its own from the BVH
+	float view_frustum[6][4];
+	memcpy(view_frustum, calls_frustum, sizeof(view_frustum));
+	render_calls.swap(shadow_render_calls);
+	render_batches.swap(shadow_render_batches);
+
 	for (int i = 0; i < 6; ++i) //for every cubemap face
 	{
 		//compute camera orientation using defined vectors
@@ -1260,6 +1822,10 @@ void GTR::Renderer::captureProbe(sProbe& p, GTR::Scene* scene)
 
 		//render the scene from this point of view
 		irr_fbo->bind();
+		render_calls.clear();
+		collectRenderCalls(scene, &cam, render_calls);
+		sortRenderCalls();
+		buildRenderBatches();
 		renderForward(&cam, scene);
 		irr_fbo->unbind();
 
@@ -1267,6 +1833,10 @@ void GTR::Renderer::captureProbe(sProbe& p, GTR::Scene* scene)
 		images[i].fromTexture(irr_fbo->color_textures[0]);
 	}
 
+	render_calls.swap(shadow_render_calls);
+	render_batches.swap(shadow_render_batches);
+	memcpy(calls_frustum, view_frustum, sizeof(calls_frustum));
+
 	//compute the coefficients given the six images
 	p.sh = computeSH(images);
 }
@@ -1359,22 +1929,21 @@ void GTR::Renderer::renderSkybox(Camera* camera)
 
 	Matrix44 model;
 
-	glDisable(GL_CULL_FACE);
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
 
 	model.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
 	model.scale(5, 5, 5);
 
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
-	shader->setUniform("u_texture", skybox, 0);
+	uploadFrameBlock(camera);
+	shader->setUniform(UNIFORM("u_model"), model);
+	shader->setUniform(UNIFORM("u_texture"), skybox, 0);
 
 	mesh->render(GL_TRIANGLES);
 	shader->disable();
 
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
 }
 
 Texture* GTR::CubemapFromHDRE(const char* filename)
@@ -1429,11 +1998,10 @@ void GTR::Renderer::renderReflectionProbes(Scene* scene, Camera* camera)
 	Shader* shader = Shader::Get("reflection_probe");
 	shader->enable();
 
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
+	uploadFrameBlock(camera);
 
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
 	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
 	for (int i = 0; i < scene->entities.size(); ++i)
@@ -1447,8 +2015,8 @@ void GTR::Renderer::renderReflectionProbes(Scene* scene, Camera* camera)
 
 		Matrix44 model = ent->model;
 		model.scale(10, 10, 10);
-		shader->setUniform("u_model", model);
-		shader->setUniform("u_texture", probe->texture, 0);
+		shader->setUniform(UNIFORM("u_model"), model);
+		shader->setUniform(UNIFORM("u_texture"), probe->texture, 0);
 
 		mesh->render(GL_TRIANGLES);
 	}
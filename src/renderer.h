@@ -7,6 +7,9 @@
 #include "material.h"
 #include "sphericalharmonics.h"
 #include "mesh.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "clustering.h"
 
 //forward declarations
 class Camera;
@@ -23,15 +26,24 @@ namespace GTR {
 		Mesh* mesh;
 		Material* material;
 		BoundingBox world_bounding;
+		int lod; //of the mesh, chosen by its size on screen
 
 		float distance_to_camera;
+		uint64 sort_key; //calls are rendered in the order of this key
+
+		//packs the render state and the depth in the key:
+		//opaque: alpha(2) | coarse depth(6) | two sided(1) | material(20) | mesh(20) | fine depth(15) -> front to back
+		//blend:  alpha(2) | inverted depth(24) | two sided(1) | material(20) | mesh(17) -> back to front
+		void computeSortKey(float far_plane);
 	};
 
-	struct sort_distance {
-		inline bool operator() (const RenderCall& rc1, const RenderCall& rc2)
-		{
-			return (rc1.distance_to_camera > rc2.distance_to_camera);
-		}
+	//render calls that share mesh, LOD and material, they are rendered with one instanced draw
+	class RenderBatch {
+	public:
+		Mesh* mesh;
+		Material* material;
+		int lod;
+		std::vector<int> calls; //indices in render_calls, in the sorted order
 	};
 
 	//struct to store probes
@@ -50,7 +62,8 @@ namespace GTR {
 	public:
 		enum eLightMode {
 			SINGLE,
-			MULTI
+			MULTI,
+			CLUSTERED
 		};
 
 		enum ePipeline{
@@ -60,9 +73,45 @@ namespace GTR {
 		
 		std::vector<GTR::LightEntity*> lights;
 		std::vector<RenderCall> render_calls;
+		std::vector< std::vector<RenderCall> > chunk_render_calls; //one per chunk when collecting in parallel
+		std::vector<RenderCall> sorted_render_calls; //buffers reused every frame to sort the calls
+		std::vector<uint64> sort_keys;
+		std::vector<uint32> sort_indices;
+		std::vector<RenderBatch> render_batches; //opaque calls grouped by mesh and material
+		std::vector<RenderCall> shadow_render_calls; //swapped with the ones of the view while rendering a shadowmap or a probe
+		std::vector<RenderBatch> shadow_render_batches;
+		std::vector<sSceneNode*> visible_nodes; //result of the last query to the BVH of the scene
+		std::vector<Matrix44> instance_models; //models of the visible instances of the batch being rendered
+		BoxCuller calls_culler; //bounding of render_calls, culled against the camera of the current pass
+		float calls_frustum[6][4]; //planes of the camera render_calls were collected for, the BVH query already culled them
+		bool use_instancing;
+		bool use_lods;
+		bool use_cluster_culling; //culls the meshlets of the meshes rendered without instancing
+		std::vector<sIndexRange> visible_ranges; //ranges of indices of the visible meshlets of the mesh being rendered
+		float lod_pixel_error; //max error on screen (in pixels) allowed when choosing the LOD of a mesh
+		float lod_viewport_height; //in pixels, of the target of the calls being collected
+		int collect_chunk_size; //visible nodes per chunk when collecting render calls
+
+		//OCCLUSION CULLING
+		bool use_occlusion_culling;
+		OcclusionBuffer occlusion_buffer;
+		int max_occluders;
+		int max_occluder_triangles;
+		float occluder_min_size; //pixels of the occlusion buffer that the box of an occluder must cover (in both axis)
+		std::vector<char> calls_occluded;
+		int occlusion_tested_calls; //in the last frame (view and shadowmaps)
+		int occlusion_culled_calls;
 
 		eLightMode light_mode;
 		ePipeline pipeline;
+
+		//CLUSTERED LIGHTING (forward+, the point and spot lights are binned per cluster in the CPU)
+		LightClusters light_clusters;
+		std::vector<float> clustered_lights_data; //3 RGBA texels per light
+		Texture* clusters_grid_texture; //offset and count of every cluster (RG32UI)
+		Texture* clusters_indices_texture; //light indices (R32UI), CLUSTER_INDICES_WIDTH per row
+		Texture* clustered_lights_texture; //position and radius, color and cone exponent, direction and cosine of the cone (RGBA32F)
+		Vector4 clusters_viewport; //of the camera of the clusters
 		bool render_shadowmaps;
 
 		//GBUFFERS
@@ -110,6 +159,12 @@ namespace GTR {
 		FBO* decals_fbo;
 		Mesh cube;
 
+		//DEFERRED LIGHT VOLUMES (unit sizes, scaled by the model of every light)
+		Mesh sphere_volume;
+		Mesh cone_volume;
+		int deferred_volume_lights; //of the last frame
+		int deferred_fullscreen_lights;
+
 		//POSTFX
 		Texture* postFX_textureA;
 		Texture* postFX_textureB;
@@ -136,7 +191,57 @@ namespace GTR {
 		float bloom_threshold;
 		float bloom_soft_threshold;
 
-		static const int max_lights = 10;
+		static const int max_lights = 10; //MAX_LIGHTS in the shader atlas, plus one slot used as scratch
+		static const int max_materials = 256; //MAX_MATERIALS in the shader atlas, the last one is used as scratch
+
+		//UNIFORM BUFFERS (the structs follow the std140 layout of the blocks in the shader atlas)
+		struct sFrameBlock {
+			Matrix44 viewprojection;
+			Vector3 camera_position;
+			float time;
+			Vector3 ambient_light;
+			float padding;
+		};
+
+		struct sLightData {
+			Vector3 position;
+			float max_dist;
+			Vector3 color;
+			float intensity;
+			Vector3 direction;
+			int type;
+			Vector3 vector; //for directional lights
+			int cast_shadows;
+			Vector4 cone; //angle, exponent, cosine of the angle, shadow bias
+			Matrix44 shadow_viewproj;
+		};
+
+		struct sLightsBlock {
+			int num_lights;
+			int padding[3];
+			sLightData lights[max_lights + 1];
+		};
+
+		struct sMaterialData {
+			Vector4 color;
+			Vector3 emissive;
+			float alpha_cutoff;
+			float roughness;
+			float metallic;
+			float padding[2];
+		};
+
+		UniformBuffer* frame_buffer;
+		UniformBuffer* lights_buffer;
+		UniformBuffer* materials_buffer;
+		sFrameBlock frame_block; //the last one uploaded, it changes with the camera
+		bool frame_block_uploaded;
+		float frame_time;
+		sLightsBlock lights_block;
+		std::vector<LightEntity*> block_lights; //the lights in the order of the lights block, the ones after num_lights do not fit
+		std::vector<sMaterialData> materials_data;
+		std::vector<int> material_slots; //index in the materials buffer of every material (by Material::m_Id), -1 if it has none
+		std::vector<int> frame_material_ids; //materials with a slot this frame
 		
 		//add here your functions
 		//...
@@ -148,28 +253,70 @@ namespace GTR {
 	
 		//to render a whole prefab (with all its nodes)
 		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
+		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<RenderCall>& calls);
 
-		//to render one node from the prefab and its children
-		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		//adds the call of a node with mesh, choosing its LOD
+		void addRenderCall(const Matrix44& model, const BoundingBox& world_bounding, Mesh* mesh, GTR::Material* material, Camera* camera, std::vector<RenderCall>& calls);
+
+		//collects the calls of the nodes of the scene inside the frustum of the camera, they are found with the BVH of the scene
+		void collectRenderCalls(GTR::Scene* scene, Camera* camera, std::vector<RenderCall>& calls);
+
+		//sorts render_calls by its sort_key
+		void sortRenderCalls();
+
+		//rasterizes the biggest opaque calls in the occlusion buffer and removes the calls hidden behind them
+		//(must be called after sorting, so the occluders are the closest ones), returns how many were removed
+		int cullOccludedCalls(Camera* camera);
+
+		//groups the opaque render calls with the same mesh, LOD and material (must be called after sorting)
+		void buildRenderBatches();
+		//tests the render calls against the frustum of the camera (once per pass)
+		void cullRenderCalls(Camera* camera);
+		//fills instance_models with the calls of the batch visible in the last cullRenderCalls, returns how many
+		int collectBatchInstances(RenderBatch& batch);
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
-		void renderMeshWithMaterialandLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
-		void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod = 0);
+		void renderMeshWithMaterialandLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod = 0);
+		void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod = 0);
+
+		//same but for several instances of the mesh, using instancing when there is more than one
+		void renderMeshWithMaterialToGBuffers(const Matrix44* models, int num_instances, Mesh* mesh, GTR::Material* material, Camera* camera, int lod = 0);
+		void renderMeshWithMaterialandLighting(const Matrix44* models, int num_instances, Mesh* mesh, GTR::Material* material, Camera* camera, int lod = 0);
+		void renderFlatMesh(const Matrix44* models, int num_instances, Mesh* mesh, GTR::Material* material, Camera* camera, int lod = 0);
+
+		//does the draw call of the mesh, instanced if there are several models
+		void drawMesh(Mesh* mesh, const Matrix44* models, int num_instances, int lod = 0);
+
+		//uniform blocks: the frame one when the camera changes, lights and materials once per frame
+		void uploadFrameBlock(Camera* camera);
+		void uploadLightsBlock();
+		void uploadMaterialsBlock();
+		//index of the material in the materials buffer, materials not collected this frame are uploaded on demand
+		int getMaterialSlot(Material* material);
+		//index in the lights buffer of block_lights[index], the ones that do not fit are uploaded on demand
+		int getLightSlot(int index);
 
 		//to render the object once
-		void renderSinglePass(Shader* shader, Mesh* mesh);
+		void renderSinglePass(Shader* shader, Mesh* mesh, const Matrix44* models = NULL, int num_instances = 1, int lod = 0);
 
 		//to render the object several times, once with every light, and accumulate the result using blending
-		void renderMultiPass(Shader* shader, Mesh* mesh, Material* material);
+		void renderMultiPass(Shader* shader, Mesh* mesh, Material* material, const Matrix44* models = NULL, int num_instances = 1, int lod = 0);
+
+		//bins the point and spot lights in the clusters of the camera and uploads them (once per camera)
+		void buildLightClusters(Camera* camera);
+		//to render the object once with the lights of the clusters it touches
+		void renderClusteredPass(Shader* shader, Mesh* mesh, const Matrix44* models = NULL, int num_instances = 1, int lod = 0);
 		
 		//Shadows
 		void uploadLightToShader(GTR::LightEntity* light, Shader* shader);
-		void generateShadowmap(LightEntity* light);
+		void generateShadowmap(LightEntity* light, Scene* scene);
 		void showShadowmap(LightEntity* light);
 
 		void renderForward(Camera* camera, GTR::Scene* scene);
 		void renderDeferred(Camera* camera, GTR::Scene* scene);
+		//the directional lights shade the whole screen, the point and spot lights only the pixels inside their sphere or cone
+		void renderDeferredLights(Camera* camera, GTR::Scene* scene, const Matrix44& inv_vp, int width, int height);
 		void GbuffersShader(Shader* shader, Scene* scene, Camera* camera);
 
 		void renderProbe(Vector3 pos, float size, float* coeffs);
@@ -4,6 +4,9 @@
 #include "prefab.h"
 #include "extra/cJSON.h"
 #include "application.h"
+#include "mesh.h"
+
+#include <cstring>
 
 GTR::Scene* GTR::Scene::instance = NULL;
 
@@ -21,6 +24,7 @@ void GTR::Scene::clear()
 		delete ent;
 	}
 	entities.resize(0);
+	bvh.clear();
 }
 
 
@@ -40,6 +44,125 @@ GTR::BaseEntity* GTR::Scene::getEntityByName(std::string name)
 	return it->second;
 }
 
+//the visible nodes with mesh of the prefab
+static void collectSceneNodes(GTR::PrefabEntity* entity, GTR::sFlatNodes& flat, std::vector<GTR::sSceneNode>& result)
+{
+	result.resize(flat.mesh_nodes.size());
+	for (int i = 0; i < flat.mesh_nodes.size(); ++i)
+	{
+		GTR::sSceneNode& scene_node = result[i];
+		scene_node.entity = entity;
+		scene_node.index = flat.mesh_nodes[i];
+		scene_node.mesh = flat.meshes[scene_node.index];
+		scene_node.material = flat.materials[scene_node.index];
+		scene_node.transform_version = 0;
+		scene_node.leaf = -1;
+	}
+}
+
+void GTR::Scene::updateBVH()
+{
+	for (int i = 0; i < entities.size(); ++i)
+	{
+		if (entities[i]->entity_type != PREFAB)
+			continue;
+		PrefabEntity* ent = (PrefabEntity*)entities[i];
+
+		//only the first entity of a shared prefab does the work
+		if (ent->prefab)
+			ent->prefab->updateGlobalMatrices();
+
+		bool prefab_changed = ent->prefab != ent->bvh_prefab || (ent->prefab && ent->prefab->compile_version != ent->bvh_compile_version);
+		bool model_changed = prefab_changed || memcmp(ent->model.m, ent->bvh_model.m, sizeof(ent->model.m)) != 0;
+		bool nodes_changed = ent->prefab && ent->prefab->transform_version != ent->bvh_transform_version;
+		if (!model_changed && !nodes_changed)
+			continue;
+
+		if (prefab_changed)
+		{
+			for (int j = 0; j < ent->scene_nodes.size(); ++j)
+				bvh.remove(ent->scene_nodes[j].leaf);
+			ent->scene_nodes.clear();
+			if (ent->prefab)
+				collectSceneNodes(ent, ent->prefab->flat, ent->scene_nodes);
+			ent->bvh_prefab = ent->prefab;
+		}
+		ent->bvh_model = ent->model;
+		if (!ent->prefab)
+			continue;
+		ent->bvh_compile_version = ent->prefab->compile_version;
+		ent->bvh_transform_version = ent->prefab->transform_version;
+
+		//the leaves point to the elements of the vector, it does not change size till the prefab changes
+		const sFlatNodes& flat = ent->prefab->flat;
+		for (int j = 0; j < ent->scene_nodes.size(); ++j)
+		{
+			sSceneNode& scene_node = ent->scene_nodes[j];
+			//if only some nodes moved the rest keep their matrix
+			if (!model_changed && scene_node.transform_version == flat.transform_versions[scene_node.index])
+				continue;
+			scene_node.transform_version = flat.transform_versions[scene_node.index];
+			scene_node.model = flat.global_models[scene_node.index] * ent->model;
+			scene_node.world_bounding = transformBoundingBox(scene_node.model, scene_node.mesh->box);
+			if (scene_node.leaf == -1)
+				scene_node.leaf = bvh.insert(scene_node.world_bounding, &scene_node);
+			else
+				bvh.update(scene_node.leaf, scene_node.world_bounding);
+		}
+	}
+}
+
+//the hidden nodes of the prefab are not in the BVH (Node::setVisible compiles the prefab again), only the entity can hide them
+static bool isSceneNodeVisible(const GTR::sSceneNode* scene_node)
+{
+	return scene_node->entity->visible;
+}
+
+void GTR::Scene::queryFrustum(Camera* camera, std::vector<sSceneNode*>& result)
+{
+	std::vector<void*> leaves;
+	bvh.queryFrustum(camera->frustum, leaves);
+
+	//the leaves have fat boxes, the real bounding is tested again (all at once)
+	bvh_culler.clear();
+	bvh_culler.reserve((int)leaves.size());
+	for (int i = 0; i < leaves.size(); ++i)
+	{
+		sSceneNode* scene_node = (sSceneNode*)leaves[i];
+		bvh_culler.add(scene_node->world_bounding.center, scene_node->world_bounding.halfsize);
+	}
+	bvh_culler.cull(camera);
+
+	for (int i = 0; i < leaves.size(); ++i)
+	{
+		sSceneNode* scene_node = (sSceneNode*)leaves[i];
+		if (bvh_culler.isVisible(i) && isSceneNodeVisible(scene_node))
+			result.push_back(scene_node);
+	}
+}
+
+GTR::BaseEntity* GTR::Scene::testRayCollision(const Vector3& origin, const Vector3& direction, Vector3& collision, float max_dist)
+{
+	std::vector<void*> leaves;
+	bvh.queryRay(origin, direction, max_dist, leaves);
+
+	BaseEntity* closest = NULL;
+	for (int i = 0; i < leaves.size(); ++i)
+	{
+		sSceneNode* scene_node = (sSceneNode*)leaves[i];
+		if (!isSceneNodeVisible(scene_node))
+			continue;
+		Vector3 point, normal;
+		if (!scene_node->mesh->testRayCollision(scene_node->model, origin, direction, point, normal, max_dist))
+			continue;
+		//the next ones must be closer
+		max_dist = origin.distance(point);
+		collision = point;
+		closest = scene_node->entity;
+	}
+	return closest;
+}
+
 bool GTR::Scene::load(const char* filename)
 {
 	std::string content;
@@ -160,6 +283,9 @@ GTR::PrefabEntity::PrefabEntity()
 {
 	entity_type = PREFAB;
 	prefab = NULL;
+	bvh_prefab = NULL;
+	bvh_compile_version = 0;
+	bvh_transform_version = 0;
 }
 
 void GTR::PrefabEntity::configure(cJSON* json)
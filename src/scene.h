@@ -5,6 +5,8 @@
 #include "camera.h"
 #include "fbo.h"
 #include "texture.h"
+#include "bvh.h"
+#include "culling.h"
 #include <string>
 #include <map>
 
@@ -12,6 +14,7 @@
 class cJSON; 
 class FBO;
 class Texture;
+class Mesh;
 
 //our namespace
 namespace GTR {
@@ -33,6 +36,21 @@ namespace GTR {
 
 	class Scene;
 	class Prefab;
+	class Node;
+	class PrefabEntity;
+	class Material;
+
+	//a node with mesh of a prefab entity, it is a leaf of the BVH of the scene
+	struct sSceneNode {
+		PrefabEntity* entity;
+		int index; //in the flat nodes of the prefab
+		Mesh* mesh;
+		Material* material;
+		Matrix44 model; //in world space
+		unsigned int transform_version; //of the flat node when model was computed
+		BoundingBox world_bounding;
+		int leaf; //in the BVH of the scene
+	};
 
 	//represents one element of the scene (could be lights, prefabs, cameras, etc)
 	class BaseEntity
@@ -55,6 +73,13 @@ namespace GTR {
 	public:
 		std::string filename;
 		Prefab* prefab;
+
+		//nodes with mesh in the BVH, updated by Scene::updateBVH when the model, the prefab or its nodes change
+		std::vector<sSceneNode> scene_nodes;
+		Matrix44 bvh_model;
+		Prefab* bvh_prefab;
+		unsigned int bvh_compile_version; //of the prefab
+		unsigned int bvh_transform_version;
 		
 		PrefabEntity();
 		virtual void renderInMenu();
@@ -97,11 +122,20 @@ namespace GTR {
 		std::string filename;
 		std::vector<BaseEntity*> entities;
 		std::map<std::string,BaseEntity*> entities_by_name;
+		BVH bvh; //nodes of the prefabs in world space
+		BoxCuller bvh_culler; //real bounding of the leaves found in the BVH
 
 		void clear();
 		void addEntity(BaseEntity* entity);
 		BaseEntity* getEntityByName(std::string name);
 
+		//refits the leaves of the prefab entities that moved (only reinserted if they leave their fat box)
+		void updateBVH();
+		//visible nodes whose bounding is inside the frustum of the camera
+		void queryFrustum(Camera* camera, std::vector<sSceneNode*>& result);
+		//closest visible prefab entity hit by the ray, NULL if none
+		BaseEntity* testRayCollision(const Vector3& origin, const Vector3& direction, Vector3& collision, float max_dist = 3.4e+38F);
+
 		bool load(const char* filename);
 		BaseEntity* createEntity(std::string type);
 	};
@@ -1,5 +1,6 @@
 #include "shader.h"
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include "utils.h"
 #include <algorithm> 
@@ -8,9 +9,17 @@
 #include <locale>
 
 #include "texture.h"
+#include "glstate.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
+std::string Shader::s_program_cache_filename;
+std::map<std::string, Shader::ProgramBinary> Shader::s_program_cache;
+bool Shader::s_program_cache_dirty = false;
+
+#ifdef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+	#define USE_PROGRAM_BINARY
+#endif
 
 
 //typedef unsigned int GLhandle;
@@ -32,6 +41,7 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 	REGISTER_GLEXT( void, glActiveTexture, GLenum texture )
 	REGISTER_GLEXT( void, glGetInfoLog, GLhandle obj, GLsizei maxLength, GLsizei *length, GLchar *infoLog )
 	REGISTER_GLEXT( GLint, glGetUniformLocation, GLhandle programObj, const GLchar *name)
+	REGISTER_GLEXT( void, glGetActiveUniform, GLhandle programObj, GLuint index, GLsizei maxLength, GLsizei *length, GLint *size, GLenum *type, GLchar *name)
 	REGISTER_GLEXT( GLint, glGetAttribLocation, GLhandle programObj, const GLchar *name)
 	REGISTER_GLEXT( void, glUniform1i, GLint location, GLint v0 )
 	REGISTER_GLEXT( void, glUniform2i, GLint location, GLint v0, GLint v1 )
@@ -56,12 +66,15 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+std::map<uint32, std::string> Shader::s_uniform_names;
+const char* Shader::s_uniform_block_names[NUM_UNIFORM_BLOCKS] = { "FrameBlock", "LightsBlock", "MaterialsBlock" };
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
 	vs = fs = 0;
+	uniform_mask = 0;
 	compiled = false;
 	from_atlas = false;
 }
@@ -85,6 +98,7 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 	vs_filename = vsf;
 	ps_filename = psf;
 	from_atlas = false;
+	cache_name = vsf + "," + psf + (macros ? macros : "");
 
 	bool printMacros = false;
 
@@ -129,6 +143,7 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 	if (!sh->load( vsf,psf, macros ))
 		return NULL;
 	s_Shaders[name] = sh;
+	SaveProgramCache();
 	return sh;
 }
 
@@ -169,6 +184,9 @@ bool Shader::LoadAtlas(const char* filename)
 		return false;
 	}
 
+	if (s_program_cache_filename.empty())
+		LoadProgramCache((std::string(filename) + ".cache").c_str());
+
 	//separate subfiles
 	s_shader_atlas_filename = filename;
 	std::vector<std::string> lines = tokenize(content, "\n");
@@ -252,8 +270,10 @@ bool Shader::LoadAtlas(const char* filename)
 		else
 			shader = it->second;
 	
+		shader->cache_name = name;
 		if (!shader->compileFromMemory(vs_code,fs_code))
 		{
+			s_Shaders.erase(name); //Get must not return the deleted shader
 			delete shader;
 			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
             return false; //stop here
@@ -266,6 +286,7 @@ bool Shader::LoadAtlas(const char* filename)
 		std::cout << " + Shader from atlas: " << name << std::endl;
 	}
 
+	SaveProgramCache();
 	return true;
 }
 
@@ -306,6 +327,23 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
 
+	//try first with the binary of a previous run
+	uint64 key = 0;
+	if (cache_name.size() && isProgramCacheSupported())
+	{
+		key = computeProgramKey(vsm, psm);
+		if (loadProgramBinary(key))
+		{
+			buildUniformTable();
+			bindUniformBlocks();
+			compiled = true;
+			return true;
+		}
+#ifdef USE_PROGRAM_BINARY
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+	}
+
 	if (!createVertexShaderObject(vsm))
 	{
 		printf("Vertex shader compilation failed\n");
@@ -337,6 +375,11 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	validate();
 #endif
 
+	if (key)
+		storeProgramBinary(key);
+
+	buildUniformTable();
+	bindUniformBlocks();
 	compiled = true;
 
 	return true;
@@ -427,12 +470,14 @@ void Shader::release()
 
 	if (program)
 	{
+		GLState::onProgramDeleted(program);
 		glDeleteProgram(program);
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
 	}
 
-	locations.clear();
+	uniform_table.clear();
+	uniform_mask = 0;
 
 	compiled = false;
 }
@@ -440,12 +485,10 @@ void Shader::release()
 
 void Shader::enable()
 {
-	if (current == this)
-		return;
-
 	current = this;
 
-	glUseProgram(program);
+	//GLState skips it if it is already in use
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -457,14 +500,15 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	current = NULL;
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -511,32 +555,107 @@ void Shader::saveProgramInfoLog(GLuint obj)
 	}
 }
 
-GLint Shader::getLocation(const char* varname,loctable* table)
+void Shader::buildUniformTable()
 {
-	if(varname == 0 || table == 0)
-		return 0;
-
-	GLint loc = 0;
-	loctable* locs = table;
-
-	loctable::iterator cur = locs->find(varname);
-	
-	if(cur == locs->end()) //not found in the locations table
+	GLint num_uniforms = 0;
+	GLint max_length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &num_uniforms);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+	//arrays add one entry per element, leave room for them and keep half the table empty so probes are short
+	std::vector<std::pair<std::string, GLint>> uniforms;
+	std::vector<char> buffer(max_length + 1);
+	for (int i = 0; i < num_uniforms; ++i)
 	{
-		loc = glGetUniformLocation(program, varname);
-		if (loc == -1)
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, i, (GLsizei)buffer.size(), &length, &size, &type, &buffer[0]);
+		std::string name(&buffer[0], length);
+		GLint location = glGetUniformLocation(program, name.c_str());
+		if (location == -1) //built-in vars or uniforms inside blocks
+			continue;
+
+		//arrays are reported as "name[0]", we want to find them by "name" and by every element
+		size_t pos = name.find("[0]");
+		if (pos != std::string::npos && pos + 3 == name.size())
 		{
-			return -1;
+			std::string base = name.substr(0, pos);
+			uniforms.push_back(std::make_pair(base, location));
+			for (int j = 0; j < size; ++j)
+			{
+				std::string element = base + "[" + std::to_string(j) + "]";
+				uniforms.push_back(std::make_pair(element, j == 0 ? location : glGetUniformLocation(program, element.c_str())));
+			}
 		}
+		else
+			uniforms.push_back(std::make_pair(name, location));
+	}
+	assert(glGetError() == GL_NO_ERROR);
 
-		//insert the new value
-		locs->insert(loctable::value_type(varname,loc));
+	uint32 table_size = 8;
+	while (table_size < uniforms.size() * 2)
+		table_size *= 2;
+	UniformSlot empty = { 0, -1, NULL };
+	uniform_table.assign(table_size, empty);
+	uniform_mask = table_size - 1;
+
+	for (size_t i = 0; i < uniforms.size(); ++i)
+		addUniform(uniforms[i].first, uniforms[i].second);
+}
+
+void Shader::addUniform(const std::string& name, GLint location)
+{
+	if (location == -1)
+		return;
+	uint32 hash = hashString(name.c_str());
+
+	//names are interned the first time we see them, two names with the same hash would be mixed
+	auto it = s_uniform_names.find(hash);
+	if (it == s_uniform_names.end())
+		it = s_uniform_names.insert(std::make_pair(hash, name)).first;
+	else if (it->second != name)
+	{
+		std::cout << "Shader error: uniforms " << it->second << " and " << name << " have the same hash" << std::endl;
+		assert(0);
 	}
-	else //found in the table
+
+	uint32 index = hash & uniform_mask;
+	while (uniform_table[index].location != -1)
+		index = (index + 1) & uniform_mask;
+	uniform_table[index].hash = hash;
+	uniform_table[index].location = location;
+	uniform_table[index].name = it->second.c_str();
+}
+
+void Shader::bindUniformBlocks()
+{
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
 	{
-		loc = (*cur).second;
+		GLuint index = glGetUniformBlockIndex(program, s_uniform_block_names[i]);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, i);
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+GLint Shader::getLocation(const UniformName& varname)
+{
+	if (!uniform_table.size())
+		return -1;
+
+	//the table is never full, we stop at the first empty slot
+	uint32 index = varname.hash & uniform_mask;
+	while (true)
+	{
+		const UniformSlot& slot = uniform_table[index];
+		if (slot.location == -1)
+			return -1;
+		//a name that is not in any shader could have the same hash than one that is
+		if (slot.hash == varname.hash && strcmp(slot.name, varname.name) == 0)
+			return slot.location;
+		index = (index + 1) & uniform_mask;
 	}
-	return loc;
 }
 
 int Shader::getAttribLocation(const char* varname)
@@ -553,7 +672,7 @@ int Shader::getAttribLocation(const char* varname)
 
 int Shader::getUniformLocation(const char* varname)
 {
-	int loc = getLocation(varname, &locations);
+	int loc = getLocation(varname);
 	if (loc == -1)
 	{
 		return loc;
@@ -562,16 +681,16 @@ int Shader::getUniformLocation(const char* varname)
 	return loc;
 }
 
-void Shader::setTexture(const char* varname, Texture* tex, int slot)
+void Shader::setTexture(const UniformName& varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	if (tex->loading)
+		tex->requested = true; //visible, upload it first
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 /*
-void Shader::setTexture(const char* varname, unsigned int tex)
+void Shader::setTexture(const UniformName& varname, unsigned int tex)
 {
 	glActiveTexture(GL_TEXTURE0 + last_slot);
 	glBindTexture(GL_TEXTURE_2D,tex);
@@ -581,166 +700,343 @@ void Shader::setTexture(const char* varname, unsigned int tex)
 }
 */
 
-void Shader::setUniform1(const char* varname, bool input1)
+void Shader::setUniform1(const UniformName& varname, bool input1)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc, varname);
 	glUniform1i(loc, input1);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1(const char* varname, int input1)
+void Shader::setUniform1(const UniformName& varname, int input1)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform1i(loc, input1);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2(const char* varname, int input1, int input2)
+void Shader::setUniform2(const UniformName& varname, int input1, int input2)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2i(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3(const char* varname, int input1, int input2, int input3)
+void Shader::setUniform3(const UniformName& varname, int input1, int input2, int input3)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3i(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4)
+void Shader::setUniform4(const UniformName& varname, const int input1, const int input2, const int input3, const int input4)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4i(loc, input1, input2, input3, input4);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1Array(const char* varname, const int* input, const int count)
+void Shader::setUniform1Array(const UniformName& varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform1iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2Array(const char* varname, const int* input, const int count)
+void Shader::setUniform2Array(const UniformName& varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3Array(const char* varname, const int* input, const int count)
+void Shader::setUniform3Array(const UniformName& varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4Array(const char* varname, const int* input, const int count)
+void Shader::setUniform4Array(const UniformName& varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1(const char* varname, const float input1)
+void Shader::setUniform1(const UniformName& varname, const float input1)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform1f(loc, input1);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2(const char* varname, const float input1, const float input2)
+void Shader::setUniform2(const UniformName& varname, const float input1, const float input2)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2f(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3(const char* varname, const float input1, const float input2, const float input3)
+void Shader::setUniform3(const UniformName& varname, const float input1, const float input2, const float input3)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3f(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4)
+void Shader::setUniform4(const UniformName& varname, const float input1, const float input2, const float input3, const float input4)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4f(loc, input1, input2, input3, input4);
 	checkGLErrors();
 }
 
-void Shader::setUniform1Array(const char* varname, const float* input, const int count)
+void Shader::setUniform1Array(const UniformName& varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform1fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2Array(const char* varname, const float* input, const int count)
+void Shader::setUniform2Array(const UniformName& varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3Array(const char* varname, const float* input, const int count)
+void Shader::setUniform3Array(const UniformName& varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4Array(const char* varname, const float* input, const int count)
+void Shader::setUniform4Array(const UniformName& varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44(const char* varname, const float* m)
+void Shader::setMatrix44(const UniformName& varname, const float* m)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44( const char* varname, const Matrix44 &m )
+void Shader::setMatrix44( const UniformName& varname, const Matrix44 &m )
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m.m);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
+void Shader::setMatrix44Array( const UniformName& varname, Matrix44* m_array, int num )
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc, varname);
 	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
+// Program cache *****************************
+
+bool Shader::isProgramCacheSupported()
+{
+#ifdef USE_PROGRAM_BINARY
+	static int num_formats = -1;
+	if (num_formats == -1)
+	{
+	#ifdef USE_GLEW
+		if (!glProgramBinary || !glGetProgramBinary || !glProgramParameteri)
+			num_formats = 0;
+		else
+	#endif
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		if (!num_formats)
+			std::cout << " - Driver does not support program binaries, shaders will be compiled always" << std::endl;
+	}
+	return num_formats > 0;
+#else
+	return false;
+#endif
+}
+
+//FNV-1a 64 bits
+static uint64 hashBytes(const char* data, size_t size, uint64 hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ (uint8)data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+uint64 Shader::computeProgramKey(const std::string& vsm, const std::string& psm)
+{
+	//the binaries only work with the same driver that created them
+	static uint64 driver_hash = 0;
+	if (!driver_hash)
+	{
+		std::string driver;
+		const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (int i = 0; i < 3; ++i)
+		{
+			const char* str = (const char*)glGetString(names[i]);
+			driver += std::string(str ? str : "") + "\n";
+		}
+		driver_hash = hashBytes(driver.c_str(), driver.size());
+	}
+
+	uint64 key = hashBytes(vsm.c_str(), vsm.size() + 1, driver_hash); //+1 to include the \0 as separator
+	key = hashBytes(psm.c_str(), psm.size(), key);
+	return key ? key : 1; //0 means no key
+}
+
+bool Shader::loadProgramBinary(uint64 key)
+{
+#ifdef USE_PROGRAM_BINARY
+	auto it = s_program_cache.find(cache_name);
+	if (it == s_program_cache.end())
+		return false;
+	ProgramBinary& binary = it->second;
+	if (binary.key != key) //source or driver changed
+		return false;
+
+	glProgramBinary(program, binary.format, &binary.data[0], (GLsizei)binary.data.size());
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	while (glGetError() != GL_NO_ERROR); //a rejected binary can leave errors, we do not care
+	if (linked)
+		return true;
+
+	//the driver rejected it (p.e. it was updated but reports the same version), forget it and compile from source
+	std::cout << " - Program binary rejected, compiling from source: " << cache_name << std::endl;
+	s_program_cache.erase(it);
+	s_program_cache_dirty = true;
+#endif
+	return false;
+}
+
+void Shader::storeProgramBinary(uint64 key)
+{
+#ifdef USE_PROGRAM_BINARY
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return;
+
+	ProgramBinary& binary = s_program_cache[cache_name];
+	binary.key = key;
+	binary.data.resize(size);
+	GLsizei length = 0;
+	glGetProgramBinary(program, size, &length, &binary.format, &binary.data[0]);
+	if (glGetError() != GL_NO_ERROR || length <= 0)
+	{
+		s_program_cache.erase(cache_name);
+		return;
+	}
+	binary.data.resize(length);
+	s_program_cache_dirty = true;
+#endif
+}
+
+//file format: "PCH1", num entries and for every entry: name length, name, key, format, size and the binary
+void Shader::LoadProgramCache(const char* filename)
+{
+	s_program_cache_filename = filename;
+	s_program_cache.clear();
+	s_program_cache_dirty = false;
+
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return;
+
+	char magic[4];
+	int num_entries = 0;
+	bool valid = fread(magic, 4, 1, f) == 1 && memcmp(magic, "PCH1", 4) == 0 && fread(&num_entries, sizeof(int), 1, f) == 1;
+	for (int i = 0; valid && i < num_entries; ++i)
+	{
+		int name_length = 0;
+		int size = 0;
+		ProgramBinary binary;
+		valid = fread(&name_length, sizeof(int), 1, f) == 1 && name_length > 0 && name_length < 4096;
+		if (!valid)
+			break;
+		std::string name(name_length, ' ');
+		valid = fread(&name[0], name_length, 1, f) == 1 &&
+			fread(&binary.key, sizeof(uint64), 1, f) == 1 &&
+			fread(&binary.format, sizeof(GLenum), 1, f) == 1 &&
+			fread(&size, sizeof(int), 1, f) == 1 && size > 0;
+		if (!valid)
+			break;
+		binary.data.resize(size);
+		valid = fread(&binary.data[0], size, 1, f) == 1;
+		if (valid)
+			s_program_cache[name] = binary;
+	}
+	fclose(f);
+
+	if (!valid) //truncated or old version, it will be rebuilt
+	{
+		std::cout << " - Program cache corrupted, ignoring it: " << filename << std::endl;
+		s_program_cache.clear();
+		s_program_cache_dirty = true;
+		return;
+	}
+	std::cout << " + Program cache: " << s_program_cache.size() << " binaries" << std::endl;
+}
+
+void Shader::SaveProgramCache()
+{
+	if (!s_program_cache_dirty || s_program_cache_filename.empty())
+		return;
+
+	FILE* f = fopen(s_program_cache_filename.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << " - Cannot write program cache: " << s_program_cache_filename << std::endl;
+		return;
+	}
+
+	fwrite("PCH1", 4, 1, f);
+	int num_entries = (int)s_program_cache.size();
+	fwrite(&num_entries, sizeof(int), 1, f);
+	for (auto& it : s_program_cache)
+	{
+		const ProgramBinary& binary = it.second;
+		int name_length = (int)it.first.size();
+		int size = (int)binary.data.size();
+		fwrite(&name_length, sizeof(int), 1, f);
+		fwrite(it.first.c_str(), name_length, 1, f);
+		fwrite(&binary.key, sizeof(uint64), 1, f);
+		fwrite(&binary.format, sizeof(GLenum), 1, f);
+		fwrite(&size, sizeof(int), 1, f);
+		fwrite(&binary.data[0], size, 1, f);
+	}
+	fclose(f);
+	s_program_cache_dirty = false;
+}
+
 void Shader::init()
 {
 	static bool firsttime = true;
@@ -762,6 +1058,7 @@ void Shader::init()
 		//IMPORT_GLEXT( glActiveTexture );
 		IMPORT_GLEXT( glGetInfoLog );
 		IMPORT_GLEXT( glGetUniformLocation );
+		IMPORT_GLEXT( glGetActiveUniform );
 		IMPORT_GLEXT( glGetAttribLocation );
 		IMPORT_GLEXT( glUniform1i );
 		IMPORT_GLEXT( glUniform2i );
@@ -945,9 +1242,34 @@ Shader* Shader::getDefaultShader(std::string name)
 	}
 
 	sh->enable();
-	sh->setUniform4("u_color", Vector4(1, 1, 1, 1));
+	sh->setUniform4(UNIFORM("u_color"), Vector4(1, 1, 1, 1));
 	sh->disable();
 
 	s_Shaders[name] = sh;
 	return sh;
 }
+
+UniformBuffer::UniformBuffer(eUniformBlock block, int size)
+{
+	this->block = block;
+	this->size = size;
+	glGenBuffers(1, &buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, block, buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+UniformBuffer::~UniformBuffer()
+{
+	glDeleteBuffers(1, &buffer_id);
+}
+
+void UniformBuffer::upload(const void* data, int size, int offset)
+{
+	assert(offset + size <= this->size && "uniform buffer overflow");
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
@@ -8,18 +8,45 @@
 #include "includes.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <type_traits>
 #include "framework.h"
 #include <cassert>
 
 #ifdef _DEBUG
 	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
-	//#define CHECK_SHADER_VAR(a,b) if (a == -1) { std::cout << "Shader error: Var not found in shader: " << b << std::endl; return; } 
+	//#define CHECK_SHADER_VAR(a,b) if (a == -1) { std::cout << "Shader error: Var not found in shader: " << b.name << std::endl; return; } 
 #else
 	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
 #endif
 
 class Texture;
 
+//uniform blocks shared by the shaders, the value is the binding point (names in Shader::s_uniform_block_names)
+enum eUniformBlock {
+	FRAME_BLOCK,
+	LIGHTS_BLOCK,
+	MATERIALS_BLOCK,
+	NUM_UNIFORM_BLOCKS
+};
+
+//FNV-1a hash, constexpr so the hash of the uniform names written as literals is computed when compiling
+constexpr uint32 hashString(const char* str, uint32 hash = 2166136261u)
+{
+	return *str ? hashString(str + 1, (hash ^ (uint8)*str) * 16777619u) : hash;
+}
+
+//the name of a uniform and its hash, it is built implicitly when passing a string to setUniform (hashed when called)
+struct UniformName {
+	const char* name;
+	uint32 hash;
+	UniformName(const char* name) : name(name), hash(hashString(name)) {}
+	constexpr UniformName(const char* name, uint32 hash) : name(name), hash(hash) {}
+};
+
+//for names written as literals, the hash is a template argument so it is always computed when compiling
+#define UNIFORM(name) UniformName(name, std::integral_constant<uint32, hashString(name)>::value)
+
 class Shader
 {
 	int last_slot;
@@ -52,52 +79,52 @@ public:
 	virtual bool IsAttribute(const char* varname) { return (getAttribLocation(varname) != -1); } //attribute exist
 
 	//upload
-	void setUniform(const char* varname, bool input) { assert(current == this); setUniform1(varname, input); }
-	void setUniform(const char* varname, int input) { assert(current == this); setUniform1(varname, input); }
-	void setUniform(const char* varname, float input) { assert(current == this); setUniform1(varname, input); }
-	void setUniform(const char* varname, const Vector2& input) { assert(current == this); setUniform2(varname, input.x, input.y ); }
-	void setUniform(const char* varname, const Vector3& input) { assert(current == this); setUniform3(varname, input.x, input.y, input.z); }
-	void setUniform(const char* varname, const Vector4& input) { assert(current == this); setUniform4(varname, input.x, input.y, input.z, input.w); }
-	void setUniform(const char* varname, const Matrix44& input) { assert(current == this); setMatrix44(varname, input); }
-	void setUniform(const char* varname, std::vector<Matrix44>& m_vector) { assert(current == this && m_vector.size()); setMatrix44Array(varname, &m_vector[0], m_vector.size()); }
+	void setUniform(const UniformName& varname, bool input) { assert(current == this); setUniform1(varname, input); }
+	void setUniform(const UniformName& varname, int input) { assert(current == this); setUniform1(varname, input); }
+	void setUniform(const UniformName& varname, float input) { assert(current == this); setUniform1(varname, input); }
+	void setUniform(const UniformName& varname, const Vector2& input) { assert(current == this); setUniform2(varname, input.x, input.y ); }
+	void setUniform(const UniformName& varname, const Vector3& input) { assert(current == this); setUniform3(varname, input.x, input.y, input.z); }
+	void setUniform(const UniformName& varname, const Vector4& input) { assert(current == this); setUniform4(varname, input.x, input.y, input.z, input.w); }
+	void setUniform(const UniformName& varname, const Matrix44& input) { assert(current == this); setMatrix44(varname, input); }
+	void setUniform(const UniformName& varname, std::vector<Matrix44>& m_vector) { assert(current == this && m_vector.size()); setMatrix44Array(varname, &m_vector[0], m_vector.size()); }
 	
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
-	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
+	void setUniform(const UniformName& varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
 
-	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
-	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
-	virtual void setVector3(const char* varname, const Vector3& input) { setUniform3(varname, input.x, input.y, input.z); }
-	virtual void setMatrix44(const char* varname, const float* m);
-	virtual void setMatrix44(const char* varname, const Matrix44 &m);
-	virtual void setMatrix44Array(const char* varname, Matrix44* m_array, int num);
+	virtual void setInt(const UniformName& varname, const int& input) { setUniform1(varname, input); }
+	virtual void setFloat(const UniformName& varname, const float& input) { setUniform1(varname, input); }
+	virtual void setVector3(const UniformName& varname, const Vector3& input) { setUniform3(varname, input.x, input.y, input.z); }
+	virtual void setMatrix44(const UniformName& varname, const float* m);
+	virtual void setMatrix44(const UniformName& varname, const Matrix44 &m);
+	virtual void setMatrix44Array(const UniformName& varname, Matrix44* m_array, int num);
 
-	virtual void setUniform1Array(const char* varname, const float* input, const int count) ;
-	virtual void setUniform2Array(const char* varname, const float* input, const int count) ;
-	virtual void setUniform3Array(const char* varname, const float* input, const int count) ;
-	virtual void setUniform4Array(const char* varname, const float* input, const int count) ;
+	virtual void setUniform1Array(const UniformName& varname, const float* input, const int count) ;
+	virtual void setUniform2Array(const UniformName& varname, const float* input, const int count) ;
+	virtual void setUniform3Array(const UniformName& varname, const float* input, const int count) ;
+	virtual void setUniform4Array(const UniformName& varname, const float* input, const int count) ;
 
-	virtual void setUniform1Array(const char* varname, const int* input, const int count) ;
-	virtual void setUniform2Array(const char* varname, const int* input, const int count) ;
-	virtual void setUniform3Array(const char* varname, const int* input, const int count) ;
-	virtual void setUniform4Array(const char* varname, const int* input, const int count) ;
+	virtual void setUniform1Array(const UniformName& varname, const int* input, const int count) ;
+	virtual void setUniform2Array(const UniformName& varname, const int* input, const int count) ;
+	virtual void setUniform3Array(const UniformName& varname, const int* input, const int count) ;
+	virtual void setUniform4Array(const UniformName& varname, const int* input, const int count) ;
 
-	virtual void setUniform1(const char* varname, const bool input1);
+	virtual void setUniform1(const UniformName& varname, const bool input1);
 
-	virtual void setUniform1(const char* varname, const int input1) ;
-	virtual void setUniform2(const char* varname, const int input1, const int input2) ;
-	virtual void setUniform3(const char* varname, const int input1, const int input2, const int input3) ;
-	virtual void setUniform3(const char* varname, const Vector3& input) { setUniform3(varname, input.x, input.y, input.z); }
-	virtual void setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4) ;
+	virtual void setUniform1(const UniformName& varname, const int input1) ;
+	virtual void setUniform2(const UniformName& varname, const int input1, const int input2) ;
+	virtual void setUniform3(const UniformName& varname, const int input1, const int input2, const int input3) ;
+	virtual void setUniform3(const UniformName& varname, const Vector3& input) { setUniform3(varname, input.x, input.y, input.z); }
+	virtual void setUniform4(const UniformName& varname, const int input1, const int input2, const int input3, const int input4) ;
 
-	virtual void setUniform1(const char* varname, const float input) ;
-	virtual void setUniform2(const char* varname, const float input1, const float input2) ;
-	virtual void setUniform3(const char* varname, const float input1, const float input2, const float input3) ;
-	virtual void setUniform4(const char* varname, const Vector4& input) { setUniform4(varname, input.x, input.y, input.z, input.w); }
-	virtual void setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4) ;
+	virtual void setUniform1(const UniformName& varname, const float input) ;
+	virtual void setUniform2(const UniformName& varname, const float input1, const float input2) ;
+	virtual void setUniform3(const UniformName& varname, const float input1, const float input2, const float input3) ;
+	virtual void setUniform4(const UniformName& varname, const Vector4& input) { setUniform4(varname, input.x, input.y, input.z, input.w); }
+	virtual void setUniform4(const UniformName& varname, const float input1, const float input2, const float input3, const float input4) ;
 
-	//virtual void setTexture(const char* varname, const unsigned int tex) ;
-	virtual void setTexture(const char* varname, Texture* texture, int slot);
+	//virtual void setTexture(const UniformName& varname, const unsigned int tex) ;
+	virtual void setTexture(const UniformName& varname, Texture* texture, int slot);
 
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
@@ -120,6 +147,13 @@ public:
 
 	static Shader* getDefaultShader(std::string name);
 
+	//the linked programs are stored in disk (glGetProgramBinary) so next runs do not have to compile them again
+	//every entry is stored by the name of the shader with a hash of the driver and the final source (macros included),
+	//if any of them changes the binary is discarded and the shader is compiled from source
+	static void LoadProgramCache(const char* filename);
+	static void SaveProgramCache(); //only if something changed
+	static std::string s_program_cache_filename;
+
 protected:
 
 	std::string info_log;
@@ -127,6 +161,7 @@ protected:
 	std::string ps_filename;
 	std::string macros;
 	bool from_atlas;
+	std::string cache_name; //name used in the program cache, empty if it is not cached
 
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
@@ -141,21 +176,57 @@ protected:
 	GLuint program;
 	std::string log;
 
-//this is a hack to speed up shader usage (save info locally)
-private: 
+	//locations of the active uniforms, filled when the program is linked
+	//it is a flat open addressing table indexed by the hash of the name (size is a power of two)
+	struct UniformSlot {
+		uint32 hash;
+		GLint location; //-1 when the slot is empty
+		const char* name; //interned in s_uniform_names, compared when the hash matches
+	};
+	std::vector<UniformSlot> uniform_table;
+	uint32 uniform_mask;
+
+	void buildUniformTable();
+	void addUniform(const std::string& name, GLint location);
+
+	//every name found in a shader, used to detect hash collisions between different names
+	static std::map<uint32, std::string> s_uniform_names;
+
+	//connects the uniform blocks declared in the shader to their binding points
+	void bindUniformBlocks();
+	static const char* s_uniform_block_names[NUM_UNIFORM_BLOCKS];
+
+	struct ProgramBinary {
+		uint64 key;
+		GLenum format;
+		std::vector<char> data;
+	};
+	static std::map<std::string, ProgramBinary> s_program_cache;
+	static bool s_program_cache_dirty;
+
+	static bool isProgramCacheSupported();
+	static uint64 computeProgramKey(const std::string& vsm, const std::string& psm);
+	bool loadProgramBinary(uint64 key);
+	void storeProgramBinary(uint64 key);
 
-	struct ltstr
-	{
-		bool operator()(const char* s1, const char* s2) const
-		{
-			return strcmp(s1, s2) < 0;
-		}
-	};	
-	typedef std::map<const char*, int, ltstr> loctable;
+public:
+	GLint getLocation(const UniformName& varname);
+};
 
+//a buffer with the data of a uniform block (std140 layout), every shader that declares the block reads from it
+//it is better to upload big chunks of data once than many uniforms for every draw call
+class UniformBuffer
+{
 public:
-	GLint getLocation( const char* varname, loctable* table );
-	loctable locations;	
+	GLuint buffer_id;
+	eUniformBlock block;
+	int size;
+
+	UniformBuffer(eUniformBlock block, int size);
+	~UniformBuffer();
+
+	//GL keeps the draws already issued with the old data, so it can be updated between draws
+	void upload(const void* data, int size, int offset = 0);
 };
 
 #endif
\ No newline at end of file
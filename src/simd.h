@@ -0,0 +1,71 @@
+/*
+	Thin wrapper over registers of 4 floats so the math kernels are written only once:
+	- SSE in x86 and x64
+	- NEON in ARM64
+	- a struct of 4 floats in the rest of platforms (or if SIMD_DISABLED is defined)
+	All the operations work lane by lane and there is no fused multiply-add, but the compiler may still contract
+	the scalar code (-ffp-contract), so the versions agree within a few ulps, not always bit for bit.
+*/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#if !defined(SIMD_DISABLED) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define SIMD_SSE
+	#include <emmintrin.h>
+	typedef __m128 float4;
+#elif !defined(SIMD_DISABLED) && defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+	#define SIMD_NEON
+	#include <arm_neon.h>
+	typedef float32x4_t float4;
+#else
+	#define SIMD_SCALAR
+	#include <cmath>
+	struct float4 { float v[4]; };
+#endif
+
+#if defined(SIMD_SSE)
+
+inline float4 load4(const float* p) { return _mm_loadu_ps(p); }
+inline void store4(float* p, float4 a) { _mm_storeu_ps(p, a); }
+inline float4 set4(float x) { return _mm_set1_ps(x); }
+inline float4 set4(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+inline float4 add4(float4 a, float4 b) { return _mm_add_ps(a, b); }
+inline float4 sub4(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+inline float4 mul4(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+inline float4 min4(float4 a, float4 b) { return _mm_min_ps(a, b); }
+inline float4 max4(float4 a, float4 b) { return _mm_max_ps(a, b); }
+inline float4 abs4(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+template<int i> inline float4 splat4(float4 a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(i, i, i, i)); }
+
+#elif defined(SIMD_NEON)
+
+inline float4 load4(const float* p) { return vld1q_f32(p); }
+inline void store4(float* p, float4 a) { vst1q_f32(p, a); }
+inline float4 set4(float x) { return vdupq_n_f32(x); }
+inline float4 set4(float x, float y, float z, float w) { float v[4] = { x, y, z, w }; return vld1q_f32(v); }
+inline float4 add4(float4 a, float4 b) { return vaddq_f32(a, b); }
+inline float4 sub4(float4 a, float4 b) { return vsubq_f32(a, b); }
+inline float4 mul4(float4 a, float4 b) { return vmulq_f32(a, b); }
+inline float4 min4(float4 a, float4 b) { return vminq_f32(a, b); }
+inline float4 max4(float4 a, float4 b) { return vmaxq_f32(a, b); }
+inline float4 abs4(float4 a) { return vabsq_f32(a); }
+template<int i> inline float4 splat4(float4 a) { return vdupq_laneq_f32(a, i); }
+
+#else
+
+inline float4 load4(const float* p) { float4 r = { { p[0], p[1], p[2], p[3] } }; return r; }
+inline void store4(float* p, float4 a) { p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; p[3] = a.v[3]; }
+inline float4 set4(float x) { float4 r = { { x, x, x, x } }; return r; }
+inline float4 set4(float x, float y, float z, float w) { float4 r = { { x, y, z, w } }; return r; }
+inline float4 add4(float4 a, float4 b) { float4 r = { { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] } }; return r; }
+inline float4 sub4(float4 a, float4 b) { float4 r = { { a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3] } }; return r; }
+inline float4 mul4(float4 a, float4 b) { float4 r = { { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] } }; return r; }
+inline float4 min4(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; } //like SSE
+inline float4 max4(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline float4 abs4(float4 a) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = fabsf(a.v[i]); return r; }
+template<int i> inline float4 splat4(float4 a) { return set4(a.v[i]); }
+
+#endif
+
+#endif
@@ -1,79 +1,344 @@
 #include "task.h"
 #include <iostream>       // std::cout
 #include <thread>         // std::thread
-#include <chrono>		  //ms
 #include <cassert>
+#include <algorithm>
+#include <memory>
+#include <chrono>		  //us
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
 
+//used to know if the thread adding a task is a worker of the same pool, so it can use its own queue
+static thread_local TaskManager* current_manager = NULL;
+static thread_local int current_worker = -1;
+
+Task::Task()
+{
+	callback = NULL;
+	manager = NULL;
+	priority = 0;
+	cost = 0;
+	num_dependencies = 1;
+	finished = false;
+	done = done_promise.get_future().share();
+}
+
+Task::Task(std::function<void()> func) : Task()
+{
+	callback = func;
+}
+
+void Task::dependsOn(Task* task)
+{
+	const std::lock_guard<std::mutex> lock(task->continuations_mutex);
+	if (task->finished)
+		return;
+	num_dependencies++;
+	task->continuations.push_back(this);
+}
+
+Task* Task::then(Task* task, TaskManager* manager)
+{
+	if (!manager)
+		manager = this->manager ? this->manager : &TaskManager::background;
+	task->dependsOn(this);
+	manager->addTask(task);
+	return task;
+}
+
+bool Task::release()
+{
+	return --num_dependencies == 0;
+}
+
+void Task::finish()
+{
+	std::vector<Task*> ready;
+	{
+		const std::lock_guard<std::mutex> lock(continuations_mutex);
+		finished = true;
+		ready.swap(continuations);
+	}
+
+	done_promise.set_value();
+
+	//wake up the tasks that were waiting only for this one
+	for (Task* task : ready)
+		if (task->release())
+			task->manager->enqueue(task);
+}
+
+void TaskQueue::push(Task* task)
+{
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	tasks.push_back(task);
+}
+
+void TaskQueue::pushFront(Task* task)
+{
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	tasks.push_front(task);
+}
+
+Task* TaskQueue::popHighestPriority()
+{
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	if (tasks.empty())
+		return NULL;
+
+	//priorities can change while waiting (p.e. a texture becomes visible) so we search every time
+	auto best = tasks.begin();
+	int best_priority = (*best)->getPriority();
+	for (auto it = best + 1; it != tasks.end(); ++it)
+	{
+		int priority = (*it)->getPriority();
+		if (priority > best_priority)
+		{
+			best = it;
+			best_priority = priority;
+		}
+	}
+	Task* task = *best;
+	tasks.erase(best);
+	return task;
+}
+
+Task* TaskQueue::pop()
+{
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	if (tasks.empty())
+		return NULL;
+	Task* task = tasks.front();
+	tasks.pop_front();
+	return task;
+}
+
+Task* TaskQueue::steal()
+{
+	//do not wait for a busy queue, try with the next one
+	std::unique_lock<std::mutex> lock(tasks_mutex, std::try_to_lock);
+	if (!lock.owns_lock() || tasks.empty())
+		return NULL;
+	Task* task = tasks.back();
+	tasks.pop_back();
+	return task;
+}
+
 TaskManager::TaskManager()
 {
 	must_loop = false;
-	_thread = NULL;
+	num_pending = 0;
+	next_queue = 0;
+	queues.push_back(new TaskQueue());
 }
 
-void TaskManager::loop()
+TaskManager::~TaskManager()
 {
-	using namespace std::chrono_literals;
-	std::cout << "Starting Task Manager ..." << std::endl;
+	stopThreads();
+	for (int i = 0; i < queues.size(); ++i)
+	{
+		for (Task* task : queues[i]->tasks)
+			delete task;
+		delete queues[i];
+	}
+	queues.clear();
+}
+
+void TaskManager::loop(int worker_index)
+{
+	current_manager = this;
+	current_worker = worker_index;
 
 	while (must_loop)
 	{
-		if (pending_tasks.empty())
+		Task* task = popTask(worker_index);
+		if (task)
 		{
-			std::this_thread::sleep_for(10ms);
+			executeTask(task);
 			continue;
 		}
 
-		fetchTask();
+		//nothing to do, sleep till somebody adds a task
+		std::unique_lock<std::mutex> lock(wait_mutex);
+		wait_condition.wait(lock, [this]() { return !must_loop || num_pending > 0; });
 	}
 
-	std::cout << "Ending Task Manager" << std::endl;
+	current_manager = NULL;
+	current_worker = -1;
+}
+
+Task* TaskManager::popTask(int worker_index)
+{
+	int num_queues = (int)queues.size();
+	Task* task = queues[worker_index]->pop();
+
+	//my queue is empty, steal from the others
+	for (int i = 1; !task && i < num_queues; ++i)
+		task = queues[(worker_index + i) % num_queues]->steal();
+
+	if (task)
+		num_pending--;
+	return task;
+}
+
+void TaskManager::executeTask(Task* task)
+{
+	task->onExecute();
+	task->finish();
+	delete task;
+}
+
+bool TaskManager::fetchTask()
+{
+	Task* task = popTask(current_manager == this ? current_worker : 0);
+	if (!task)
+		return false;
+	executeTask(task);
+	return true;
 }
 
-void TaskManager::fetchTask()
+int TaskManager::fetchTasks(long budget_us)
 {
-	Task* task = NULL;
-	try
+	using namespace std::chrono;
+	TaskQueue* queue = queues[current_manager == this ? current_worker : 0];
+	high_resolution_clock::time_point start = high_resolution_clock::now();
+	int num_executed = 0;
+
+	while (true)
 	{
-		//lock
-		const std::lock_guard<std::mutex> lock(tasks_mutex);
-		if (pending_tasks.empty())
-			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
-		//unlock after finishing scope
-	}
-	catch (std::logic_error&) {
-		std::cout << "[exception caught]\n";
+		Task* task = queue->popHighestPriority();
+		if (!task)
+			break;
+
+		//always execute one so we never stall, then only the ones that fit in the budget
+		long elapsed_us = (long)duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+		if (num_executed && elapsed_us + task->getCost() > budget_us)
+		{
+			queue->pushFront(task);
+			break;
+		}
+
+		num_pending--;
+		executeTask(task);
+		num_executed++;
 	}
 
-	if (task)
+	return num_executed;
+}
+
+//shared by the calling thread and the helper tasks of a parallelFor, helpers could start after the call ends
+struct ParallelJob {
+	std::function<void(int, int, int)> func;
+	int count;
+	int chunk_size;
+	int num_chunks;
+	std::atomic<int> next_chunk;
+	std::atomic<int> done_chunks;
+	std::mutex done_mutex;
+	std::condition_variable done_condition;
+
+	//returns false when there are no more chunks to take
+	bool runChunk()
 	{
-		task->onExecute();
-		delete task;
-		task = NULL;
+		int chunk = next_chunk++;
+		if (chunk >= num_chunks)
+			return false;
+		int start = chunk * chunk_size;
+		func(start, std::min(start + chunk_size, count), chunk);
+		if (++done_chunks == num_chunks)
+		{
+			const std::lock_guard<std::mutex> lock(done_mutex);
+			done_condition.notify_all();
+		}
+		return true;
 	}
+};
+
+void TaskManager::parallelFor(int count, int chunk_size, std::function<void(int start, int end, int chunk)> func)
+{
+	if (count <= 0)
+		return;
+	chunk_size = std::max(1, chunk_size);
+
+	std::shared_ptr<ParallelJob> job = std::make_shared<ParallelJob>();
+	job->func = func;
+	job->count = count;
+	job->chunk_size = chunk_size;
+	job->num_chunks = (count + chunk_size - 1) / chunk_size;
+	job->next_chunk = 0;
+	job->done_chunks = 0;
+
+	//one helper per worker, we do not wait for them to start (they may be busy), only for the chunks to end
+	int num_helpers = std::min((int)threads.size(), job->num_chunks - 1);
+	for (int i = 0; i < num_helpers; ++i)
+		addTask(new Task([job]() { while (job->runChunk()); }));
+
+	while (job->runChunk());
+
+	std::unique_lock<std::mutex> lock(job->done_mutex);
+	job->done_condition.wait(lock, [&job]() { return job->done_chunks == job->num_chunks; });
 }
 
-void thread_loop_func(TaskManager* manager)
+void thread_loop_func(TaskManager* manager, int worker_index)
 {
-	manager->loop();
-	//join?
+	manager->loop(worker_index);
 }
 
-void TaskManager::startThread()
+void TaskManager::startThreads(int num_threads)
 {
-	assert(!_thread && "TaskManager already in a thread");
+	assert(!threads.size() && "TaskManager already has threads");
+	if (num_threads <= 0)
+		num_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1); //leave one for the main thread
+
+	//tasks added before starting stay in the first queue
+	while (queues.size() < num_threads)
+		queues.push_back(new TaskQueue());
+
 	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(thread_loop_func, this, i));
+	std::cout << "Task Manager started with " << num_threads << " threads" << std::endl;
+}
+
+void TaskManager::stopThreads()
+{
+	if (!threads.size())
+		return;
+
+	{
+		const std::lock_guard<std::mutex> lock(wait_mutex);
+		must_loop = false;
+	}
+	wait_condition.notify_all();
+
+	for (std::thread* thread : threads)
+	{
+		thread->join();
+		delete thread;
+	}
+	threads.clear();
+	std::cout << "Task Manager stopped" << std::endl;
 }
 
 void TaskManager::addTask(Task* task)
 {
-	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
-	//release pending_tasks automatically
-}
\ No newline at end of file
+	task->manager = this;
+	if (task->release())
+		enqueue(task);
+}
+
+void TaskManager::enqueue(Task* task)
+{
+	//workers keep the tasks they generate, the rest are distributed
+	if (current_manager == this)
+		queues[current_worker]->push(task);
+	else
+		queues[next_queue++ % queues.size()]->push(task);
+
+	{
+		const std::lock_guard<std::mutex> lock(wait_mutex);
+		num_pending++;
+	}
+	wait_condition.notify_one();
+}
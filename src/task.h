@@ -1,34 +1,113 @@
 #pragma once
 
 #include <vector>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <thread>         // std::thread
 #include <functional>
+#include <future>
+
+class TaskManager;
 
 //any task executed in BG should inherit from this one
+//tasks can depend on other tasks, they are only queued when all the tasks they depend on are finished,
+//so a graph of tasks is executed in topological order. Dependencies must be declared before the
+//task we depend on is added to a manager (or from inside its onExecute)
 class Task {
 public:
 	std::function<void()> callback;
-	Task() { callback = NULL; };
-	Task(std::function<void()> func) { callback = func; };
+	TaskManager* manager; //where it will be executed once it is ready
+	int priority; //tasks with higher priority are executed first when draining with a budget
+	float cost; //estimated microseconds to execute it, used to fit tasks in a budget (0 means unknown)
+	std::shared_future<void> done; //copy it before adding the task to wait for it
+
+	Task();
+	Task(std::function<void()> func);
 	virtual ~Task() {};
 	virtual void onExecute() { if (callback) callback(); }
+	virtual int getPriority() { return priority; }
+	virtual float getCost() { return cost; }
+
+	void dependsOn(Task* task);
+	//adds a task that will be executed after this one, in the given manager (or in the same one), returns the new task to chain calls
+	Task* then(Task* task, TaskManager* manager = NULL);
+	Task* then(std::function<void()> func, TaskManager* manager = NULL) { return then(new Task(func), manager); }
+
+	//called by the manager
+	void finish();
+	bool release(); //returns true if it has no more dependencies
+
+protected:
+	std::atomic<int> num_dependencies; //starts at one, the manager releases it when the task is added
+	std::vector<Task*> continuations; //tasks waiting for this one
+	std::mutex continuations_mutex; //protects continuations and finished
+	bool finished;
+	std::promise<void> done_promise;
+};
+
+//a task that returns a value, use result to wait for it
+template <typename T> class FutureTask : public Task {
+public:
+	std::function<T()> func;
+	std::shared_future<T> result;
+
+	FutureTask(std::function<T()> func) { this->func = func; result = promise.get_future().share(); }
+	void onExecute() { promise.set_value(func()); }
+
+protected:
+	std::promise<T> promise;
 };
 
+//the queue of one worker, the owner pops from the front and the other workers steal from the back
+class TaskQueue {
+public:
+	std::deque<Task*> tasks;
+	std::mutex tasks_mutex;  // protects tasks
+
+	void push(Task* task);
+	void pushFront(Task* task);
+	Task* pop();
+	Task* popHighestPriority();
+	Task* steal();
+};
+
+//when threads are started it works as a work-stealing pool (one queue per worker),
+//otherwise it has one queue that must be drained calling fetchTask (used for the main thread)
 class TaskManager {
 public:
-	std::list<Task*> pending_tasks;
-	std::mutex tasks_mutex;  // protects pending_tasks
-	bool must_loop;
-	std::thread* _thread;
+	std::vector<TaskQueue*> queues;
+	std::vector<std::thread*> threads;
+
+	std::mutex wait_mutex;  // used by idle workers to sleep till a task arrives
+	std::condition_variable wait_condition;
+	std::atomic<int> num_pending;
+	std::atomic<unsigned int> next_queue; //round robin for tasks added from outside the pool
+	std::atomic<bool> must_loop; //read by the workers without the lock
 
 	static TaskManager foreground;
 	static TaskManager background;
 
 	TaskManager();
-	void addTask(Task* task);
-	void fetchTask();
-	void loop();
-	void startThread();
-};
\ No newline at end of file
+	~TaskManager();
+	void addTask(Task* task); //it will wait in the manager till its dependencies are finished
+	bool fetchTask(); //executes one task in the calling thread, returns false if there was nothing to do
+	int fetchTasks(long budget_us); //executes tasks by priority till the budget (in microseconds) is used, returns how many
+	void loop(int worker_index);
+	void startThreads(int num_threads = 0); //0 means one per hardware thread
+	void stopThreads();
+
+	//splits [0,count) in chunks executed by the workers and the calling thread, returns when all are done
+	//func receives the range and the index of the chunk (to write in per-chunk buffers)
+	void parallelFor(int count, int chunk_size, std::function<void(int start, int end, int chunk)> func);
+
+	int getNumPending() { return num_pending; }
+	int getNumWorkers() { return (int)threads.size(); }
+
+	void enqueue(Task* task); //adds a task that is ready to be executed
+
+protected:
+	Task* popTask(int worker_index);
+	void executeTask(Task* task);
+};
@@ -2,9 +2,11 @@
 #include "texture.h"
 #include "fbo.h"
 #include "utils.h"
+#include "glstate.h"
 
 #include <iostream> //to output
 #include <cmath>
+#include <chrono>
 
 #include "mesh.h"
 #include "shader.h"
@@ -74,11 +76,13 @@ Texture::Texture()
 	type = 0;
 	texture_type = GL_TEXTURE_2D;
 	loading = false;
+	requested = false;
 }
 
 Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	loading = false;
+	requested = false;
 	texture_id = 0;
 	create(width, height, format, type, mipmaps, data, internal_format);
 }
@@ -86,6 +90,7 @@ Texture::Texture(unsigned int width, unsigned int height, unsigned int format, u
 Texture::Texture(Image* img)
 {
 	loading = false;
+	requested = false;
 	texture_id = 0;
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 }
@@ -97,11 +102,14 @@ Texture::~Texture()
 
 void Texture::clear()
 {
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 
 	//external textures are handled by an outside system (like Android OS)
 	if( texture_type != GL_TEXTURE_EXTERNAL_OES)
+	{
+		GLState::onTextureDeleted(texture_id);
 		glDeleteTextures(1, &texture_id);
+	}
 
 	if(!loading) //when loading the texture of 1x1 is replaced with the new one
 		stdlog("Destroy texture: " + filename );
@@ -214,7 +222,7 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
@@ -258,9 +266,11 @@ Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
 	temp->setName(filename);
 	temp->loading = true;
 
-	//add action to BG Thread 
-	LoadTextureTask* task = new LoadTextureTask(filename);
-	TaskManager::background.addTask(task);
+	//add action to BG Thread and the upload to the main thread once it is done
+	UploadTextureTask* upload_task = new UploadTextureTask(filename, NULL, temp);
+	LoadTextureTask* load_task = new LoadTextureTask(filename, upload_task);
+	load_task->then(upload_task, &TaskManager::foreground);
+	TaskManager::background.addTask(load_task);
 
 	return temp;
 }
@@ -291,14 +301,14 @@ void Texture::loadFromImage(Image* image, bool mipmaps, bool wrap, unsigned int
 	// We have to synchronously upload for now because Image class is not ref-counted
 	create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type,  mipmaps, image->data, 0);
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	//if (mipmaps)
 	//	generateMipmaps();
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::bindTexture(GL_TEXTURE_2D, 0);
 }
 
 void Texture::upload(Image* img)
@@ -319,7 +329,7 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	if (internal_format == 0)
 	{
@@ -340,7 +350,7 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
@@ -349,7 +359,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
 
@@ -362,7 +372,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
 */
@@ -373,7 +383,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint
 	assert(texture_type == GL_TEXTURE_CUBE_MAP && "Texture type does not match.");
 	//assert(glGetError() == GL_NO_ERROR);
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	int w = ((int)this->width) >> level;
 	int h = ((int)this->height) >> level;
@@ -413,7 +423,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint
 		//	generateMipmaps();
 	}
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(glGetError() == GL_NO_ERROR && "Error creating texture");
 }
 
@@ -473,7 +483,7 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 	assert(glGetError() == GL_NO_ERROR);
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-	glBindTexture( this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture( this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	glTexImage3D( this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -496,13 +506,13 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
-	glBindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
 }
 
 void Texture::unbind()
 {
 	//glDisable(this->texture_type); //disable the textures 
-	glBindTexture(this->texture_type, 0 );	//disable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, 0 );	//disable the id of the texture we are going to use
 }
 
 void Texture::UnbindAll()
@@ -510,9 +520,9 @@ void Texture::UnbindAll()
 	glDisable( GL_TEXTURE_CUBE_MAP );
 	glDisable( GL_TEXTURE_2D );
 	glDisable(GL_TEXTURE_3D);
-	glBindTexture( GL_TEXTURE_2D, 0 );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, 0 );
-	glBindTexture(GL_TEXTURE_3D, 0);
+	GLState::bindTexture( GL_TEXTURE_2D, 0 );
+	GLState::bindTexture( GL_TEXTURE_CUBE_MAP, 0 );
+	GLState::bindTexture(GL_TEXTURE_3D, 0);
 }
 
 void Texture::generateMipmaps()
@@ -521,7 +531,7 @@ void Texture::generateMipmaps()
 		if(!glGenerateMipmapEXT)
 			return;
 
-		glBindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
+		GLState::bindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter ); //set the mag filter
 		if (this->texture_type == GL_TEXTURE_CUBE_MAP)
 		{
@@ -530,7 +540,7 @@ void Texture::generateMipmaps()
 		}
 		glGenerateMipmapEXT(this->texture_type);
 #else
-	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
 	glGenerateMipmap(this->texture_type);
     #endif
@@ -544,10 +554,10 @@ void Texture::toViewport(Shader* shader)
 		shader = Shader::getDefaultShader("screen");
 	shader->enable();
 	if(shader->getUniformLocation("u_texture") != -1)
-		shader->setUniform("u_texture", this, 0);
+		shader->setUniform(UNIFORM("u_texture"), this, 0);
 	assert(glGetError() == GL_NO_ERROR);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
 	quad->render(GL_TRIANGLES);
 	assert(glGetError() == GL_NO_ERROR);
 	shader->disable();
@@ -587,8 +597,8 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 	{
 		if (format == GL_DEPTH_COMPONENT) //to clone depth buffer
 		{
-			glEnable(GL_DEPTH_TEST); //we need to use the depth buffer
-			glDepthFunc(GL_ALWAYS); //but ignore the test, every fragment should update the depth
+			GLState::enable(GL_DEPTH_TEST); //we need to use the depth buffer
+			GLState::depthFunc(GL_ALWAYS); //but ignore the test, every fragment should update the depth
 			glColorMask(false, false, false, false); //block drawing to colors
 			if(!shader)
 				shader = Shader::getDefaultShader("screen_depth");
@@ -597,37 +607,37 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 			shader = Shader::getDefaultShader("texture");
 		Mesh* quad = Mesh::getQuad();
 		shader->enable();
-		shader->setUniform("u_texture", this, 0);
-		shader->setUniform("u_color", Vector4(1,1,1,1) );
-		glDisable(GL_CULL_FACE);
+		shader->setUniform(UNIFORM("u_texture"), this, 0);
+		shader->setUniform(UNIFORM("u_color"), Vector4(1,1,1,1) );
+		GLState::disable(GL_CULL_FACE);
 		quad->render(GL_TRIANGLES);
 		glColorMask(true, true, true, true);
-		glDisable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
+		GLState::disable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_LESS);
 		return;
 	}
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
 	FBO* fbo = getGlobalFBO(destination);
 	fbo->bind();
 	if (!shader && format == GL_DEPTH_COMPONENT)
 	{
 		shader = Shader::getDefaultShader("screen_depth");
-		glDepthFunc(GL_ALWAYS);
-		glEnable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_ALWAYS);
+		GLState::enable(GL_DEPTH_TEST);
 		Mesh* quad = Mesh::getQuad();
 		shader->enable();
 		if (shader->getUniformLocation("u_texture") != -1)
-			shader->setUniform("u_texture", this, 0);
+			shader->setUniform(UNIFORM("u_texture"), this, 0);
 		quad->render(GL_TRIANGLES);
 		shader->disable();
 	}
 	else
 		toViewport(shader);
 	fbo->unbind();
-	glDisable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_LESS);
 }
 
 void Image::fromScreen(int width, int height)
@@ -1026,36 +1036,52 @@ bool isPowerOfTwo( int n )
 
 //*********************
 
-LoadTextureTask::LoadTextureTask(const char* str)
+LoadTextureTask::LoadTextureTask(const char* str, UploadTextureTask* upload_task)
 {
 	filename = str;
-	image = NULL;
+	this->upload_task = upload_task;
 }
 
 void LoadTextureTask::onExecute()
 {
-	image = new Image();
+	Image* image = new Image();
 	if (!image->load(filename.c_str()))
 	{
 		delete image;
 		image = NULL;
 	}
 
-	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
-	TaskManager::foreground.addTask(upload_task);
+	//image loaded, the upload task will be queued in the main thread when this one finishes
+	upload_task->image = image;
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+float UploadTextureTask::us_per_byte = 0.001f;
+
+UploadTextureTask::UploadTextureTask(const char* filename, Image* image, Texture* texture)
 {
 	this->filename = filename;
 	this->image = image;
+	this->texture = texture;
 }
 
-void UploadTextureTask::onExecute()
+int UploadTextureTask::getPriority()
+{
+	//the texture could have been replaced while loading, so check it is still registered
+	auto it = Texture::sTexturesLoaded.find(filename);
+	if (it != Texture::sTexturesLoaded.end() && it->second == texture && texture->requested)
+		return priority + 1;
+	return priority;
+}
+
+float UploadTextureTask::getCost()
 {
-	Texture* texture = NULL;
+	if (!image)
+		return 0;
+	return image->width * image->height * image->num_channels * us_per_byte;
+}
 
+void UploadTextureTask::onExecute()
+{
 	//in case somehow it got loaded while I was loading it in the background
 	auto it = Texture::sTexturesLoaded.find(filename);
 	if (it == Texture::sTexturesLoaded.end())
@@ -1070,11 +1096,24 @@ void UploadTextureTask::onExecute()
 		return;
 	}
 
-	texture = it->second;
+	texture = it->second; //it could have been replaced while loading
+
+	//failed to load, keep the 1x1 texture
+	if (!image)
+	{
+		texture->loading = false;
+		return;
+	}
 
-	//upload to GPU
+	//upload to GPU and measure it to improve the next estimations
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 	texture->loadFromImage(image);
 	texture->loading = false;
+	texture->requested = false;
+	float elapsed_us = (float)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	float bytes = (float)image->width * image->height * image->num_channels;
+	if (bytes > 0)
+		us_per_byte = us_per_byte * 0.8f + (elapsed_us / bytes) * 0.2f;
 
 	//delete image
 	delete image;
@@ -119,6 +119,7 @@ public:
 	float depth;	//Optional for 3dTexture or 2dTexture array
 	std::string filename;
 	bool loading;
+	bool requested; //used for rendering while loading, so it must be uploaded first
 
 	unsigned int format; //GL_RGB, GL_RGBA
 	unsigned int type; //GL_UNSIGNED_INT, GL_FLOAT
@@ -192,23 +193,31 @@ bool isPowerOfTwo(int n);
 //When loading textures asyncrhonously, first we load them from the hard drive in a background thread
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
 //uploads to GPU. While loading a fake 1x1 texture is created
+//The upload task is a continuation of the load task, so it is only queued in the main thread once the image is decoded
+
+class UploadTextureTask;
 
 class LoadTextureTask : public Task {
 public:
 	std::string filename;
-	Image* image;
+	UploadTextureTask* upload_task; //where to pass the image
 
-	LoadTextureTask(const char* filename);
+	LoadTextureTask(const char* filename, UploadTextureTask* upload_task);
 	void onExecute();
 };
 
 class UploadTextureTask : public Task {
 public:
+	static float us_per_byte; //measured cost of uploading, used to estimate the cost of the next ones
+
 	std::string filename;
 	Image* image;
+	Texture* texture; //the temporary texture, only used to know its priority
 
-	UploadTextureTask(const char* filename, Image* image);
+	UploadTextureTask(const char* filename, Image* image = NULL, Texture* texture = NULL);
 	void onExecute();
+	int getPriority();
+	float getCost();
 };
 
 
@@ -4,6 +4,10 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
 #endif
 
 #include "includes.h"
@@ -12,6 +16,7 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "glstate.h"
 
 #include "extra/stb_easy_font.h"
 
@@ -137,6 +142,70 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+bool mapFile(const char* filename, MappedFile& file)
+{
+	file.data = NULL;
+	file.size = 0;
+	file.handle = NULL;
+
+#ifdef WIN32
+	HANDLE f = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(f, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(f);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(f); //the mapping keeps the file open
+	if (!mapping)
+		return false;
+	file.data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!file.data)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+	file.size = (size_t)size.QuadPart;
+	file.handle = mapping;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //the mapping keeps the file open
+	if (data == MAP_FAILED)
+		return false;
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	file.data = (const char*)data;
+	file.size = (size_t)st.st_size;
+#endif
+	return true;
+}
+
+void unmapFile(MappedFile& file)
+{
+	if (!file.data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle((HANDLE)file.handle);
+#else
+	munmap((void*)file.data, file.size);
+#endif
+	file.data = NULL;
+	file.size = 0;
+	file.handle = NULL;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -186,6 +255,52 @@ std::string join(std::vector<std::string>& strings, const char* delim)
 	return str;
 }
 
+//LSD radix sort, 8 bits per pass, skipping the passes where all the keys have the same byte
+void radixSort(uint64* keys, uint32* values, int num, uint64* tmp_keys, uint32* tmp_values)
+{
+	if (num < 2)
+		return;
+
+	uint64* src_keys = keys;
+	uint32* src_values = values;
+	uint64* dst_keys = tmp_keys;
+	uint32* dst_values = tmp_values;
+
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		int count[256] = { 0 };
+		for (int i = 0; i < num; ++i)
+			count[(src_keys[i] >> shift) & 0xFF]++;
+		if (count[(src_keys[0] >> shift) & 0xFF] == num)
+			continue;
+
+		int offset = 0;
+		for (int i = 0; i < 256; ++i)
+		{
+			int c = count[i];
+			count[i] = offset;
+			offset += c;
+		}
+
+		for (int i = 0; i < num; ++i)
+		{
+			int pos = count[(src_keys[i] >> shift) & 0xFF]++;
+			dst_keys[pos] = src_keys[i];
+			dst_values[pos] = src_values[i];
+		}
+
+		std::swap(src_keys, dst_keys);
+		std::swap(src_values, dst_values);
+	}
+
+	//result ended in the tmp buffers
+	if (src_keys != keys)
+	{
+		memcpy(keys, src_keys, sizeof(uint64) * num);
+		memcpy(values, src_values, sizeof(uint32) * num);
+	}
+}
+
 Vector2 getDesktopSize( int display_index )
 {
   SDL_DisplayMode current;
@@ -214,8 +329,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	Matrix44 projection_matrix;
 	projection_matrix.ortho(0, Application::instance->window_width / scale, Application::instance->window_height / scale, 0, -1, 1);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
 
 	glMatrixMode(GL_MODELVIEW);
 	glPushMatrix();
@@ -234,8 +349,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	glMatrixMode(GL_MODELVIEW);
 	glPopMatrix();
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 
 	return true;
 }
@@ -324,37 +439,40 @@ void drawGrid()
 	}
 
 	glLineWidth(1);
-	glEnable(GL_BLEND);
+	GLState::enable(GL_BLEND);
 	glDepthMask(false);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	Shader* grid_shader = Shader::getDefaultShader("grid");
 	grid_shader->enable();
 	Matrix44 m;
 	m.translate(floor(Camera::current->eye.x / 100.0)*100.0f, 0.0f, floor(Camera::current->eye.z / 100.0f)*100.0f);
-	grid_shader->setUniform("u_color", Vector4(0.7, 0.7, 0.7, 0.7));
-	grid_shader->setUniform("u_model", m);
-	grid_shader->setUniform("u_camera_position", Camera::current->eye);
-	grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
+	grid_shader->setUniform(UNIFORM("u_color"), Vector4(0.7, 0.7, 0.7, 0.7));
+	grid_shader->setUniform(UNIFORM("u_model"), m);
+	grid_shader->setUniform(UNIFORM("u_camera_position"), Camera::current->eye);
+	grid_shader->setUniform(UNIFORM("u_viewprojection"), Camera::current->viewprojection_matrix);
 	grid->render(GL_LINES); //background grid
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
 	glDepthMask(true);
 	grid_shader->disable();
 }
 
-void ImGuiMatrix44(Matrix44& matrix, const char* text)
+bool ImGuiMatrix44(Matrix44& matrix, const char* text)
 {
+	bool changed = false;
 	#ifndef SKIP_IMGUI
 	if (ImGui::TreeNode((void*)&matrix, "Model"))
 	{
 		float matrixTranslation[3], matrixRotation[3], matrixScale[3];
 		ImGuizmo::DecomposeMatrixToComponents(matrix.m, matrixTranslation, matrixRotation, matrixScale);
-		ImGui::DragFloat3("Position", matrixTranslation, 0.1f);
-		ImGui::DragFloat3("Rotation", matrixRotation, 0.1f);
-		ImGui::DragFloat3("Scale", matrixScale, 0.1f);
-		ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, matrix.m);
+		changed |= ImGui::DragFloat3("Position", matrixTranslation, 0.1f);
+		changed |= ImGui::DragFloat3("Rotation", matrixRotation, 0.1f);
+		changed |= ImGui::DragFloat3("Scale", matrixScale, 0.1f);
+		if (changed) //recomposing always changes some bits
+			ImGuizmo::RecomposeMatrixFromComponents(matrixTranslation, matrixRotation, matrixScale, matrix.m);
 		ImGui::TreePop();
 	}
 	#endif
+	return changed;
 }
 
 char* fetchWord(char* data, char* word)
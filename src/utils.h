@@ -19,6 +19,15 @@ float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 
+//maps a file in memory (read only), pages are loaded by the OS when accessed and they do not count as allocated memory
+struct MappedFile {
+	const char* data;
+	size_t size;
+	void* handle; //used only in windows
+};
+bool mapFile(const char* filename, MappedFile& file);
+void unmapFile(MappedFile& file);
+
 //generic purposes fuctions
 void drawGrid();
 bool drawText(float x, float y, std::string text, Vector3 c, float scale = 1);
@@ -36,7 +45,10 @@ std::vector<std::string>& split(const std::string &s, char delim, std::vector<st
 std::vector<std::string> split(const std::string &s, char delim);
 std::string join(std::vector<std::string>& strings, const char* delim);
 
-void ImGuiMatrix44(Matrix44& matrix, const char* text);
+//sorts the keys (and its values) in O(n), tmp buffers must have the same size
+void radixSort(uint64* keys, uint32* values, int num, uint64* tmp_keys, uint32* tmp_values);
+
+bool ImGuiMatrix44(Matrix44& matrix, const char* text); //true if it was edited
 
 std::string getGPUStats();
 void drawGrid();
@@ -0,0 +1,86 @@
+//culls random boxes around a camera with Camera::testBoxInFrustum, the batched scalar loop and the SIMD one,
+//prints their times and checks that the three give the same result
+
+#include "test.h"
+#include "culling.h"
+#include "camera.h"
+#include <vector>
+
+static const int NUM_BOXES = 100000;
+static const int NUM_REPETITIONS = 20;
+
+int main()
+{
+	Camera camera;
+	camera.setPerspective(70.0f, 1.7f, 0.1f, 1000.0f);
+	camera.lookAt(Vector3(0.0f, 10.0f, 0.0f), Vector3(10.0f, 5.0f, 30.0f), Vector3(0.0f, 1.0f, 0.0f));
+
+	//random boxes around the camera, some of them inside the frustum
+	BoxCuller culler;
+	culler.reserve(NUM_BOXES);
+	std::vector<Vector3> centers(NUM_BOXES);
+	std::vector<Vector3> halfsizes(NUM_BOXES);
+	float area = camera.far_plane * 0.5f;
+	for (int i = 0; i < NUM_BOXES; ++i)
+	{
+		centers[i] = camera.eye + Vector3(random(area * 2.0f) - area, random(area * 2.0f) - area, random(area * 2.0f) - area);
+		halfsizes[i] = Vector3(random(10.0f) + 0.1f, random(10.0f) + 0.1f, random(10.0f) + 0.1f);
+		culler.add(centers[i], halfsizes[i]);
+	}
+
+	std::vector<char> reference(NUM_BOXES);
+	double start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		for (int i = 0; i < NUM_BOXES; ++i)
+			reference[i] = camera.testBoxInFrustum(centers[i], halfsizes[i]) != CLIP_OUTSIDE;
+	double camera_us = (testTime() - start) / NUM_REPETITIONS;
+
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		culler.cullScalar(camera.frustum);
+	double scalar_us = (testTime() - start) / NUM_REPETITIONS;
+	int scalar_mismatches = 0;
+	for (int i = 0; i < NUM_BOXES; ++i)
+		scalar_mismatches += culler.isVisible(i) != (bool)reference[i];
+
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		culler.cull(camera.frustum);
+	double simd_us = (testTime() - start) / NUM_REPETITIONS;
+	int simd_mismatches = 0, num_visible = 0;
+	for (int i = 0; i < NUM_BOXES; ++i)
+	{
+		simd_mismatches += culler.isVisible(i) != (bool)reference[i];
+		num_visible += culler.isVisible(i);
+	}
+
+#if defined(CULLING_AVX)
+	const char* simd_name = "AVX";
+#elif defined(CULLING_SSE)
+	const char* simd_name = "SSE";
+#else
+	const char* simd_name = "scalar";
+#endif
+	printf("%d boxes, %d visible\n", NUM_BOXES, num_visible);
+	printf("testBoxInFrustum %8.1f us\n", camera_us);
+	printf("batched scalar   %8.1f us\n", scalar_us);
+	printf("batched %-8s %8.1f us\n", simd_name, simd_us);
+
+	CHECK(num_visible > 0 && num_visible < NUM_BOXES);
+	CHECK(scalar_mismatches == 0);
+	CHECK(simd_mismatches == 0);
+
+	//the padding of a cull is replaced by the boxes added after it
+	for (int num = 13; num < 16; ++num)
+	{
+		culler.clear();
+		for (int i = 0; i < num; ++i)
+			culler.add(Vector3(0.0f, 10.0f, 10.0f + i), Vector3(1.0f, 1.0f, 1.0f));
+		culler.cull(&camera);
+		CHECK(culler.size() == num && culler.isVisible(num - 1));
+	}
+	culler.setAllVisible(40);
+	CHECK(culler.size() == 40 && culler.isVisible(39));
+
+	return test_failures;
+}
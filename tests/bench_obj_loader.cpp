@@ -0,0 +1,187 @@
+//parses a big OBJ generated in memory (a grid with v/vt/vn, two submeshes and relative indices) and prints the speed,
+//the result is checked against the values written. The sequential parser that Mesh::loadOBJ used before is timed too
+
+#include "test.h"
+#include "obj_loader.h"
+#include "task.h"
+#include <cstring>
+#include <string>
+
+static const int N = 500; //quads per side
+
+static Vector3 gridPosition(int x, int y) { return Vector3(x * 0.1234f, sin(x * 0.05f) * 3.0f, y * -0.5678f); }
+
+//the second half uses indices relative to the end of the vertices, the old parser only supports absolute ones
+static std::string buildOBJ(bool relative_indices)
+{
+	int num_positions = (N + 1) * (N + 1);
+	std::string text = "# grid\ng top\n";
+	char line[256];
+	for (int y = 0; y <= N; ++y)
+		for (int x = 0; x <= N; ++x)
+		{
+			Vector3 p = gridPosition(x, y);
+			sprintf(line, "v %.4f %.6f %.4f\nvt %.6f %.6f\nvn 0 1 0\n", p.x, p.y, p.z, x / (float)N, y / (float)N);
+			text += line;
+		}
+	for (int y = 0; y < N; ++y)
+	{
+		if (y == N / 2)
+			text += "usemtl bottom\n";
+		for (int x = 0; x < N; ++x)
+		{
+			//1 based, the second half uses indices relative to the end of the vertices
+			int a = y * (N + 1) + x + 1, b = a + 1, c = a + N + 1, d = c + 1;
+			if (relative_indices && y >= N / 2)
+			{
+				a -= num_positions + 1; b -= num_positions + 1; c -= num_positions + 1; d -= num_positions + 1;
+			}
+			sprintf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, d, d, d, c, c, c);
+			text += line;
+		}
+	}
+	return text;
+}
+
+//utils tokenize, it can not be linked without a window
+static std::vector<std::string> referenceTokenize(const std::string& source)
+{
+	std::vector<std::string> tokens;
+	std::string str;
+	for (const char* pos = source.c_str(); *pos; ++pos)
+	{
+		if (*pos != ' ')
+			str += *pos;
+		else if (!str.empty())
+		{
+			tokens.push_back(str);
+			str.clear();
+		}
+	}
+	if (!str.empty())
+		tokens.push_back(str);
+	return tokens;
+}
+
+//the loop of the old Mesh::loadOBJ: one line at a time, tokenized, and a vertex for every corner (no submeshes)
+static int referenceParseOBJ(const std::string& text, std::vector<Vector3>& vertices, std::vector<Vector2>& uvs, std::vector<Vector3>& normals)
+{
+	std::string data = text; //it was read from the file into a string
+	char* pos = &data[0];
+	char line[255];
+	std::vector<Vector3> indexed_positions;
+	std::vector<Vector3> indexed_normals;
+	std::vector<Vector2> indexed_uvs;
+	while (*pos != 0)
+	{
+		if (*pos == '\n') pos++;
+		if (*pos == '\r') pos++;
+		int i = 0;
+		while (i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
+		memcpy(line, pos, i);
+		line[i] = 0;
+		pos = pos + i;
+		if (*line == '#' || *line == 0)
+			continue;
+
+		std::vector<std::string> tokens = referenceTokenize(line);
+		if (tokens.empty())
+			continue;
+		if (tokens[0] == "v" && tokens.size() == 4)
+			indexed_positions.push_back(Vector3((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str())));
+		else if (tokens[0] == "vt" && tokens.size() >= 3)
+			indexed_uvs.push_back(Vector2((float)atof(tokens[1].c_str()), 1.0 - (float)atof(tokens[2].c_str())));
+		else if (tokens[0] == "vn" && tokens.size() == 4)
+			indexed_normals.push_back(Vector3((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str())));
+		else if (tokens[0] == "f" && tokens.size() >= 4)
+		{
+			Vector3 v1, v2, v3;
+			v1.parseFromText(tokens[1].c_str(), '/');
+			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
+			{
+				v2.parseFromText(tokens[iPoly].c_str(), '/');
+				v3.parseFromText(tokens[iPoly + 1].c_str(), '/');
+				vertices.push_back(indexed_positions[(unsigned int)(v1.x) - 1]);
+				vertices.push_back(indexed_positions[(unsigned int)(v2.x) - 1]);
+				vertices.push_back(indexed_positions[(unsigned int)(v3.x) - 1]);
+				if (indexed_uvs.size() > 0)
+				{
+					uvs.push_back(indexed_uvs[(unsigned int)(v1.y) - 1]);
+					uvs.push_back(indexed_uvs[(unsigned int)(v2.y) - 1]);
+					uvs.push_back(indexed_uvs[(unsigned int)(v3.y) - 1]);
+				}
+				if (indexed_normals.size() > 0)
+				{
+					normals.push_back(indexed_normals[(unsigned int)(v1.z) - 1]);
+					normals.push_back(indexed_normals[(unsigned int)(v2.z) - 1]);
+					normals.push_back(indexed_normals[(unsigned int)(v3.z) - 1]);
+				}
+			}
+		}
+	}
+	return (int)vertices.size() / 3;
+}
+
+int main()
+{
+	int num_positions = (N + 1) * (N + 1);
+
+	//both parsers with the same file, the old one needs absolute indices
+	std::string absolute_text = buildOBJ(false);
+	std::vector<Vector3> reference_vertices, reference_normals;
+	std::vector<Vector2> reference_uvs;
+	double start = testTime();
+	int reference_triangles = referenceParseOBJ(absolute_text, reference_vertices, reference_uvs, reference_normals);
+	double reference_time = testTime() - start;
+
+	TaskManager::background.startThreads();
+	sOBJData absolute_obj;
+	start = testTime();
+	parseOBJ(absolute_text.data(), absolute_text.size(), absolute_obj);
+	double absolute_time = testTime() - start;
+
+	std::string text = buildOBJ(true);
+	sOBJData obj;
+	start = testTime();
+	bool result = parseOBJ(text.data(), text.size(), obj);
+	double time = testTime() - start;
+	printf("%.1f MB, %d vertices, %d triangles with %d workers\n", text.size() / 1048576.0, (int)obj.positions.size(),
+		(int)obj.indices.size() / 3, TaskManager::background.getNumWorkers());
+	printf("sequential (old loadOBJ) %8.1f ms (%4.0f MB/s)\n", reference_time / 1000.0, absolute_text.size() / reference_time);
+	printf("chunked                  %8.1f ms (%4.0f MB/s), %.1fx faster\n", absolute_time / 1000.0, absolute_text.size() / absolute_time, reference_time / absolute_time);
+	printf("chunked, relative        %8.1f ms (%4.0f MB/s)\n", time / 1000.0, text.size() / time);
+	TaskManager::background.stopThreads();
+
+	CHECK(reference_triangles == N * N * 2);
+	CHECK(absolute_obj.indices == obj.indices);
+
+	CHECK(result);
+	CHECK(obj.positions.size() == num_positions);
+	CHECK(obj.uvs.size() == num_positions);
+	CHECK(obj.normals.size() == num_positions);
+	CHECK(obj.indices.size() == N * N * 6);
+	CHECK(obj.submeshes.size() == 2);
+	if (obj.submeshes.size() == 2)
+	{
+		CHECK(strcmp(obj.submeshes[0].name, "top") == 0);
+		CHECK(strcmp(obj.submeshes[1].material, "bottom") == 0);
+		CHECK(obj.submeshes[1].start == N * N * 3 && obj.submeshes[1].length == N * N * 3);
+	}
+	if (!test_failures)
+	{
+		//the quad x,y is two triangles, every corner must be the position written in that place
+		int num_wrong = 0;
+		for (int y = 0; y < N; ++y)
+			for (int x = 0; x < N; ++x)
+			{
+				const unsigned int* quad = &obj.indices[(y * N + x) * 6];
+				Vector3 expected[6] = { gridPosition(x, y), gridPosition(x + 1, y), gridPosition(x + 1, y + 1), gridPosition(x, y), gridPosition(x + 1, y + 1), gridPosition(x, y + 1) };
+				for (int k = 0; k < 6; ++k)
+					if (obj.positions[quad[k]].distance(expected[k]) > 0.001f)
+						num_wrong++;
+			}
+		CHECK(num_wrong == 0);
+	}
+
+	return test_failures;
+}
@@ -0,0 +1,9 @@
+#include "test.h"
+
+int test_failures = 0;
+
+//the camera checks the GL errors when it is enabled, the tests never enable it
+bool checkGLErrors()
+{
+	return true;
+}
@@ -0,0 +1,24 @@
+/*
+	Helpers for the headless tests and benchmarks (see tests/Makefile).
+	They only use the CPU code of the framework, there is no window nor GL context.
+*/
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <cstdio>
+#include <chrono>
+
+extern int test_failures;
+
+//reports the failure and keeps going, main returns the number of failures
+#define CHECK(cond) do { if (!(cond)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); test_failures++; } } while (0)
+
+//microseconds since the first call
+inline double testTime()
+{
+	static std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count() * 0.001;
+}
+
+#endif
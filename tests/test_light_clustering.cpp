@@ -0,0 +1,112 @@
+//bins random point and spot lights, the SIMD and threaded build must give the same result than the scalar one and
+//every point lit by a light must find it in its cluster. Prints the time of both builds
+
+#include "test.h"
+#include "clustering.h"
+#include "culling.h"
+#include "camera.h"
+#include "task.h"
+#include <algorithm>
+
+static const int NUM_REPETITIONS = 20;
+
+static void addRandomLights(LightClusters& clusters, Camera& camera, int num_lights, float area)
+{
+	for (int i = 0; i < num_lights; ++i)
+	{
+		Vector3 position = camera.eye + Vector3(random(area * 2.0f) - area, random(area * 2.0f) - area, random(area * 2.0f) - area);
+		float radius = random(area * 0.2f) + 1.0f;
+		if (i % 2)
+			clusters.addPointLight(position, radius);
+		else
+			clusters.addSpotLight(position, radius, Vector3(random(2.0f) - 1.0f, random(2.0f) - 1.0f, random(2.0f) - 1.0f), random(40.0f) + 10.0f);
+	}
+}
+
+int main()
+{
+	TaskManager::background.startThreads();
+
+	Camera camera;
+	camera.setPerspective(60.0f, 16.0f / 9.0f, 0.5f, 500.0f);
+	camera.lookAt(Vector3(10.0f, 20.0f, 30.0f), Vector3(50.0f, 10.0f, -40.0f), Vector3(0.0f, 1.0f, 0.0f));
+
+	const int num_lights[2] = { 512, 2000 };
+	for (int n = 0; n < 2; ++n)
+	{
+		LightClusters clusters;
+		clusters.begin(&camera);
+		addRandomLights(clusters, camera, num_lights[n], camera.far_plane * 0.25f);
+
+		double start = testTime();
+		for (int r = 0; r < NUM_REPETITIONS; ++r)
+			clusters.buildScalar();
+		double scalar_us = (testTime() - start) / NUM_REPETITIONS;
+		std::vector<uint32> reference_grid = clusters.grid;
+		std::vector<uint32> reference_indices = clusters.indices;
+
+		start = testTime();
+		for (int r = 0; r < NUM_REPETITIONS; ++r)
+			clusters.build();
+		double simd_us = (testTime() - start) / NUM_REPETITIONS;
+		CHECK(clusters.grid == reference_grid);
+		CHECK(clusters.indices == reference_indices);
+
+		int used_clusters = 0, max_lights = 0;
+		for (int i = 0; i < NUM_CLUSTERS; ++i)
+		{
+			int count = (int)clusters.grid[i * 2 + 1];
+			used_clusters += count ? 1 : 0;
+			max_lights = std::max(max_lights, count);
+		}
+#ifdef CULLING_SSE
+		const char* simd_name = "SSE";
+#else
+		const char* simd_name = "scalar";
+#endif
+		printf("%d lights: %d of %d clusters with lights (max %d), scalar %.0f us, %s and %d workers %.0f us\n", num_lights[n], used_clusters,
+			NUM_CLUSTERS, max_lights, scalar_us, simd_name, TaskManager::background.getNumWorkers(), simd_us);
+	}
+
+	//the binning is conservative: random points inside the lights, and inside the cone of the spots, must find the light in their cluster
+	LightClusters clusters;
+	clusters.begin(&camera);
+	addRandomLights(clusters, camera, 300, 100.0f);
+	clusters.build();
+	Vector3 front = (camera.center - camera.eye).normalize();
+	int num_tested = 0, num_missing = 0;
+	for (int i = 0; i < clusters.lights.size(); ++i)
+	{
+		const LightClusters::sLight& light = clusters.lights[i];
+		for (int k = 0; k < 2000; ++k)
+		{
+			Vector3 offset(random(2.0f) - 1.0f, random(2.0f) - 1.0f, random(2.0f) - 1.0f);
+			if (offset.length() > 1.0f)
+				continue;
+			Vector3 point = light.position + offset * light.radius;
+			Vector3 to_point = point - light.position;
+			if (light.spot && (to_point.length() < 1e-4f || to_point.dot(light.direction) < light.cos_angle * to_point.length()))
+				continue;
+
+			Vector4 clip = camera.viewprojection_matrix * Vector4(point, 1.0f);
+			if (clip.w <= 0.0f)
+				continue;
+			float x = clip.x / clip.w, y = clip.y / clip.w, z = clip.z / clip.w;
+			if (fabsf(x) >= 1.0f || fabsf(y) >= 1.0f || fabsf(z) >= 1.0f)
+				continue;
+			int cluster = clusters.getCluster((int)((x * 0.5f + 0.5f) * CLUSTERS_X), (int)((y * 0.5f + 0.5f) * CLUSTERS_Y), clusters.getSlice((point - camera.eye).dot(front)));
+
+			bool found = false;
+			for (uint32 j = 0; j < clusters.grid[cluster * 2 + 1]; ++j)
+				found = found || clusters.indices[clusters.grid[cluster * 2] + j] == (uint32)i;
+			num_tested++;
+			num_missing += !found;
+		}
+	}
+	printf("%d points inside the lights, %d without the light in their cluster\n", num_tested, num_missing);
+	CHECK(num_tested > 0);
+	CHECK(num_missing == 0);
+
+	TaskManager::background.stopThreads();
+	return test_failures;
+}
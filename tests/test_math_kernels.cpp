@@ -0,0 +1,188 @@
+//compares the SIMD math kernels with plain scalar code on random models and prints the time of both.
+//The results do not need to be the same bits (the compiler can contract the scalar code in FMAs), the error must be
+//within a few ulps of the magnitude of the terms summed, which is what rounding can change
+
+#include "test.h"
+#include "framework.h"
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+static const int COUNT = 100000;
+static const int NUM_REPETITIONS = 20;
+static const float MAX_ULPS = 8.0f; //in units of the sum of the absolute values of the terms
+
+//the scalar code used before the SIMD kernels, row vectors like Matrix44
+static void referenceMultiply(const Matrix44& a, const Matrix44& b, Matrix44& result, Matrix44& magnitude)
+{
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+		{
+			result.M[i][j] = 0.0f;
+			magnitude.M[i][j] = 0.0f;
+			for (int k = 0; k < 4; k++)
+			{
+				result.M[i][j] += a.M[i][k] * b.M[k][j];
+				magnitude.M[i][j] += fabsf(a.M[i][k] * b.M[k][j]);
+			}
+		}
+}
+
+static Vector3 referenceTransform(const Matrix44& m, const Vector3& p, Vector3& magnitude)
+{
+	Vector3 result;
+	for (int j = 0; j < 3; ++j)
+	{
+		result.v[j] = m.m[j] * p.x + m.m[4 + j] * p.y + m.m[8 + j] * p.z + m.m[12 + j];
+		magnitude.v[j] = fabsf(m.m[j] * p.x) + fabsf(m.m[4 + j] * p.y) + fabsf(m.m[8 + j] * p.z) + fabsf(m.m[12 + j]);
+	}
+	return result;
+}
+
+//the 8 corners transformed, the magnitude bounds the terms of all of them
+static BoundingBox referenceTransformBoundingBox(const Matrix44& m, const BoundingBox& box, Vector3& magnitude)
+{
+	Vector3 box_min(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vector3 box_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	magnitude = Vector3();
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 c = box.center + Vector3(i & 1 ? box.halfsize.x : -box.halfsize.x, i & 2 ? box.halfsize.y : -box.halfsize.y, i & 4 ? box.halfsize.z : -box.halfsize.z);
+		Vector3 corner_magnitude;
+		Vector3 corner = referenceTransform(m, c, corner_magnitude);
+		box_min.setMin(corner);
+		box_max.setMax(corner);
+		magnitude.setMax(corner_magnitude);
+	}
+	Vector3 halfsize = (box_max - box_min) * 0.5f;
+	return BoundingBox(box_max - halfsize, halfsize);
+}
+
+//error of a value in ulps of the magnitude of its terms
+static float ulps(float value, float reference, float magnitude)
+{
+	return fabsf(value - reference) / (std::max(magnitude, FLT_MIN) * FLT_EPSILON);
+}
+
+int main()
+{
+	//random models: rotation, scale and translation
+	std::vector<Matrix44> models(COUNT), results(COUNT), references(COUNT), magnitudes(COUNT);
+	std::vector<BoundingBox> boxes(COUNT), result_boxes(COUNT);
+	std::vector<Vector3> points(COUNT), result_points(COUNT);
+	for (int i = 0; i < COUNT; ++i)
+	{
+		models[i].setTranslation(random(200.0f) - 100.0f, random(200.0f) - 100.0f, random(200.0f) - 100.0f);
+		models[i].rotate(random(6.28f), Vector3(random(1.0f) - 0.5f, random(1.0f) - 0.5f, random(1.0f) + 0.1f).normalize());
+		models[i].scale(random(2.0f) + 0.1f, random(2.0f) + 0.1f, random(2.0f) + 0.1f);
+		boxes[i] = BoundingBox(Vector3(random(1.0f) - 0.5f, random(1.0f) - 0.5f, random(1.0f) - 0.5f), Vector3(random(1.0f) + 0.1f, random(1.0f) + 0.1f, random(1.0f) + 0.1f));
+		points[i] = Vector3(random(20.0f) - 10.0f, random(20.0f) - 10.0f, random(20.0f) - 10.0f);
+	}
+	Matrix44 parent = models[0];
+
+	//products
+	double start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		for (int i = 0; i < COUNT; ++i)
+			referenceMultiply(models[i], parent, references[i], magnitudes[i]);
+	double reference_us = (testTime() - start) / NUM_REPETITIONS;
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		multiplyMatrices(&models[0], parent, &results[0], COUNT);
+	double batched_us = (testTime() - start) / NUM_REPETITIONS;
+	float max_ulps = 0.0f;
+	int num_exact = 0;
+	for (int i = 0; i < COUNT; ++i)
+	{
+		Matrix44 single = models[i] * parent;
+		for (int j = 0; j < 16; ++j)
+		{
+			max_ulps = std::max(max_ulps, ulps(results[i].m[j], references[i].m[j], magnitudes[i].m[j]));
+			max_ulps = std::max(max_ulps, ulps(single.m[j], references[i].m[j], magnitudes[i].m[j]));
+		}
+		num_exact += memcmp(results[i].m, references[i].m, sizeof(Matrix44)) == 0;
+	}
+	printf("multiply      reference %7.0f us, batched %7.0f us, max error %.2f ulps, %d of %d the same bits\n", reference_us, batched_us, max_ulps, num_exact, COUNT);
+	CHECK(max_ulps <= MAX_ULPS);
+
+	//points
+	transformPoints(models[0], &points[0], &result_points[0], COUNT);
+	max_ulps = 0.0f;
+	for (int i = 0; i < COUNT; ++i)
+	{
+		Vector3 magnitude;
+		Vector3 reference = referenceTransform(models[0], points[i], magnitude);
+		Vector3 single = models[0] * points[i];
+		for (int j = 0; j < 3; ++j)
+		{
+			max_ulps = std::max(max_ulps, ulps(result_points[i].v[j], reference.v[j], magnitude.v[j]));
+			max_ulps = std::max(max_ulps, ulps(single.v[j], reference.v[j], magnitude.v[j]));
+		}
+	}
+	printf("points        max error %.2f ulps\n", max_ulps);
+	CHECK(max_ulps <= MAX_ULPS);
+
+	//bounding boxes, the kernels use the center and |M| * halfsize instead of the corners
+	std::vector<BoundingBox> reference_boxes(COUNT);
+	std::vector<Vector3> box_magnitudes(COUNT);
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		for (int i = 0; i < COUNT; ++i)
+			reference_boxes[i] = referenceTransformBoundingBox(models[i], boxes[i], box_magnitudes[i]);
+	reference_us = (testTime() - start) / NUM_REPETITIONS;
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		transformBoundingBoxes(&models[0], &boxes[0], &result_boxes[0], COUNT);
+	batched_us = (testTime() - start) / NUM_REPETITIONS;
+	max_ulps = 0.0f;
+	for (int i = 0; i < COUNT; ++i)
+	{
+		BoundingBox single = transformBoundingBox(models[i], boxes[i]);
+		for (int j = 0; j < 3; ++j)
+		{
+			float magnitude = box_magnitudes[i].v[j];
+			max_ulps = std::max(max_ulps, ulps(result_boxes[i].center.v[j], reference_boxes[i].center.v[j], magnitude));
+			max_ulps = std::max(max_ulps, ulps(result_boxes[i].halfsize.v[j], reference_boxes[i].halfsize.v[j], magnitude));
+			max_ulps = std::max(max_ulps, ulps(single.center.v[j], reference_boxes[i].center.v[j], magnitude));
+			max_ulps = std::max(max_ulps, ulps(single.halfsize.v[j], reference_boxes[i].halfsize.v[j], magnitude));
+		}
+	}
+	printf("bounding box  reference %7.0f us, batched %7.0f us, max error %.2f ulps\n", reference_us, batched_us, max_ulps);
+	CHECK(max_ulps <= MAX_ULPS);
+
+	//both inverses must give the identity, the general one (gaussian elimination) is the less precise with translations
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		for (int i = 0; i < COUNT; ++i)
+		{
+			references[i] = models[i];
+			references[i].inverse();
+		}
+	double general_us = (testTime() - start) / NUM_REPETITIONS;
+	start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+		for (int i = 0; i < COUNT; ++i)
+		{
+			results[i] = models[i];
+			results[i].inverseAffine();
+		}
+	double affine_us = (testTime() - start) / NUM_REPETITIONS;
+	float general_error = 0.0f, affine_error = 0.0f;
+	for (int i = 0; i < COUNT; ++i)
+	{
+		Matrix44 general_identity = models[i] * references[i];
+		Matrix44 affine_identity = models[i] * results[i];
+		for (int j = 0; j < 16; ++j)
+		{
+			general_error = std::max(general_error, fabsf(general_identity.m[j] - Matrix44::IDENTITY.m[j]));
+			affine_error = std::max(affine_error, fabsf(affine_identity.m[j] - Matrix44::IDENTITY.m[j]));
+		}
+	}
+	printf("inverse       general %7.0f us, affine %7.0f us, max error general %g, affine %g\n", general_us, affine_us, general_error, affine_error);
+	CHECK(affine_error < 1e-4f);
+	CHECK(affine_error <= general_error);
+
+	return test_failures;
+}
@@ -0,0 +1,103 @@
+//optimizes a shuffled grid and prints the vertex cache stats of every step, the triangles must be the same at the end
+//then simplifies it, the error is a distance relative to the size of the grid whatever the number of triangles
+
+#include "test.h"
+#include "mesh_optimizer.h"
+#include <algorithm>
+#include <array>
+#include <random>
+
+typedef std::array<unsigned int, 3> Triangle;
+
+//same first vertex for the same triangle, keeping the winding
+static Triangle canonical(unsigned int a, unsigned int b, unsigned int c)
+{
+	Triangle t = { a, b, c };
+	while (t[0] > t[1] || t[0] > t[2])
+		t = { t[1], t[2], t[0] };
+	return t;
+}
+
+static void printStats(const char* step, const std::vector<unsigned int>& indices, int num_vertices)
+{
+	sVertexCacheStats stats = analyzeVertexCache(&indices[0], (int)indices.size(), num_vertices);
+	printf("%-10s ACMR %.3f ATVR %.3f\n", step, stats.acmr, stats.atvr);
+}
+
+int main()
+{
+	const int N = 100;
+	std::vector<Vector3> positions;
+	std::vector<unsigned int> grid;
+	for (int y = 0; y <= N; ++y)
+		for (int x = 0; x <= N; ++x)
+			positions.push_back(Vector3((float)x, (float)y, sin(x * 0.3f) * 3.0f));
+	for (int y = 0; y < N; ++y)
+		for (int x = 0; x < N; ++x)
+		{
+			unsigned int a = y * (N + 1) + x, b = a + 1, c = a + N + 1, d = c + 1;
+			unsigned int quad[6] = { a, b, c, b, d, c };
+			grid.insert(grid.end(), quad, quad + 6);
+		}
+	int num_vertices = (int)positions.size();
+
+	//the worst case for the cache, the triangles in random order
+	std::vector<int> order(grid.size() / 3);
+	for (int i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::shuffle(order.begin(), order.end(), std::mt19937(1));
+	std::vector<unsigned int> indices;
+	for (int t : order)
+		indices.insert(indices.end(), &grid[t * 3], &grid[t * 3] + 3);
+	printStats("shuffled", indices, num_vertices);
+	sVertexCacheStats shuffled = analyzeVertexCache(&indices[0], (int)indices.size(), num_vertices);
+
+	double start = testTime();
+	optimizeVertexCache(&indices[0], (int)indices.size(), num_vertices);
+	printStats("cache", indices, num_vertices);
+	sVertexCacheStats cache = analyzeVertexCache(&indices[0], (int)indices.size(), num_vertices);
+	optimizeOverdraw(&indices[0], (int)indices.size(), &positions[0], num_vertices);
+	printStats("overdraw", indices, num_vertices);
+	sVertexCacheStats overdraw = analyzeVertexCache(&indices[0], (int)indices.size(), num_vertices);
+	std::vector<int> remap;
+	int num_used = optimizeVertexFetch(&indices[0], (int)indices.size(), num_vertices, remap);
+	printStats("fetch", indices, num_used);
+	printf("%d triangles optimized in %.0f us\n", (int)indices.size() / 3, testTime() - start);
+
+	CHECK(cache.acmr < shuffled.acmr * 0.5f);
+	CHECK(cache.acmr < 0.8f);
+	CHECK(overdraw.acmr <= cache.acmr * 1.1f); //the threshold is per cluster, the borders between clusters add a bit more
+	CHECK(num_used == num_vertices);
+
+	//the same triangles with the same winding
+	std::vector<int> inverse(num_used);
+	for (int i = 0; i < remap.size(); ++i)
+		if (remap[i] != -1)
+			inverse[remap[i]] = i;
+	std::vector<Triangle> before, after;
+	for (int i = 0; i < grid.size(); i += 3)
+		before.push_back(canonical(grid[i], grid[i + 1], grid[i + 2]));
+	for (int i = 0; i < indices.size(); i += 3)
+		after.push_back(canonical(inverse[indices[i]], inverse[indices[i + 1]], inverse[indices[i + 2]]));
+	std::sort(before.begin(), before.end());
+	std::sort(after.begin(), after.end());
+	CHECK(before == after);
+
+	//the waves are 6 units high in a grid of 100, so no simplification can be further than that from the surface
+	std::vector<unsigned int> simplified;
+	float error = 0.0f;
+	simplifyMesh(simplified, &grid[0], (int)grid.size(), &positions[0], num_vertices, (int)grid.size() / 4, 0.1f, &error);
+	printf("simplified to %d triangles, error %.4f\n", (int)simplified.size() / 3, error);
+	CHECK(simplified.size() <= grid.size() / 4);
+	CHECK(error > 0.0f && error <= 0.06f);
+
+	//a flat grid collapses without error
+	std::vector<Vector3> flat(positions);
+	for (Vector3& p : flat)
+		p.z = 0.0f;
+	simplifyMesh(simplified, &grid[0], (int)grid.size(), &flat[0], num_vertices, (int)grid.size() / 4, 0.1f, &error);
+	CHECK(simplified.size() <= grid.size() / 4);
+	CHECK(error < 1e-4f);
+
+	return test_failures;
+}
@@ -0,0 +1,118 @@
+//splits a sphere in meshlets, checks their limits and bounds and that culling never removes a triangle that can be seen,
+//also with a mirrored model. Prints the time to cull all the meshlets
+
+#include "test.h"
+#include "mesh_optimizer.h"
+#include "camera.h"
+#include <algorithm>
+
+static const int NUM_ITERATIONS = 1000;
+
+//the triangle faces the eye with the winding it has once transformed
+static bool isFrontFacing(const Vector3& a, const Vector3& b, const Vector3& c, const Vector3& eye)
+{
+	return (b - a).cross(c - a).dot(eye - a) > 0.0f;
+}
+
+static bool isInRanges(int index, const std::vector<sIndexRange>& ranges)
+{
+	for (const sIndexRange& range : ranges)
+		if (index >= range.start && index < range.start + range.length)
+			return true;
+	return false;
+}
+
+int main()
+{
+	//uv sphere of radius 1, with the triangles facing outwards
+	const int ROWS = 64, COLUMNS = 128;
+	std::vector<Vector3> positions;
+	std::vector<unsigned int> indices;
+	for (int r = 0; r <= ROWS; ++r)
+		for (int c = 0; c < COLUMNS; ++c)
+		{
+			float theta = (float)M_PI * r / ROWS, phi = 2.0f * (float)M_PI * c / COLUMNS;
+			positions.push_back(Vector3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+		}
+	for (int r = 0; r < ROWS; ++r)
+		for (int c = 0; c < COLUMNS; ++c)
+		{
+			unsigned int a = r * COLUMNS + c, b = r * COLUMNS + (c + 1) % COLUMNS;
+			unsigned int d = a + COLUMNS, e = b + COLUMNS;
+			unsigned int quad[6] = { a, b, d, b, e, d };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	int num_vertices = (int)positions.size();
+	int num_indices = (int)indices.size();
+	optimizeVertexCache(&indices[0], num_indices, num_vertices);
+
+	std::vector<sMeshlet> meshlets;
+	buildMeshlets(meshlets, &indices[0], 0, num_indices, &positions[0], num_vertices);
+	printf("%d triangles in %d meshlets\n", num_indices / 3, (int)meshlets.size());
+
+	//they cover all the triangles once, in order, within the limits and their bounds
+	int next = 0;
+	int num_cullable = 0;
+	for (const sMeshlet& meshlet : meshlets)
+	{
+		CHECK(meshlet.start == next);
+		CHECK(meshlet.length > 0 && meshlet.length <= MESHLET_MAX_TRIANGLES * 3);
+		next = meshlet.start + meshlet.length;
+
+		std::vector<unsigned int> used(&indices[meshlet.start], &indices[meshlet.start + meshlet.length]);
+		std::sort(used.begin(), used.end());
+		CHECK(std::unique(used.begin(), used.end()) - used.begin() <= MESHLET_MAX_VERTICES);
+		for (unsigned int v : used)
+			CHECK(positions[v].distance(meshlet.center) <= meshlet.radius * 1.001f);
+		num_cullable += meshlet.cone_cutoff < 1.0f;
+	}
+	CHECK(next == num_indices);
+	CHECK(num_cullable > (int)meshlets.size() / 2);
+
+	Camera camera;
+	camera.setPerspective(60.0f, 1.0f, 0.1f, 100.0f);
+	camera.lookAt(Vector3(0.0f, 0.0f, 5.0f), Vector3(0.0f, 0.0f, 0.0f), Vector3(0.0f, 1.0f, 0.0f));
+
+	//a mirror flips the winding: the same meshlets are seen from the other side so they cannot be culled with the cones
+	Matrix44 models[2];
+	Matrix44 mirror;
+	mirror.setScale(-1.0f, 1.0f, 1.0f);
+	models[1] = mirror;
+	const char* names[2] = { "model", "mirrored" };
+
+	std::vector<sIndexRange> ranges;
+	for (int m = 0; m < 2; ++m)
+	{
+		const Matrix44& model = models[m];
+		int num_visible = cullMeshlets(ranges, &meshlets[0], (int)meshlets.size(), model, &camera, true);
+
+		double start = testTime();
+		for (int i = 0; i < NUM_ITERATIONS; ++i)
+			cullMeshlets(ranges, &meshlets[0], (int)meshlets.size(), model, &camera, true);
+		double time = (testTime() - start) / NUM_ITERATIONS;
+		printf("%-10s %d of %d triangles visible in %d ranges, culled in %.2f us\n", names[m], num_visible / 3, num_indices / 3, (int)ranges.size(), time);
+
+		int num_missing = 0;
+		for (int i = 0; i < num_indices; i += 3)
+		{
+			Vector3 a = model * positions[indices[i]];
+			Vector3 b = model * positions[indices[i + 1]];
+			Vector3 c = model * positions[indices[i + 2]];
+			if (isFrontFacing(a, b, c, camera.eye) && !isInRanges(i, ranges))
+				num_missing++;
+		}
+		CHECK(num_missing == 0);
+		if (m == 0)
+			CHECK(num_visible < num_indices * 3 / 4); //about half of the sphere faces away
+		else
+			CHECK(num_visible == num_indices); //all of it is inside the frustum
+	}
+
+	//moved away from the camera nothing is visible
+	Matrix44 behind;
+	behind.setTranslation(0.0f, 0.0f, 10.0f);
+	CHECK(cullMeshlets(ranges, &meshlets[0], (int)meshlets.size(), behind, &camera, true) == 0);
+	CHECK(ranges.empty());
+
+	return test_failures;
+}
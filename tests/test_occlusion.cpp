@@ -0,0 +1,99 @@
+//rasterizes a wall in front of the camera and tests boxes around it, then prints the time to rasterize
+//many small occluders and to test boxes against them
+
+#include "test.h"
+#include "occlusion.h"
+#include "camera.h"
+#include "task.h"
+
+static const int NUM_REPETITIONS = 20;
+
+struct sBoxCase {
+	const char* name;
+	Vector3 center;
+	Vector3 halfsize;
+	bool visible;
+};
+
+int main()
+{
+	TaskManager::background.startThreads();
+
+	Camera camera;
+	camera.setPerspective(70.0f, 2.0f, 0.1f, 1000.0f);
+	camera.lookAt(Vector3(0.0f, 1.0f, 0.0f), Vector3(0.0f, 1.0f, 10.0f), Vector3(0.0f, 1.0f, 0.0f));
+
+	//a wall at z=10, x in [-5,5] and y in [-1,5]
+	Vector3 wall[4] = { Vector3(-5.0f, -1.0f, 10.0f), Vector3(5.0f, -1.0f, 10.0f), Vector3(5.0f, 5.0f, 10.0f), Vector3(-5.0f, 5.0f, 10.0f) };
+	unsigned int wall_indices[6] = { 0, 1, 2, 0, 2, 3 };
+	OcclusionBuffer buffer;
+	buffer.begin(&camera);
+	buffer.addOccluder(Matrix44(), wall, wall_indices, 6, true);
+	buffer.rasterize();
+	CHECK(buffer.num_occluders == 1);
+	CHECK(buffer.num_triangles == 2);
+	int num_filled = 0;
+	for (float d : buffer.depth)
+		num_filled += d > 0.0f;
+	CHECK(num_filled > 0 && num_filled < (int)buffer.depth.size());
+
+	sBoxCase cases[] = {
+		{ "behind", Vector3(0.0f, 1.0f, 20.0f), Vector3(1.0f, 1.0f, 1.0f), false },
+		{ "in front", Vector3(0.0f, 1.0f, 5.0f), Vector3(1.0f, 1.0f, 1.0f), true },
+		{ "crossing", Vector3(0.0f, 1.0f, 10.5f), Vector3(1.0f, 1.0f, 1.0f), true },
+		{ "the wall", Vector3(0.0f, 1.0f, 10.0f), Vector3(5.0f, 3.0f, 0.01f), true },
+		{ "beside", Vector3(12.0f, 1.0f, 20.0f), Vector3(1.0f, 1.0f, 1.0f), true },
+		{ "partially behind", Vector3(10.5f, 1.0f, 20.0f), Vector3(1.0f, 1.0f, 1.0f), true },
+		{ "above", Vector3(0.0f, 12.0f, 20.0f), Vector3(1.0f, 1.0f, 1.0f), true },
+		{ "behind the camera", Vector3(0.0f, 1.0f, -5.0f), Vector3(1.0f, 1.0f, 1.0f), true },
+	};
+	for (const sBoxCase& box_case : cases)
+	{
+		bool visible = buffer.testBox(BoundingBox(box_case.center, box_case.halfsize));
+		if (visible != box_case.visible)
+			printf("FAILED %s: %s\n", box_case.name, visible ? "visible" : "hidden");
+		test_failures += visible != box_case.visible;
+	}
+
+	//one sided occluders are only rasterized from the front, the wall is counter clockwise seen from the camera
+	buffer.begin(&camera);
+	buffer.addOccluder(Matrix44(), wall, wall_indices, 6, false);
+	unsigned int back_indices[6] = { 0, 2, 1, 0, 3, 2 };
+	buffer.addOccluder(Matrix44(), wall, back_indices, 6, false);
+	buffer.rasterize();
+	CHECK(buffer.num_triangles == 2);
+
+	//random small triangles, the boxes are tested in a wider area so some are not behind them
+	std::vector<Vector3> positions;
+	std::vector<unsigned int> indices;
+	for (int i = 0; i < 20000; ++i)
+	{
+		Vector3 origin(random(40.0f) - 20.0f, random(10.0f), 8.0f + random(60.0f));
+		for (int k = 0; k < 3; ++k)
+		{
+			indices.push_back((unsigned int)positions.size());
+			positions.push_back(origin + Vector3(random(4.0f) - 2.0f, random(4.0f) - 2.0f, random(2.0f)));
+		}
+	}
+	double start = testTime();
+	for (int r = 0; r < NUM_REPETITIONS; ++r)
+	{
+		buffer.begin(&camera);
+		buffer.addOccluder(Matrix44(), &positions[0], &indices[0], (int)indices.size(), true);
+		buffer.rasterize();
+	}
+	double rasterize_us = (testTime() - start) / NUM_REPETITIONS;
+
+	const int NUM_BOXES = 10000;
+	int num_hidden = 0;
+	start = testTime();
+	for (int i = 0; i < NUM_BOXES; ++i)
+		num_hidden += !buffer.testBox(BoundingBox(Vector3(random(120.0f) - 60.0f, random(10.0f), 20.0f + random(80.0f)), Vector3(0.5f, 0.5f, 0.5f)));
+	double test_us = testTime() - start;
+	printf("%d triangles rasterized in %.0f us, %d boxes tested in %.0f us (%d hidden) with %d workers\n",
+		buffer.num_triangles, rasterize_us, NUM_BOXES, test_us, num_hidden, TaskManager::background.getNumWorkers());
+	CHECK(num_hidden > 0 && num_hidden < NUM_BOXES);
+
+	TaskManager::background.stopThreads();
+	return test_failures;
+}